@@ -0,0 +1,184 @@
+# Builds the servers and perf_suite three ways and reports what LTO and PGO
+# gain over a plain Release build:
+#
+#   cmake -DBUILD_DIR=<dir> [-DGENERATOR=<generator>] [-DROUNDS=3]
+#         [-DDURATION_MS=3000] [-DCMAKE_ARGS=<more configure args>]
+#         -P cmake/pgo.cmake
+#
+# <dir>/release is a Release build and <dir>/lto-only adds GRPCTEST_LTO.
+# <dir>/pgo is built with LTO and GRPCTEST_PGO=GENERATE, and the perf scenarios
+# are run against it to train the profile: every async server under Greeter
+# load, with perf_suite as the client. It's then configured again with
+# GRPCTEST_PGO=USE and rebuilt with the profile.
+#
+# The three builds take turns running the scenarios for ROUNDS rounds, and the
+# median of each metric is written to <dir>/report.txt. Run it on an otherwise
+# idle machine, the numbers are only as steady as it is.
+
+# string(JSON) needs 3.19, unlike the build itself.
+cmake_minimum_required(VERSION 3.19)
+
+if(NOT BUILD_DIR)
+	message(FATAL_ERROR "Usage: cmake -DBUILD_DIR=<dir> -P cmake/pgo.cmake")
+endif()
+get_filename_component(BUILD_DIR ${BUILD_DIR} ABSOLUTE)
+get_filename_component(SOURCE_DIR ${CMAKE_CURRENT_LIST_DIR}/.. ABSOLUTE)
+if(NOT DURATION_MS)
+	set(DURATION_MS 3000)
+endif()
+if(NOT ROUNDS)
+	set(ROUNDS 3)
+endif()
+set(TARGETS perf_suite server server_stream server_stream_client
+	server_stream_bidir)
+set(SCENARIOS unary server_stream client_stream bidi)
+set(GENERATOR_ARGS)
+if(GENERATOR)
+	set(GENERATOR_ARGS -G ${GENERATOR})
+endif()
+
+function(run)
+	execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		string(REPLACE ";" " " command "${ARGN}")
+		message(FATAL_ERROR "Failed (${result}): ${command}")
+	endif()
+endfunction()
+
+# Configures and builds dir with the Release configuration and args.
+function(build dir)
+	run(${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${dir} ${GENERATOR_ARGS}
+		-DCMAKE_BUILD_TYPE=Release ${CMAKE_ARGS} ${ARGN})
+	foreach(target ${TARGETS})
+		run(${CMAKE_COMMAND} --build ${dir} --config Release --target ${target})
+	endforeach()
+endfunction()
+
+# Where the executables of dir are, multi-config generators add Release.
+function(bin_dir dir out)
+	if(EXISTS ${dir}/Release)
+		set(${out} ${dir}/Release PARENT_SCOPE)
+	else()
+		set(${out} ${dir} PARENT_SCOPE)
+	endif()
+endfunction()
+
+# Runs every scenario against the build in dir, writing the results to
+# <dir>/perf/<name>-<scenario>.json.
+function(measure dir name)
+	bin_dir(${dir} bin)
+	file(MAKE_DIRECTORY ${dir}/perf)
+	foreach(scenario ${SCENARIOS})
+		execute_process(
+			COMMAND ${bin}/perf_suite --scenario=${scenario} --bin-dir=${bin}
+				--duration-ms=${DURATION_MS}
+				--out=${dir}/perf/${name}-${scenario}.json
+			OUTPUT_VARIABLE output
+			ERROR_VARIABLE output
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "${scenario} failed (${result}):\n${output}")
+		endif()
+	endforeach()
+endfunction()
+
+# Median over the rounds of a metric measured in dir, as an integer.
+function(median dir scenario metric out)
+	set(values)
+	foreach(round RANGE 1 ${ROUNDS})
+		file(READ ${dir}/perf/${round}-${scenario}.json json)
+		string(JSON value GET ${json} metrics ${metric})
+		string(REGEX REPLACE "\\..*" "" value ${value})
+		list(APPEND values ${value})
+	endforeach()
+	list(LENGTH values count)
+	math(EXPR middle "${count} / 2")
+	foreach(value ${values})
+		set(below 0)
+		set(same 0)
+		foreach(other ${values})
+			if(other LESS value)
+				math(EXPR below "${below} + 1")
+			elseif(other EQUAL value)
+				math(EXPR same "${same} + 1")
+			endif()
+		endforeach()
+		math(EXPR above "${below} + ${same}")
+		if(NOT middle LESS below AND middle LESS above)
+			set(${out} ${value} PARENT_SCOPE)
+			return()
+		endif()
+	endforeach()
+endfunction()
+
+set(RELEASE_DIR ${BUILD_DIR}/release)
+set(LTO_DIR ${BUILD_DIR}/lto-only)
+set(PGO_DIR ${BUILD_DIR}/pgo)
+set(REPORT ${BUILD_DIR}/report.txt)
+set(PROFILE_DIR ${PGO_DIR}/pgo-profile)
+file(REMOVE ${REPORT})
+
+message(STATUS "Release build in ${RELEASE_DIR}")
+build(${RELEASE_DIR} -DGRPCTEST_LTO=OFF -DGRPCTEST_PGO=OFF)
+message(STATUS "LTO build in ${LTO_DIR}")
+build(${LTO_DIR} -DGRPCTEST_LTO=ON -DGRPCTEST_PGO=OFF)
+
+message(STATUS "Instrumented build in ${PGO_DIR}")
+file(REMOVE_RECURSE ${PROFILE_DIR})
+build(${PGO_DIR} -DGRPCTEST_LTO=ON -DGRPCTEST_PGO=GENERATE
+	-DPGO_PROFILE_DIR=${PROFILE_DIR})
+message(STATUS "Training the profile")
+measure(${PGO_DIR} training)
+file(GLOB RAW_PROFILES ${PROFILE_DIR}/*.profraw)
+if(RAW_PROFILES)
+	find_program(LLVM_PROFDATA llvm-profdata)
+	if(NOT LLVM_PROFDATA)
+		message(FATAL_ERROR "llvm-profdata is needed to merge Clang's profiles")
+	endif()
+	run(${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/default.profdata
+		${RAW_PROFILES})
+endif()
+message(STATUS "Optimized build in ${PGO_DIR}")
+build(${PGO_DIR} -DGRPCTEST_LTO=ON -DGRPCTEST_PGO=USE)
+
+# The builds take turns so that the machine drifting affects them alike.
+foreach(round RANGE 1 ${ROUNDS})
+	message(STATUS "Measuring, round ${round} of ${ROUNDS}")
+	foreach(dir ${RELEASE_DIR} ${LTO_DIR} ${PGO_DIR})
+		measure(${dir} ${round})
+	endforeach()
+endforeach()
+
+set(report "Medians of ${ROUNDS} rounds, change from Release in brackets\n")
+foreach(scenario ${SCENARIOS})
+	file(READ ${RELEASE_DIR}/perf/1-${scenario}.json json)
+	string(JSON metrics GET ${json} metrics)
+	string(JSON count LENGTH ${metrics})
+	math(EXPR last "${count} - 1")
+	foreach(i RANGE ${last})
+		string(JSON metric MEMBER ${metrics} ${i})
+		median(${RELEASE_DIR} ${scenario} ${metric} release)
+		string(APPEND report "${scenario} ${metric}: Release ${release}")
+		foreach(build "LTO" "LTO+PGO")
+			if(build STREQUAL "LTO")
+				median(${LTO_DIR} ${scenario} ${metric} value)
+			else()
+				median(${PGO_DIR} ${scenario} ${metric} value)
+			endif()
+			# Tenths of a percent, as math() only does integers.
+			math(EXPR change "(${value} - ${release}) * 1000 / ${release}")
+			set(sign "+")
+			if(change LESS 0)
+				set(sign "-")
+				math(EXPR change "-${change}")
+			endif()
+			math(EXPR whole "${change} / 10")
+			math(EXPR tenth "${change} % 10")
+			string(APPEND report
+				", ${build} ${value} (${sign}${whole}.${tenth}%)")
+		endforeach()
+		string(APPEND report "\n")
+	endforeach()
+endforeach()
+file(WRITE ${REPORT} "${report}")
+message("\n${report}\nWritten to ${REPORT}")
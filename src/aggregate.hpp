@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "recording.hpp"
+
+/// How AggregationEngine spreads and batches its work.
+struct AggregationOptions {
+	/// Shards of the global state, usually one per completion queue.
+	std::size_t shards = 1;
+	/// Requests a stream folds into its partial aggregate before merging it into
+	/// its shard, and so how stale a query can be.
+	std::size_t flush_every = 1024;
+};
+
+/// Aggregates the requests of many client streams into shared results.
+///
+/// What's computed is up to Aggregate, which has a default constructible
+/// `State` and
+/// - `static void Fold(State &, HelloRequest const &)` to add a request
+/// - `static void Merge(State &, State const &)` to add another state
+/// - `static void Describe(State const &, std::ostream &)` to print one
+///
+/// Each stream folds its requests into a partial State of its own without
+/// locking, then merges it into its shard every flush_every requests and when
+/// it ends. Each shard has its own lock, usually taken by the thread of one
+/// completion queue only, so there's no global lock.
+///
+/// Snapshot merges the shards one at a time and can be called at any time,
+/// while streams are still merging into them. It sees everything merged so
+/// far, and every shard as of some moment during the call.
+template <typename Aggregate> class AggregationEngine {
+public:
+	using State = typename Aggregate::State;
+
+	explicit AggregationEngine(AggregationOptions options)
+			: options(options), shards(std::max<std::size_t>(options.shards, 1)) {}
+
+	/// Merges partial into shard and clears it.
+	void Merge(std::size_t shard, State &partial) {
+		auto &s = shards[shard % shards.size()];
+		{
+			std::lock_guard l{s.mutex};
+			Aggregate::Merge(s.state, partial);
+			++s.merges;
+		}
+		partial = State{};
+	}
+
+	/// Everything merged so far.
+	State Snapshot() {
+		State snapshot;
+		for (auto &s : shards) {
+			std::lock_guard l{s.mutex};
+			Aggregate::Merge(snapshot, s.state);
+		}
+		return snapshot;
+	}
+	/// Times a partial has been merged into a shard.
+	std::uint64_t Merges() {
+		std::uint64_t merges = 0;
+		for (auto &s : shards) {
+			std::lock_guard l{s.mutex};
+			merges += s.merges;
+		}
+		return merges;
+	}
+	AggregationOptions const &Options() const { return options; }
+
+private:
+	/// On cache lines of their own so that threads merging into neighbouring
+	/// shards don't slow each other down.
+	struct alignas(64) Shard {
+		std::mutex mutex;
+		State state;
+		std::uint64_t merges = 0;
+	};
+	AggregationOptions options;
+	std::vector<Shard> shards;
+};
+
+/// Requests, bytes of names and the range of ids.
+struct Totals {
+	struct State {
+		std::uint64_t requests = 0;
+		std::uint64_t name_bytes = 0;
+		std::uint64_t min_id = std::numeric_limits<std::uint64_t>::max();
+		std::uint64_t max_id = 0;
+	};
+	static void Fold(State &state, helloworld::HelloRequest const &request) {
+		++state.requests;
+		state.name_bytes += request.name().size();
+		state.min_id = std::min(state.min_id, request.id());
+		state.max_id = std::max(state.max_id, request.id());
+	}
+	static void Merge(State &state, State const &other) {
+		state.requests += other.requests;
+		state.name_bytes += other.name_bytes;
+		state.min_id = std::min(state.min_id, other.min_id);
+		state.max_id = std::max(state.max_id, other.max_id);
+	}
+	static void Describe(State const &state, std::ostream &os) {
+		os << "requests: " << state.requests << " name bytes: " << state.name_bytes;
+		if (state.requests)
+			os << " ids: " << state.min_id << "-" << state.max_id;
+	}
+};
+
+/// How many times each name was sent.
+struct NameCounts {
+	struct State {
+		std::uint64_t requests = 0;
+		std::unordered_map<std::string, std::uint64_t> counts;
+	};
+	static void Fold(State &state, helloworld::HelloRequest const &request) {
+		++state.requests;
+		++state.counts[request.name()];
+	}
+	static void Merge(State &state, State const &other) {
+		state.requests += other.requests;
+		for (auto &[name, count] : other.counts) {
+			state.counts[name] += count;
+		}
+	}
+	/// Prints the 5 most frequent names.
+	static void Describe(State const &state, std::ostream &os) {
+		std::vector<std::pair<std::string, std::uint64_t>> top(
+				state.counts.begin(), state.counts.end());
+		auto n = std::min<std::size_t>(top.size(), 5);
+		std::partial_sort(top.begin(), top.begin() + n, top.end(),
+											[](auto &a, auto &b) { return a.second > b.second; });
+		os << "requests: " << state.requests << " names: " << state.counts.size();
+		for (std::size_t i = 0; i < n; ++i) {
+			os << (i ? ", " : " top: ") << top[i].first << " x" << top[i].second;
+		}
+	}
+};
+
+/// SayHellosClient, served by AsyncCall: folds every request into engine and
+/// replies with how many requests the stream sent in its id.
+///
+/// Whatever is left of the partial is merged when the call ends however it
+/// ends, so every request read counts, even from a stream that's cancelled or
+/// fails. A query while the stream is going sees it up to its last flush.
+/// @param shard Usually the index of the completion queue
+template <typename Aggregate> class AggregateSayHellosClient {
+public:
+	AggregateSayHellosClient(AggregationEngine<Aggregate> *engine,
+													 std::size_t shard)
+			: engine(engine), shard(shard) {}
+	/// AsyncCall deletes the call, and this with it, once it has ended.
+	~AggregateSayHellosClient() {
+		if (pending)
+			engine->Merge(shard, partial);
+	}
+	AggregateSayHellosClient(AggregateSayHellosClient const &) = delete;
+	AggregateSayHellosClient &
+	operator=(AggregateSayHellosClient const &) = delete;
+
+	grpc::Status OnRead(helloworld::HelloRequest const &request) {
+		Recorder::Get().Record(RecordedMethod::SayHellosClient, call, request);
+		Aggregate::Fold(partial, request);
+		++requests;
+		if (++pending >= engine->Options().flush_every) {
+			engine->Merge(shard, partial);
+			pending = 0;
+		}
+		return grpc::Status::OK;
+	}
+	grpc::Status OnReadsDone(helloworld::HelloReply &reply) {
+		if (pending)
+			engine->Merge(shard, partial);
+		pending = 0;
+		reply.set_message("Aggregated " + std::to_string(requests) + " requests");
+		reply.set_id(requests);
+		return grpc::Status::OK;
+	}
+
+private:
+	AggregationEngine<Aggregate> *engine;
+	std::size_t shard;
+	typename Aggregate::State partial;
+	/// Folded into partial since it was last merged.
+	std::size_t pending = 0;
+	std::uint64_t requests = 0;
+	/// Id of the call in the recording, if requests are recorded.
+	std::uint64_t call = 0;
+};
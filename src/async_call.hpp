@@ -0,0 +1,362 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <grpcpp/grpcpp.h>
+
+#include "common.hpp"
+#include "deadline.hpp"
+#include "priority.hpp"
+
+enum class CallShape { Unary, ServerStreaming, ClientStreaming, Bidi };
+
+/// Shape, service and message types of a method, worked out from the
+/// AsyncService::RequestX function generated for it.
+template <typename RequestMethod> struct MethodTraits;
+template <typename S, typename Req, typename Rep>
+struct MethodTraits<void (S::*)(grpc::ServerContext *, Req *,
+																grpc::ServerAsyncResponseWriter<Rep> *,
+																grpc::CompletionQueue *,
+																grpc::ServerCompletionQueue *, void *)> {
+	static constexpr CallShape shape = CallShape::Unary;
+	using Service = S;
+	using Request = Req;
+	using Reply = Rep;
+	using Stream = grpc::ServerAsyncResponseWriter<Rep>;
+};
+template <typename S, typename Req, typename Rep>
+struct MethodTraits<void (S::*)(grpc::ServerContext *, Req *,
+																grpc::ServerAsyncWriter<Rep> *,
+																grpc::CompletionQueue *,
+																grpc::ServerCompletionQueue *, void *)> {
+	static constexpr CallShape shape = CallShape::ServerStreaming;
+	using Service = S;
+	using Request = Req;
+	using Reply = Rep;
+	using Stream = grpc::ServerAsyncWriter<Rep>;
+};
+template <typename S, typename Req, typename Rep>
+struct MethodTraits<void (S::*)(grpc::ServerContext *,
+																grpc::ServerAsyncReader<Rep, Req> *,
+																grpc::CompletionQueue *,
+																grpc::ServerCompletionQueue *, void *)> {
+	static constexpr CallShape shape = CallShape::ClientStreaming;
+	using Service = S;
+	using Request = Req;
+	using Reply = Rep;
+	using Stream = grpc::ServerAsyncReader<Rep, Req>;
+};
+template <typename S, typename Req, typename Rep>
+struct MethodTraits<void (S::*)(grpc::ServerContext *,
+																grpc::ServerAsyncReaderWriter<Rep, Req> *,
+																grpc::CompletionQueue *,
+																grpc::ServerCompletionQueue *, void *)> {
+	static constexpr CallShape shape = CallShape::Bidi;
+	using Service = S;
+	using Request = Req;
+	using Reply = Rep;
+	using Stream = grpc::ServerAsyncReaderWriter<Rep, Req>;
+};
+
+/// Priority of the events of calls served by Impl: Impl::kPriority if it has
+/// one, otherwise high for unary methods and low for streams.
+template <typename Impl, CallShape shape, typename = void>
+struct DefaultPriority {
+	static constexpr Priority value =
+			shape == CallShape::Unary ? Priority::High : Priority::Low;
+};
+template <typename Impl, CallShape shape>
+struct DefaultPriority<Impl, shape, std::void_t<decltype(Impl::kPriority)>> {
+	static constexpr Priority value = Impl::kPriority;
+};
+
+/// Replies a bidi call has queued, written in order one at a time.
+template <typename Reply> using Replies = std::deque<Reply>;
+
+/// Server side of one call to the method RequestMethod requests. Each call
+/// accepts the next one as soon as it's matched, so Listen only has to be
+/// called once per completion queue.
+///
+/// What the method does is up to Impl, made for every call from the arguments
+/// given to Listen. Which of its functions are called depends on the shape:
+/// - Unary: `Status OnRequest(ServerContext &, Request const &, Reply &)`
+/// - Server streaming: `Status OnRequest(ServerContext &, Request const &)`,
+///   then `bool Next(Reply &)` for each reply until it returns false
+/// - Client streaming: `Status OnRead(Request const &)` for each request and
+///   `Status OnReadsDone(Reply &)` after the last
+/// - Bidi: `Status OnRead(Request const &, Replies<Reply> &)` and
+///   `Status OnReadsDone(Replies<Reply> &)`, queuing replies as they go
+///
+/// A status that isn't OK finishes the call with it. Impl is only called by one
+/// thread at a time.
+///
+/// The call's tags carry its priority (DefaultPriority) for PriorityDispatcher,
+/// unless the client asks for another with kPriorityKey.
+///
+/// The state machine is fixed at compile time. The tags of the call are members
+/// that dispatch straight to it, so an operation doesn't allocate or go through
+/// a std::function, and the call deletes itself once the last one is back.
+template <auto RequestMethod, typename Impl, typename... Args>
+class AsyncCall {
+	using Traits = MethodTraits<decltype(RequestMethod)>;
+	using Service = typename Traits::Service;
+	using Request = typename Traits::Request;
+	using Reply = typename Traits::Reply;
+	static constexpr CallShape shape = Traits::shape;
+
+public:
+	AsyncCall(Service *service, grpc::ServerCompletionQueue *cq, Args... args)
+			: service(service), cq(cq), args(std::move(args)...),
+				impl(std::make_from_tuple<Impl>(this->args)) {
+		SetPriority(DefaultPriority<Impl, shape>::value);
+		done_op.priority = DefaultPriority<Impl, shape>::value;
+	}
+	AsyncCall(AsyncCall const &) = delete;
+	AsyncCall &operator=(AsyncCall const &) = delete;
+
+	void Start() {
+		context.AsyncNotifyWhenDone(&done_op);
+		if constexpr (shape == CallShape::Unary ||
+									shape == CallShape::ServerStreaming) {
+			(service->*RequestMethod)(&context, &request, &stream, cq, cq,
+																&accept_op);
+		} else {
+			(service->*RequestMethod)(&context, &stream, cq, cq, &accept_op);
+		}
+	}
+
+private:
+	void OnAccept(bool ok) {
+		// The server is shutting down. The done tag only comes back for calls
+		// that were matched, so its reference is dropped here.
+		if (!ok) {
+			Release();
+			return;
+		}
+		std::apply(
+				[this](auto const &...args) {
+					(new AsyncCall(service, cq, args...))->Start();
+				},
+				args);
+		auto &metadata = context.client_metadata();
+		if (auto it = metadata.find(kPriorityKey); it != metadata.end()) {
+			Priority priority;
+			if (ParsePriority(std::string(it->second.data(), it->second.size()),
+												&priority))
+				SetPriority(priority);
+		}
+		if (Expired(context)) {
+			++WastedWork::Get().expired;
+			Fail({grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"});
+			return;
+		}
+		if constexpr (shape == CallShape::Unary) {
+			auto status = impl.OnRequest(context, request, reply);
+			if (!status.ok()) {
+				Fail(status);
+				return;
+			}
+			Issue();
+			stream.Finish(reply, status, &finish_op);
+		} else if constexpr (shape == CallShape::ServerStreaming) {
+			if (auto status = impl.OnRequest(context, request); !status.ok()) {
+				Fail(status);
+				return;
+			}
+			WriteNext();
+		} else {
+			// Clients wait for the metadata before sending anything.
+			Issue();
+			stream.SendInitialMetadata(&metadata_op);
+		}
+	}
+	void OnMetadata(bool ok) {
+		if (ok)
+			Read();
+	}
+	void OnRead(bool ok) {
+		if constexpr (shape == CallShape::ClientStreaming) {
+			if (ok) {
+				if (auto status = impl.OnRead(request); !status.ok()) {
+					Fail(status);
+					return;
+				}
+				Read();
+			} else if (!done) {
+				auto status = impl.OnReadsDone(reply);
+				if (!status.ok()) {
+					Fail(status);
+					return;
+				}
+				Issue();
+				stream.Finish(reply, status, &finish_op);
+			}
+		} else if constexpr (shape == CallShape::Bidi) {
+			std::lock_guard l{mutex};
+			if (ok) {
+				auto status = impl.OnRead(request, replies);
+				if (!status.ok()) {
+					FinishAfterWrites(status);
+				} else {
+					Read();
+				}
+			} else if (!done) {
+				FinishAfterWrites(impl.OnReadsDone(replies));
+			}
+			WriteNext();
+		}
+	}
+	void OnWrite(bool ok) {
+		if constexpr (shape == CallShape::ServerStreaming) {
+			if (ok)
+				WriteNext();
+		} else if constexpr (shape == CallShape::Bidi) {
+			std::lock_guard l{mutex};
+			writing = false;
+			replies.pop_front();
+			// The call is broken, so the read fails too and nothing is finished.
+			if (!ok) {
+				broken = true;
+				return;
+			}
+			WriteNext();
+		}
+	}
+	void OnFinish(bool ok) {}
+	void OnDone(bool ok) { done = true; }
+
+	/// Tag for one kind of operation, dispatching to On.
+	template <void (AsyncCall::*On)(bool)> struct Op : Tag {
+		Op(AsyncCall *call, char const *name) : Tag(&Complete), call(call) {
+			trace.name = name;
+		}
+		static void Complete(Tag *tag, bool ok) {
+			auto call = static_cast<Op *>(tag)->call;
+			(call->*On)(ok);
+			call->Release();
+		}
+		AsyncCall *call;
+	};
+
+	/// Sets the priority of every operation but done, which may be in flight
+	/// already.
+	void SetPriority(Priority priority) {
+		accept_op.priority = metadata_op.priority = read_op.priority =
+				write_op.priority = finish_op.priority = priority;
+	}
+	/// Counts an operation about to be started.
+	void Issue() { refs.fetch_add(1, std::memory_order_relaxed); }
+	void Release() {
+		if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+	void Fail(grpc::Status const &status) {
+		Issue();
+		if constexpr (shape == CallShape::Unary ||
+									shape == CallShape::ClientStreaming) {
+			stream.FinishWithError(status, &finish_op);
+		} else {
+			stream.Finish(status, &finish_op);
+		}
+	}
+	void Read() {
+		if constexpr (shape == CallShape::ClientStreaming ||
+									shape == CallShape::Bidi) {
+			// Nothing more will arrive and nobody is waiting for the reply.
+			if (done) {
+				++WastedWork::Get().reads_skipped;
+				return;
+			}
+			Issue();
+			stream.Read(&request, &read_op);
+		}
+	}
+	/// Writes the next reply if there is one and nothing is being written.
+	/// Bidi calls hold the lock.
+	void WriteNext() {
+		if constexpr (shape == CallShape::ServerStreaming) {
+			// The client is gone so the replies would only be thrown away.
+			if (done) {
+				++WastedWork::Get().writes_skipped;
+				return;
+			}
+			if (impl.Next(reply)) {
+				Issue();
+				stream.Write(reply, &write_op);
+			} else {
+				Issue();
+				stream.Finish(grpc::Status::OK, &finish_op);
+			}
+		} else if constexpr (shape == CallShape::Bidi) {
+			if (writing || broken)
+				return;
+			if (done) {
+				WastedWork::Get().writes_skipped += replies.size();
+				replies.clear();
+				return;
+			}
+			if (!replies.empty()) {
+				writing = true;
+				Issue();
+				stream.Write(replies.front(), &write_op);
+			} else if (finishing && !finished) {
+				finished = true;
+				Issue();
+				stream.Finish(finish_status, &finish_op);
+			}
+		}
+	}
+	/// Bidi calls finish once the replies queued so far have been written.
+	void FinishAfterWrites(grpc::Status status) {
+		finishing = true;
+		finish_status = std::move(status);
+	}
+
+	Service *service;
+	grpc::ServerCompletionQueue *cq;
+	std::tuple<Args...> args;
+	Impl impl;
+	grpc::ServerContext context;
+	typename Traits::Stream stream{&context};
+	Request request;
+	Reply reply;
+	/// Operations in flight, counting the accept and done tags Start registers.
+	/// The done tag is counted up front because it can come back, on another
+	/// thread of the queue, before OnAccept has run.
+	std::atomic<int> refs{2};
+	std::atomic<bool> done{false};
+
+	// Only used by bidi calls, where a read and a write can complete at once.
+	std::mutex mutex;
+	Replies<Reply> replies;
+	bool writing = false;
+	bool broken = false;
+	bool finishing = false;
+	bool finished = false;
+	grpc::Status finish_status;
+
+	Op<&AsyncCall::OnAccept> accept_op{this, "AsyncCall.OnAccept"};
+	Op<&AsyncCall::OnMetadata> metadata_op{this, "AsyncCall.OnMetadata"};
+	Op<&AsyncCall::OnRead> read_op{this, "AsyncCall.OnRead"};
+	Op<&AsyncCall::OnWrite> write_op{this, "AsyncCall.OnWrite"};
+	Op<&AsyncCall::OnFinish> finish_op{this, "AsyncCall.OnFinish"};
+	Op<&AsyncCall::OnDone> done_op{this, "AsyncCall.OnDone"};
+};
+
+/// Starts serving the method RequestMethod requests on cq with Impl, made from
+/// args for every call.
+///
+///     Listen<&Greeter::AsyncService::RequestSayHello, SayHello>(&service, cq);
+template <auto RequestMethod, typename Impl, typename... Args>
+void Listen(typename MethodTraits<decltype(RequestMethod)>::Service *service,
+						grpc::ServerCompletionQueue *cq, Args &&...args) {
+	(new AsyncCall<RequestMethod, Impl, std::decay_t<Args>...>(
+			 service, cq, std::forward<Args>(args)...))
+			->Start();
+}
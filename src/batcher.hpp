@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+
+/// Sends single greetings as SayHelloBatch calls. A greeting waits up to window
+/// for others to join it, or until there are max_batch of them, so a burst of
+/// greetings costs one call instead of one each.
+///
+/// Safe from any thread. Replies are handled on whichever thread polls cq.
+class SayHelloBatcher {
+public:
+	struct Result {
+		grpc::Status status;
+		helloworld::HelloReply reply;
+	};
+
+	SayHelloBatcher(
+			std::shared_ptr<grpc::Channel> channel, grpc::CompletionQueue *cq,
+			std::chrono::microseconds window = std::chrono::microseconds(200),
+			std::size_t max_batch = 1024,
+			std::chrono::milliseconds timeout = std::chrono::seconds(10))
+			: state(std::make_shared<State>(
+						helloworld::Greeter::NewStub(channel), cq, window,
+						std::max<std::size_t>(max_batch, 1), timeout)) {}
+	SayHelloBatcher(SayHelloBatcher const &) = delete;
+	SayHelloBatcher &operator=(SayHelloBatcher const &) = delete;
+	/// Sends whatever is waiting. Batches in flight still need cq polled.
+	~SayHelloBatcher() { Flush(); }
+
+	std::future<Result> SayHello(helloworld::HelloRequest request) {
+		std::shared_ptr<Batch> full;
+		std::future<Result> future;
+		{
+			std::lock_guard l{state->mutex};
+			auto &open = state->open;
+			if (!open) {
+				open = std::make_shared<Batch>();
+				// Fires at the end of the window, or straight away if cancelled.
+				open->alarm.Set(state->cq,
+												std::chrono::system_clock::now() + state->window,
+												OnWindow(state, open));
+			}
+			*open->request.add_requests() = std::move(request);
+			open->promises.emplace_back();
+			future = open->promises.back().get_future();
+			if (open->promises.size() == state->max_batch)
+				full = std::move(open);
+		}
+		if (full) {
+			full->alarm.Cancel();
+			Send(*state, std::move(full));
+		}
+		return future;
+	}
+	std::future<Result> SayHello(std::string name) {
+		helloworld::HelloRequest request;
+		request.set_name(std::move(name));
+		return SayHello(std::move(request));
+	}
+	/// Sends the greetings waiting without waiting for the window to end.
+	void Flush() {
+		std::shared_ptr<Batch> batch;
+		{
+			std::lock_guard l{state->mutex};
+			batch = std::move(state->open);
+		}
+		if (batch) {
+			batch->alarm.Cancel();
+			Send(*state, std::move(batch));
+		}
+	}
+
+private:
+	using Reply = helloworld::HelloBatchReply;
+	struct Batch {
+		grpc::Alarm alarm;
+		grpc::ClientContext context;
+		helloworld::HelloBatchRequest request;
+		std::vector<std::promise<Result>> promises;
+		std::unique_ptr<grpc::ClientAsyncResponseReader<Reply>> reader;
+		Reply reply;
+		grpc::Status status;
+	};
+	/// Everything the handlers use. They hold on to it rather than to the
+	/// batcher, whose window alarms can still fire after it's gone.
+	struct State {
+		State(std::unique_ptr<helloworld::Greeter::Stub> stub,
+					grpc::CompletionQueue *cq, std::chrono::microseconds window,
+					std::size_t max_batch, std::chrono::milliseconds timeout)
+				: stub(std::move(stub)), cq(cq), window(window), max_batch(max_batch),
+					timeout(timeout) {}
+		std::unique_ptr<helloworld::Greeter::Stub> stub;
+		grpc::CompletionQueue *cq;
+		std::chrono::microseconds const window;
+		std::size_t const max_batch;
+		std::chrono::milliseconds const timeout;
+		std::mutex mutex;
+		/// Greetings waiting for the window to end.
+		std::shared_ptr<Batch> open;
+	};
+
+	static Handler *OnWindow(std::shared_ptr<State> state,
+													 std::shared_ptr<Batch> batch) {
+		return new Handler([state, batch](bool ok) {
+			{
+				// Unless it filled up or was flushed in the meantime.
+				std::lock_guard l{state->mutex};
+				if (state->open != batch)
+					return;
+				state->open.reset();
+			}
+			Send(*state, batch);
+		});
+	}
+	static void Send(State &state, std::shared_ptr<Batch> batch) {
+		batch->context.set_deadline(std::chrono::system_clock::now() +
+																state.timeout);
+		batch->reader = state.stub->AsyncSayHelloBatch(&batch->context,
+																									 batch->request, state.cq);
+		batch->reader->Finish(&batch->reply, &batch->status, OnFinish(batch));
+	}
+	static Handler *OnFinish(std::shared_ptr<Batch> batch) {
+		return new Handler([batch](bool ok) {
+			auto &replies = *batch->reply.mutable_replies();
+			for (std::size_t i = 0; i < batch->promises.size(); ++i) {
+				auto n = static_cast<int>(i);
+				if (!batch->status.ok()) {
+					batch->promises[i].set_value({batch->status, {}});
+				} else if (n < replies.size()) {
+					batch->promises[i].set_value(
+							{grpc::Status::OK, std::move(*replies.Mutable(n))});
+				} else {
+					batch->promises[i].set_value(
+							{{grpc::StatusCode::INTERNAL, "no reply in batch"}, {}});
+				}
+			}
+		});
+	}
+
+	std::shared_ptr<State> state;
+};
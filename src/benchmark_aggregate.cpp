@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "aggregate.hpp"
+#include "async_call.hpp"
+#include "common.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "stats.hpp"
+
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+/// Server in this process aggregating SayHellosClient streams with engine.
+template <typename Aggregate> class TestServer {
+public:
+	TestServer(AggregationOptions options, int threads) : engine(options) {
+		grpc::ServerBuilder builder;
+		builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+														 &port);
+		builder.RegisterService(&service);
+		for (auto i = 0; i < threads; ++i) {
+			cqs.emplace_back(builder.AddCompletionQueue());
+		}
+		server = builder.BuildAndStart();
+		for (std::size_t i = 0; i < cqs.size(); ++i) {
+			auto cq = cqs[i].get();
+			for (auto j = 0; j < 16; ++j) {
+				Listen<&Greeter::AsyncService::RequestSayHellosClient,
+							 AggregateSayHellosClient<Aggregate>>(&service, cq, &engine, i);
+			}
+			this->threads.emplace_back([this, cq] { poller.Run(cq); });
+		}
+	}
+	~TestServer() {
+		server->Shutdown();
+		for (auto &cq : cqs) {
+			cq->Shutdown();
+		}
+		for (auto &t : threads) {
+			t.join();
+		}
+	}
+	std::string Address() const { return "127.0.0.1:" + std::to_string(port); }
+	AggregationEngine<Aggregate> &Engine() { return engine; }
+
+private:
+	AggregationEngine<Aggregate> engine;
+	Greeter::AsyncService service;
+	std::unique_ptr<grpc::Server> server;
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	Poller poller;
+	std::vector<std::thread> threads;
+	int port = 0;
+};
+
+/// SayHellosClient stream sending requests one write at a time.
+class Upload : public std::enable_shared_from_this<Upload> {
+public:
+	/// @param first Id of the first request, the rest follow
+	/// @param names Names are cycled through this many
+	Upload(Greeter::Stub *stub, grpc::CompletionQueue *cq, std::uint64_t first,
+				 std::uint64_t requests, std::uint64_t names)
+			: stub(stub), cq(cq), next(first), end(first + requests), names(names) {}
+
+	/// Ready with the status once the stream has finished.
+	std::future<grpc::Status> Start() {
+		auto finished = finished_promise.get_future();
+		writer = stub->PrepareAsyncSayHellosClient(&context, &reply, cq);
+		writer->StartCall(OnReady());
+		return finished;
+	}
+	HelloReply const &Reply() const { return reply; }
+
+private:
+	void Write() {
+		if (next == end) {
+			writer->WritesDone(new Handler([this, me = shared_from_this()](bool) {
+				writer->Finish(&status, OnFinish());
+			}));
+			return;
+		}
+		request.set_name("name-" + std::to_string(next % names));
+		request.set_id(next++);
+		writer->Write(request, OnReady());
+	}
+	/// Once the call has started or the last write is done.
+	Handler *OnReady() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (ok)
+				Write();
+			else
+				writer->Finish(&status, OnFinish());
+		});
+	}
+	Handler *OnFinish() {
+		return new Handler([this, me = shared_from_this()](bool) {
+			finished_promise.set_value(status);
+		});
+	}
+
+	Greeter::Stub *stub;
+	grpc::CompletionQueue *cq;
+	std::uint64_t next;
+	std::uint64_t end;
+	std::uint64_t names;
+	grpc::ClientContext context;
+	std::unique_ptr<grpc::ClientAsyncWriter<HelloRequest>> writer;
+	HelloRequest request;
+	HelloReply reply;
+	grpc::Status status;
+	std::promise<grpc::Status> finished_promise;
+};
+
+/// Uploads streams of requests each at once and queries the engine every
+/// query_interval until they've all finished. Both aggregates count requests.
+/// @return Whether every stream succeeded and the aggregate has every request
+template <typename Aggregate>
+bool Run(std::string const &label, AggregationOptions options,
+				 int server_threads, grpc::CompletionQueue *cq, int streams,
+				 std::uint64_t requests, std::uint64_t names,
+				 std::chrono::milliseconds query_interval) {
+	TestServer<Aggregate> server(options, server_threads);
+	auto stub = Greeter::NewStub(grpc::CreateChannel(
+			server.Address(), grpc::InsecureChannelCredentials()));
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::shared_ptr<Upload>> uploads;
+	std::vector<std::future<grpc::Status>> finished;
+	for (auto s = 0; s < streams; ++s) {
+		auto first = s * requests + 1;
+		uploads.push_back(
+				std::make_shared<Upload>(stub.get(), cq, first, requests, names));
+		finished.push_back(uploads.back()->Start());
+	}
+	// Queries while the uploads are going on, as a client of the results would.
+	LatencyRecorder query_latency;
+	std::uint64_t seen_while_uploading = 0;
+	std::atomic<bool> uploading{true};
+	std::thread queries([&] {
+		while (uploading) {
+			auto query_start = std::chrono::steady_clock::now();
+			auto snapshot = server.Engine().Snapshot();
+			query_latency.Record(std::chrono::steady_clock::now() - query_start);
+			seen_while_uploading = snapshot.requests;
+			std::this_thread::sleep_for(query_interval);
+		}
+	});
+	std::size_t failed = 0;
+	for (auto &f : finished) {
+		failed += !f.get().ok();
+	}
+	std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+	uploading = false;
+	queries.join();
+
+	auto total = std::uint64_t(streams) * requests;
+	auto result = server.Engine().Snapshot();
+	auto ok = failed == 0 && result.requests == total;
+	for (auto &upload : uploads) {
+		ok &= upload->Reply().id() == requests;
+	}
+	std::cout << label << " requests/s: " << total / elapsed.count()
+						<< " failed streams: " << failed
+						<< " merges: " << server.Engine().Merges()
+						<< " queries: " << query_latency.Count()
+						<< " last seen while uploading: " << seen_while_uploading << "/"
+						<< total << " query " << query_latency << std::endl;
+	std::cout << "  ";
+	Aggregate::Describe(result, std::cout);
+	std::cout << (ok ? "" : " MISMATCH") << std::endl;
+	return ok;
+}
+
+/// Many SayHellosClient streams uploading into one aggregate at once, with the
+/// results queried every --query-ms (10) while they do. For each of --modes a
+/// server in this process is started:
+/// - locked: one shard, every request merged into it as it's read, like a
+///   single map behind a lock
+/// - sharded: a shard per server thread and partial aggregates per stream,
+///   merged every --flush requests (1024)
+///
+/// --streams streams (64) each send --requests requests (10000) with names
+/// cycling through --names names (1000). --aggregate is names (default) or
+/// totals. The server polls with --server-threads threads (2). Exits with 1 if
+/// a stream failed or the aggregate is missing requests.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto modes = flags.GetList<std::string>("modes", {"locked", "sharded"});
+	auto streams = std::max(flags.Get("streams", 64), 1);
+	auto requests = std::max<std::uint64_t>(
+			flags.Get<std::uint64_t>("requests", 10000), 1);
+	auto names = std::max<std::uint64_t>(flags.Get<std::uint64_t>("names", 1000),
+																			 1);
+	auto flush = flags.Get<std::size_t>("flush", 1024);
+	auto aggregate = flags.Get("aggregate", "names");
+	auto server_threads = std::max(flags.Get("server-threads", 2), 1);
+	auto query_interval = std::chrono::milliseconds(flags.Get("query-ms", 10));
+
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < flags.Get("client-threads", 2); ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+
+	auto ok = true;
+	for (auto &mode : modes) {
+		AggregationOptions options;
+		if (mode == "locked") {
+			options.shards = 1;
+			options.flush_every = 1;
+		} else if (mode == "sharded") {
+			options.shards = server_threads;
+			options.flush_every = flush;
+		} else {
+			continue;
+		}
+		auto label = mode + " " + aggregate;
+		if (aggregate == "totals") {
+			ok &= Run<Totals>(label, options, server_threads, &cq, streams, requests,
+												names, query_interval);
+		} else {
+			ok &= Run<NameCounts>(label, options, server_threads, &cq, streams,
+														requests, names, query_interval);
+		}
+	}
+
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	return ok ? 0 : 1;
+}
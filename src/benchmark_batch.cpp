@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "batcher.hpp"
+#include "common.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "stats.hpp"
+
+using helloworld::Greeter;
+using helloworld::HelloBatchReply;
+using helloworld::HelloBatchRequest;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+/// Counts down the calls of a round as they finish.
+class Round {
+public:
+	explicit Round(std::size_t calls) : left(calls) {}
+	void Done(bool ok) {
+		if (!ok)
+			++failed;
+		std::lock_guard l{mutex};
+		if (--left == 0)
+			all_done.notify_one();
+	}
+	/// @return How many calls failed
+	std::size_t Wait() {
+		std::unique_lock l{mutex};
+		all_done.wait(l, [&] { return left == 0; });
+		return failed;
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable all_done;
+	std::size_t left;
+	std::atomic<std::size_t> failed{0};
+};
+
+/// One call of either kind, alive until it finishes.
+template <typename Request, typename Reply> struct Call {
+	grpc::ClientContext context;
+	Request request;
+	Reply reply;
+	grpc::Status status;
+	std::unique_ptr<grpc::ClientAsyncResponseReader<Reply>> reader;
+};
+
+/// Sends greetings as separate SayHello calls, all in flight at once.
+/// @return How many failed
+std::size_t UnaryRound(Greeter::Stub *stub, grpc::CompletionQueue *cq,
+											 std::size_t greetings,
+											 std::chrono::milliseconds timeout) {
+	Round round(greetings);
+	for (std::size_t i = 0; i < greetings; ++i) {
+		auto call = std::make_shared<Call<HelloRequest, HelloReply>>();
+		call->context.set_deadline(std::chrono::system_clock::now() + timeout);
+		call->request.set_name("world");
+		call->reader = stub->AsyncSayHello(&call->context, call->request, cq);
+		call->reader->Finish(&call->reply, &call->status,
+												 new Handler([call, &round](bool ok) {
+													 round.Done(ok && call->status.ok());
+												 }));
+	}
+	return round.Wait();
+}
+
+/// Sends greetings as SayHelloBatch calls of batch_size, all in flight at once.
+/// @return How many greetings failed
+std::size_t BatchRound(Greeter::Stub *stub, grpc::CompletionQueue *cq,
+											 std::size_t greetings, std::size_t batch_size,
+											 std::chrono::milliseconds timeout) {
+	batch_size = std::max<std::size_t>(batch_size, 1);
+	auto batches = (greetings + batch_size - 1) / batch_size;
+	std::atomic<std::size_t> failed{0};
+	Round round(batches);
+	for (std::size_t b = 0; b < batches; ++b) {
+		auto call = std::make_shared<Call<HelloBatchRequest, HelloBatchReply>>();
+		call->context.set_deadline(std::chrono::system_clock::now() + timeout);
+		auto size = std::min(batch_size, greetings - b * batch_size);
+		for (std::size_t i = 0; i < size; ++i) {
+			call->request.add_requests()->set_name("world");
+		}
+		call->reader = stub->AsyncSayHelloBatch(&call->context, call->request, cq);
+		call->reader->Finish(
+				&call->reply, &call->status,
+				new Handler([call, size, &round, &failed](bool ok) {
+					auto good = ok && call->status.ok() &&
+											call->reply.replies_size() == static_cast<int>(size);
+					if (!good)
+						failed += size;
+					round.Done(good);
+				}));
+	}
+	round.Wait();
+	return failed;
+}
+
+/// Sends greetings one at a time through the batcher, then waits for them.
+/// @return How many failed
+std::size_t AutoRound(SayHelloBatcher *batcher, std::size_t greetings) {
+	std::vector<std::future<SayHelloBatcher::Result>> replies;
+	replies.reserve(greetings);
+	for (std::size_t i = 0; i < greetings; ++i) {
+		replies.push_back(batcher->SayHello("world"));
+	}
+	std::size_t failed = 0;
+	for (auto &reply : replies) {
+		failed += !reply.get().status.ok();
+	}
+	return failed;
+}
+
+/// Compares ways of sending --per-round greetings at once, against a running
+/// server (`server`). Each round sends them all and waits for every reply:
+/// - unary: a SayHello call for each greeting
+/// - batch: SayHelloBatch calls of --batch-size greetings
+/// - auto: single greetings from --producers threads, batched by
+///   SayHelloBatcher within --window-us or up to --max-batch
+/// Prints greetings a second and how long rounds take.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto address = flags.Get("address", "localhost:50051");
+	auto modes = flags.GetList<std::string>("modes", {"unary", "batch", "auto"});
+	auto per_round = flags.Get<std::size_t>("per-round", 1000);
+	auto batch_size = flags.Get<std::size_t>("batch-size", 100);
+	auto window = std::chrono::microseconds(flags.Get("window-us", 200));
+	auto max_batch = flags.Get<std::size_t>("max-batch", 1024);
+	auto producers = std::max(flags.Get("producers", 4), 1);
+	auto duration = std::chrono::milliseconds(flags.Get("duration-ms", 3000));
+	auto timeout = std::chrono::milliseconds(flags.Get("timeout-ms", 10000));
+
+	grpc::ChannelArguments args;
+	// Large enough for the biggest batches.
+	args.SetMaxReceiveMessageSize(64 << 20);
+	auto channel = grpc::CreateCustomChannel(
+			address, grpc::InsecureChannelCredentials(), args);
+	auto stub = Greeter::NewStub(channel);
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < flags.Get("threads", 2); ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+	SayHelloBatcher batcher(channel, &cq, window, max_batch, timeout);
+
+	for (auto &mode : modes) {
+		LatencyRecorder rounds;
+		std::atomic<std::size_t> greetings{0};
+		std::atomic<std::size_t> failed{0};
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + duration;
+		// Rounds of the auto mode are split between the producers, the others
+		// are sent by one thread.
+		auto senders = mode == "auto" ? producers : 1;
+		auto share = std::max<std::size_t>(per_round / senders, 1);
+		std::vector<std::thread> send_threads;
+		for (auto s = 0; s < senders; ++s) {
+			send_threads.emplace_back([&] {
+				while (std::chrono::steady_clock::now() < end) {
+					auto round_start = std::chrono::steady_clock::now();
+					std::size_t round_failed = 0;
+					if (mode == "unary")
+						round_failed = UnaryRound(stub.get(), &cq, share, timeout);
+					else if (mode == "batch")
+						round_failed =
+								BatchRound(stub.get(), &cq, share, batch_size, timeout);
+					else if (mode == "auto")
+						round_failed = AutoRound(&batcher, share);
+					else
+						return;
+					rounds.Record(std::chrono::steady_clock::now() - round_start);
+					greetings += share;
+					failed += round_failed;
+				}
+			});
+		}
+		for (auto &t : send_threads) {
+			t.join();
+		}
+		auto elapsed = std::chrono::duration<double>(
+											 std::chrono::steady_clock::now() - start)
+											 .count();
+		std::cout << mode << " greetings/s: " << greetings / elapsed
+							<< " failed: " << failed << " rounds " << rounds << std::endl;
+	}
+
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	return 0;
+}
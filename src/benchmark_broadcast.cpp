@@ -0,0 +1,197 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "broadcast.hpp"
+#include "common.hpp"
+#include "flags.hpp"
+#include "stats.hpp"
+
+using grpc::Channel;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+std::int64_t NowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+						 std::chrono::steady_clock::now().time_since_epoch())
+			.count();
+}
+
+/// Reads everything from a SayHellos stream. Each message carries the time it
+/// was published so the fan out latency can be measured.
+class BroadcastSubscriber
+		: public std::enable_shared_from_this<BroadcastSubscriber> {
+public:
+	BroadcastSubscriber(Greeter::Stub *stub, grpc::CompletionQueue *cq,
+											std::atomic<std::uint64_t> *received,
+											LatencyRecorder *latencies)
+			: stub(stub), cq(cq), received(received), latencies(latencies) {}
+	void Start() {
+		HelloRequest request;
+		request.set_name("subscriber");
+		// Prepared first so stream is set before OnCreate runs on another thread.
+		stream = stub->PrepareAsyncSayHellos(&context, request, cq);
+		stream->StartCall(OnCreate());
+	}
+	void Cancel() { context.TryCancel(); }
+
+private:
+	Handler *OnCreate() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (ok) {
+				stream->Read(&reply, OnRead());
+			}
+		});
+	}
+	Handler *OnRead() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (ok) {
+				++*received;
+				if (latencies) {
+					latencies->Record(
+							std::chrono::nanoseconds(NowNs() - std::stoll(reply.message())));
+				}
+				stream->Read(&reply, OnRead());
+			} else {
+				stream->Finish(&status, OnFinish());
+			}
+		});
+	}
+	Handler *OnFinish() {
+		return new Handler([me = shared_from_this()](bool ok) {});
+	}
+
+	Greeter::Stub *stub;
+	grpc::CompletionQueue *cq;
+	std::atomic<std::uint64_t> *received;
+	LatencyRecorder *latencies;
+	grpc::ClientContext context;
+	std::unique_ptr<grpc::ClientAsyncReader<HelloReply>> stream;
+	HelloReply reply;
+	grpc::Status status;
+};
+
+/// One producer fanning out to many subscribers on the same host.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto num_subscribers = flags.Get("subscribers", 10000);
+	auto num_channels = flags.Get("channels", 16);
+	auto num_messages = flags.Get("messages", 100);
+	auto interval = std::chrono::microseconds(flags.Get("interval-us", 10000));
+	auto num_threads = flags.Get("threads", 4);
+	// Only some subscribers record latency so recording doesn't dominate.
+	auto sample_every = flags.Get("sample-every", 64);
+
+	BroadcastService service;
+	grpc::ServerBuilder builder;
+	int port = 0;
+	builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+													 &port);
+	builder.RegisterService(&service);
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> server_cqs;
+	for (auto i = 0; i < num_threads; ++i) {
+		server_cqs.emplace_back(builder.AddCompletionQueue());
+	}
+	auto server = builder.BuildAndStart();
+	BroadcastHub hub(server_cqs.size(), flags.Get<std::size_t>("queue-size", 64),
+									 flags.Get("policy", "drop") == "disconnect"
+											 ? SlowSubscriberPolicy::Disconnect
+											 : SlowSubscriberPolicy::Drop);
+
+	auto poll = [](grpc::CompletionQueue *cq) {
+		void *tag;
+		bool ok;
+		while (cq->Next(&tag, &ok)) {
+			static_cast<Handler *>(tag)->Proceed(ok);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (std::size_t i = 0; i < server_cqs.size(); ++i) {
+		std::make_shared<SayHellosSubscriber>(&service, server_cqs[i].get(), &hub,
+																					i)
+				->Start();
+		threads.emplace_back(poll, server_cqs[i].get());
+	}
+
+	// Separate channels so the streams are spread over several connections.
+	std::vector<std::unique_ptr<Greeter::Stub>> stubs;
+	for (auto i = 0; i < num_channels; ++i) {
+		grpc::ChannelArguments args;
+		args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+		args.SetInt("benchmark.channel", i);
+		stubs.emplace_back(Greeter::NewStub(grpc::CreateCustomChannel(
+				"127.0.0.1:" + std::to_string(port),
+				grpc::InsecureChannelCredentials(), args)));
+	}
+	grpc::CompletionQueue client_cq;
+	for (auto i = 0; i < num_threads; ++i) {
+		threads.emplace_back(poll, &client_cq);
+	}
+	std::atomic<std::uint64_t> received{0};
+	LatencyRecorder latencies;
+	std::vector<std::shared_ptr<BroadcastSubscriber>> subscribers;
+	auto subscribe_start = std::chrono::steady_clock::now();
+	for (auto i = 0; i < num_subscribers; ++i) {
+		subscribers.emplace_back(std::make_shared<BroadcastSubscriber>(
+				stubs[i % stubs.size()].get(), &client_cq, &received,
+				i % sample_every == 0 ? &latencies : nullptr));
+		subscribers.back()->Start();
+	}
+
+	while (hub.Stats().subscribers < num_subscribers) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	std::cout << num_subscribers << " subscribed in "
+						<< std::chrono::duration<double>(std::chrono::steady_clock::now() -
+																						 subscribe_start)
+									 .count()
+						<< "s" << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+	for (auto i = 0; i < num_messages; ++i) {
+		HelloReply reply;
+		reply.set_message(std::to_string(NowNs()));
+		hub.Publish(reply);
+		std::this_thread::sleep_for(interval);
+	}
+	// Wait for the queues to drain.
+	auto expected = static_cast<std::uint64_t>(num_messages) * num_subscribers;
+	auto &stats = hub.Stats();
+	auto drain_deadline =
+			std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while (received + stats.dropped < expected &&
+				 std::chrono::steady_clock::now() < drain_deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	auto elapsed = std::chrono::duration<double>(
+										 std::chrono::steady_clock::now() - start)
+										 .count();
+
+	std::cout << stats << std::endl;
+	std::cout << "received: " << received << " in " << elapsed << "s ("
+						<< received / elapsed << " msg/s)" << std::endl;
+	std::cout << "fan out latency: " << latencies << std::endl;
+
+	for (auto &s : subscribers) {
+		s->Cancel();
+	}
+	subscribers.clear();
+	server->Shutdown();
+	for (auto &cq : server_cqs) {
+		cq->Shutdown();
+	}
+	client_cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	return 0;
+}
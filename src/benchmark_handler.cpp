@@ -0,0 +1,285 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <benchmark/benchmark.h>
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+
+#include "common.hpp"
+
+// Counts every allocation made by the calling thread so the benchmarks can
+// report allocations per dispatch.
+namespace {
+thread_local std::uint64_t allocations = 0;
+/// Not inlined, so GCC doesn't see free called on memory from operator new
+/// wherever operator delete is inlined and warn about a mismatch.
+#if defined(_MSC_VER)
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+void Free(void *p) noexcept {
+	std::free(p);
+}
+} // namespace
+
+void *operator new(std::size_t size) {
+	++allocations;
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { Free(p); }
+void operator delete(void *p, std::size_t) noexcept { Free(p); }
+
+namespace {
+
+std::uint64_t Cycles() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+/// Reports allocations and cycles per iteration for the lifetime of the
+/// object.
+class PerDispatch {
+public:
+	explicit PerDispatch(benchmark::State &state)
+			: state(state), start_allocations(allocations), start_cycles(Cycles()) {}
+	~PerDispatch() {
+		auto n = static_cast<double>(state.iterations());
+		// Each thread has its own iterations so average rather than sum.
+		state.counters["allocs"] = benchmark::Counter(
+				(allocations - start_allocations) / n, benchmark::Counter::kAvgThreads);
+		state.counters["cycles"] = benchmark::Counter(
+				(Cycles() - start_cycles) / n, benchmark::Counter::kAvgThreads);
+	}
+
+private:
+	benchmark::State &state;
+	std::uint64_t start_allocations;
+	std::uint64_t start_cycles;
+};
+
+/// Stand in for an rpc call object like SayHelloBidirServer.
+struct Call : std::enable_shared_from_this<Call> {
+	std::uint64_t count = 0;
+
+	Handler *OnEvent() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			count += ok;
+		});
+	}
+	/// Like OnEvent but without keeping the call alive.
+	Handler *OnEventNoCapture() {
+		return new Handler([this](bool ok) { count += ok; });
+	}
+};
+
+/// Handler without the try/catch in Proceed.
+struct NoexceptHandler {
+	std::function<void(bool)> func;
+	template <typename F> NoexceptHandler(F &&f) : func(std::forward<F>(f)) {}
+	void Proceed(bool ok) noexcept {
+		func(ok);
+		delete this;
+	}
+};
+
+/// Alternative: a virtual tag holding the lambda directly, so there's one
+/// allocation and no std::function.
+struct VirtualTag {
+	virtual ~VirtualTag() = default;
+	virtual void Proceed(bool ok) = 0;
+};
+template <typename F> struct LambdaTag final : VirtualTag {
+	F func;
+	explicit LambdaTag(F f) : func(std::move(f)) {}
+	void Proceed(bool ok) override {
+		func(ok);
+		delete this;
+	}
+};
+template <typename F> VirtualTag *MakeTag(F &&f) {
+	return new LambdaTag<std::decay_t<F>>(std::forward<F>(f));
+}
+
+/// Alternative: a tag embedded in the call object that is reused for every
+/// operation of the same kind. No allocation and no reference counting, the
+/// call has to manage its own lifetime. AsyncCall's tags work like this.
+struct EmbeddedTag {
+	void (*proceed)(EmbeddedTag *, bool);
+	void Proceed(bool ok) { proceed(this, ok); }
+};
+struct EmbeddedCall {
+	std::uint64_t count = 0;
+	EmbeddedTag on_event{[](EmbeddedTag *tag, bool ok) {
+		auto self = reinterpret_cast<EmbeddedCall *>(
+				reinterpret_cast<char *>(tag) - offsetof(EmbeddedCall, on_event));
+		self->count += ok;
+	}};
+};
+
+/// Alternative: a state machine behind a virtual call on the call object
+/// itself, like server.cpp's CallBase before AsyncCall.
+struct StateCall {
+	virtual ~StateCall() = default;
+	virtual void Proceed(bool ok) = 0;
+};
+struct CountingStateCall final : StateCall {
+	std::uint64_t count = 0;
+	void Proceed(bool ok) override { count += ok; }
+};
+
+/// Calls are per thread like on a real server, except for the contended
+/// benchmark which has every thread capturing the same call.
+std::shared_ptr<Call> shared_call = std::make_shared<Call>();
+
+} // namespace
+
+static void BM_Handler(benchmark::State &state) {
+	auto call = std::make_shared<Call>();
+	PerDispatch per(state);
+	for (auto _ : state) {
+		void *tag = call->OnEvent();
+		static_cast<Handler *>(tag)->Proceed(true);
+	}
+	benchmark::DoNotOptimize(call->count);
+}
+BENCHMARK(BM_Handler)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_HandlerContended(benchmark::State &state) {
+	PerDispatch per(state);
+	for (auto _ : state) {
+		void *tag = new Handler([me = shared_call](bool ok) {
+			benchmark::DoNotOptimize(ok);
+		});
+		static_cast<Handler *>(tag)->Proceed(true);
+	}
+}
+BENCHMARK(BM_HandlerContended)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_HandlerNoCapture(benchmark::State &state) {
+	auto call = std::make_shared<Call>();
+	PerDispatch per(state);
+	for (auto _ : state) {
+		void *tag = call->OnEventNoCapture();
+		static_cast<Handler *>(tag)->Proceed(true);
+	}
+	benchmark::DoNotOptimize(call->count);
+}
+BENCHMARK(BM_HandlerNoCapture)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_SharedFromThis(benchmark::State &state) {
+	auto call = std::make_shared<Call>();
+	PerDispatch per(state);
+	for (auto _ : state) {
+		auto me = call->shared_from_this();
+		benchmark::DoNotOptimize(me);
+	}
+}
+BENCHMARK(BM_SharedFromThis)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_NoexceptHandler(benchmark::State &state) {
+	auto call = std::make_shared<Call>();
+	PerDispatch per(state);
+	for (auto _ : state) {
+		void *tag = new NoexceptHandler([c = call.get(), me = call](bool ok) {
+			c->count += ok;
+		});
+		static_cast<NoexceptHandler *>(tag)->Proceed(true);
+	}
+	benchmark::DoNotOptimize(call->count);
+}
+BENCHMARK(BM_NoexceptHandler)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_VirtualTag(benchmark::State &state) {
+	auto call = std::make_shared<Call>();
+	PerDispatch per(state);
+	for (auto _ : state) {
+		void *tag = MakeTag([c = call.get(), me = call](bool ok) {
+			c->count += ok;
+		});
+		static_cast<VirtualTag *>(tag)->Proceed(true);
+	}
+	benchmark::DoNotOptimize(call->count);
+}
+BENCHMARK(BM_VirtualTag)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_EmbeddedTag(benchmark::State &state) {
+	EmbeddedCall call;
+	PerDispatch per(state);
+	for (auto _ : state) {
+		void *tag = &call.on_event;
+		benchmark::DoNotOptimize(tag);
+		static_cast<EmbeddedTag *>(tag)->Proceed(true);
+	}
+	benchmark::DoNotOptimize(call.count);
+}
+BENCHMARK(BM_EmbeddedTag)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_StateMachineTag(benchmark::State &state) {
+	CountingStateCall call;
+	PerDispatch per(state);
+	for (auto _ : state) {
+		void *tag = static_cast<StateCall *>(&call);
+		benchmark::DoNotOptimize(tag);
+		static_cast<StateCall *>(tag)->Proceed(true);
+	}
+	benchmark::DoNotOptimize(call.count);
+}
+BENCHMARK(BM_StateMachineTag)->ThreadRange(1, 8)->UseRealTime();
+
+/// Round trip through a real completion queue. An alarm that has already
+/// expired is the cheapest way to get a tag back out of Next().
+static void BM_CompletionQueueHandler(benchmark::State &state) {
+	grpc::CompletionQueue cq;
+	grpc::Alarm alarm;
+	auto call = std::make_shared<Call>();
+	void *tag;
+	bool ok;
+	PerDispatch per(state);
+	for (auto _ : state) {
+		alarm.Set(&cq, gpr_time_0(GPR_CLOCK_REALTIME), call->OnEvent());
+		cq.Next(&tag, &ok);
+		static_cast<Handler *>(tag)->Proceed(ok);
+	}
+	cq.Shutdown();
+	while (cq.Next(&tag, &ok)) {
+	}
+}
+BENCHMARK(BM_CompletionQueueHandler)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_CompletionQueueEmbedded(benchmark::State &state) {
+	grpc::CompletionQueue cq;
+	grpc::Alarm alarm;
+	EmbeddedCall call;
+	void *tag;
+	bool ok;
+	PerDispatch per(state);
+	for (auto _ : state) {
+		alarm.Set(&cq, gpr_time_0(GPR_CLOCK_REALTIME), &call.on_event);
+		cq.Next(&tag, &ok);
+		static_cast<EmbeddedTag *>(tag)->Proceed(ok);
+	}
+	cq.Shutdown();
+	while (cq.Next(&tag, &ok)) {
+	}
+}
+BENCHMARK(BM_CompletionQueueEmbedded)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,144 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+#include "flags.hpp"
+#include "hedging.hpp"
+#include "stats.hpp"
+
+using grpc::Server;
+using grpc::ServerBuilder;
+using grpc::ServerContext;
+using grpc::Status;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+/// Greeter that is occasionally very slow, like a server hitting a gc pause or
+/// a noisy neighbour.
+class SlowGreeter final : public Greeter::Service {
+public:
+	SlowGreeter(double slow_fraction, std::chrono::milliseconds slow_delay)
+			: slow_fraction(slow_fraction), slow_delay(slow_delay) {}
+
+	Status SayHello(ServerContext *context, const HelloRequest *request,
+									HelloReply *reply) override {
+		thread_local std::mt19937 rng{std::random_device{}()};
+		if (std::uniform_real_distribution<>(0, 1)(rng) < slow_fraction) {
+			// Sleep in small steps so cancelled hedges give the thread back.
+			auto until = std::chrono::steady_clock::now() + slow_delay;
+			while (std::chrono::steady_clock::now() < until) {
+				if (context->IsCancelled())
+					return Status::CANCELLED;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		reply->set_message("hello " + request->name());
+		return Status::OK;
+	}
+
+private:
+	double slow_fraction;
+	std::chrono::milliseconds slow_delay;
+};
+
+/// Closed loop load: keeps concurrency calls in flight until total calls are
+/// done and records the latency of each one.
+void RunLoad(Greeter::Stub *stub, HedgingPolicy const &policy, int concurrency,
+						 int total, LatencyRecorder &latencies, HedgingStats &stats) {
+	grpc::CompletionQueue cq;
+	RetryBudget budget;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::atomic<int> started{0};
+	int finished = 0;
+
+	std::function<void()> issue = [&] {
+		if (started++ >= total)
+			return;
+		auto start = std::chrono::steady_clock::now();
+		HelloRequest request;
+		request.set_name("world");
+		std::make_shared<HedgedSayHello>(stub, &cq, policy, &budget, &stats)
+				->Start(request, [&, start](Status const &, HelloReply const &) {
+					latencies.Record(std::chrono::steady_clock::now() - start);
+					{
+						std::lock_guard l{mutex};
+						++finished;
+					}
+					cv.notify_one();
+					issue();
+				});
+	};
+
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < 4; ++i) {
+		threads.emplace_back([&] {
+			void *tag;
+			bool ok;
+			while (cq.Next(&tag, &ok)) {
+				static_cast<Handler *>(tag)->Proceed(ok);
+			}
+		});
+	}
+	for (auto i = 0; i < concurrency; ++i) {
+		issue();
+	}
+	{
+		std::unique_lock l{mutex};
+		cv.wait(l, [&] { return finished == total; });
+	}
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+}
+
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto concurrency = flags.Get("concurrency", 16);
+	auto total = flags.Get("calls", 20000);
+	SlowGreeter service(flags.Get("slow-fraction", 0.01),
+											std::chrono::milliseconds(flags.Get("slow-ms", 50)));
+
+	ServerBuilder builder;
+	int port = 0;
+	builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+													 &port);
+	builder.RegisterService(&service);
+	auto server = builder.BuildAndStart();
+	auto channel = grpc::CreateChannel("127.0.0.1:" + std::to_string(port),
+																		 grpc::InsecureChannelCredentials());
+	auto stub = Greeter::NewStub(channel);
+
+	HedgingPolicy single;
+	single.max_attempts = 1;
+	HedgingPolicy hedged;
+	hedged.max_attempts = flags.Get<std::size_t>("max-attempts", 2);
+	hedged.hedge_delay =
+			std::chrono::milliseconds(flags.Get("hedge-delay-ms", 5));
+
+	for (auto &&[name, policy] : {std::pair{"single attempt", single},
+																std::pair{"hedged", hedged}}) {
+		LatencyRecorder latencies;
+		HedgingStats stats;
+		RunLoad(stub.get(), policy, concurrency, total, latencies, stats);
+		std::cout << name << ": " << latencies << std::endl;
+		std::cout << "  " << stats << std::endl;
+	}
+
+	server->Shutdown();
+	return 0;
+}
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "async_call.hpp"
+#include "bidi_client.hpp"
+#include "flags.hpp"
+#include "mux_client.hpp"
+#include "mux_server.hpp"
+#include "poller.hpp"
+#include "stats.hpp"
+
+using grpc::ServerContext;
+using grpc::Status;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+/// SayHelloBidir replying to every request, quietly unlike server_stream_bidir.
+class Echo {
+public:
+	Status OnRead(HelloRequest const &request, Replies<HelloReply> &replies) {
+		auto &reply = replies.emplace_back();
+		reply.set_message("You sent: " + request.name());
+		reply.set_id(request.id());
+		return Status::OK;
+	}
+	Status OnReadsDone(Replies<HelloReply> &replies) { return Status::OK; }
+};
+
+struct SessionStats {
+	std::atomic<std::size_t> replies{0};
+	std::atomic<std::size_t> failed{0};
+	LatencyRecorder latencies;
+};
+
+/// Keeps depth requests in flight on a session until end, then waits for the
+/// rest of the replies.
+template <typename Write>
+void RunSession(Write write, std::size_t depth,
+								std::chrono::steady_clock::time_point end,
+								SessionStats *stats) {
+	using Clock = std::chrono::steady_clock;
+	struct Sent {
+		decltype(write()) reply;
+		Clock::time_point at;
+	};
+	std::deque<Sent> sent;
+	for (;;) {
+		auto now = Clock::now();
+		if (now < end && sent.size() < depth) {
+			sent.push_back({write(), now});
+			continue;
+		}
+		if (sent.empty())
+			return;
+		auto ok = sent.front().reply.get().status.ok();
+		stats->latencies.Record(Clock::now() - sent.front().at);
+		ok ? ++stats->replies : ++stats->failed;
+		sent.pop_front();
+	}
+}
+
+/// Many sessions of greetings from one client to one server, each session
+/// either its own SayHelloBidir stream or a channel of one SayHelloMux stream.
+/// Every session keeps --depth requests in flight for --duration-ms, except the
+/// first which keeps --hot-depth if set, to see whether one busy session slows
+/// the others down.
+///
+/// The server is in this process unless there's an --address. --max-streams
+/// limits the streams it allows on a connection at once, --mux-window,
+/// --mux-quantum and --mux-max-channels set up multiplexing.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto modes = flags.GetList<std::string>("modes", {"streams", "mux"});
+	auto sessions = std::max(flags.Get("sessions", 64), 1);
+	auto depth = flags.Get<std::size_t>("depth", 1);
+	auto hot_depth = flags.Get<std::size_t>("hot-depth", 0);
+	auto duration = std::chrono::milliseconds(flags.Get("duration-ms", 3000));
+	MuxOptions mux_options;
+	mux_options.window = flags.Get("mux-window", mux_options.window);
+	mux_options.quantum = flags.Get("mux-quantum", mux_options.quantum);
+	mux_options.max_channels =
+			flags.Get("mux-max-channels", mux_options.max_channels);
+
+	// Any server serving SayHelloMux and SayHelloBidir, such as
+	// server_stream_bidir, or one in this process.
+	auto address = flags.Get("address", "");
+	Greeter::AsyncService service;
+	std::unique_ptr<grpc::Server> server;
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> server_cqs;
+	Poller poller;
+	std::vector<std::thread> threads;
+	if (address.empty()) {
+		grpc::ServerBuilder builder;
+		int port = 0;
+		builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+														 &port);
+		builder.RegisterService(&service);
+		if (auto max_streams = flags.Get("max-streams", 0))
+			builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, max_streams);
+		for (auto i = 0; i < flags.Get("server-threads", 2); ++i) {
+			server_cqs.emplace_back(builder.AddCompletionQueue());
+		}
+		server = builder.BuildAndStart();
+		for (auto &cq : server_cqs) {
+			Listen<&Greeter::AsyncService::RequestSayHelloBidir, Echo>(&service,
+																																 cq.get());
+			std::make_shared<SayHelloMuxServer>(&service, cq.get(), mux_options)
+					->Start();
+			threads.emplace_back([&poller, cq = cq.get()] { poller.Run(cq); });
+		}
+		address = "127.0.0.1:" + std::to_string(port);
+	}
+
+	// One channel, so every session shares a connection either way.
+	auto channel =
+			grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+	grpc::CompletionQueue cq;
+	for (auto i = 0; i < flags.Get("client-threads", 2); ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+
+	for (auto &mode : modes) {
+		SessionStats hot, cold;
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + duration;
+		std::vector<std::thread> session_threads;
+		auto depth_of = [&](int session) {
+			return session == 0 && hot_depth ? hot_depth : depth;
+		};
+		auto stats_of = [&](int session) {
+			return session == 0 && hot_depth ? &hot : &cold;
+		};
+		if (mode == "streams") {
+			for (auto s = 0; s < sessions; ++s) {
+				auto client = std::make_shared<SayHelloBidirClient>(
+						channel, &cq, std::max(depth, hot_depth) + 1);
+				client->Start();
+				session_threads.emplace_back([&, s, client] {
+					RunSession([&] { return client->Write("world"); }, depth_of(s), end,
+										 stats_of(s));
+					// Every reply is in so nothing is lost, and servers that never finish
+					// their streams are covered. Makes room for sessions waiting for a
+					// stream past --max-streams.
+					auto finished = client->Finished();
+					client->Cancel();
+					finished.wait();
+				});
+			}
+			for (auto &t : session_threads) {
+				t.join();
+			}
+		} else if (mode == "mux") {
+			auto client = std::make_shared<SayHelloMuxClient>(channel, &cq,
+																												mux_options.quantum);
+			client->Start();
+			for (auto s = 0; s < sessions; ++s) {
+				session_threads.emplace_back([&, s, id = client->Open()] {
+					RunSession([&] { return client->Write(id, "world"); }, depth_of(s),
+										 end, stats_of(s));
+					client->Close(id);
+				});
+			}
+			for (auto &t : session_threads) {
+				t.join();
+			}
+			auto finished = client->Finished();
+			client->WritesDone();
+			finished.wait();
+		} else {
+			continue;
+		}
+		auto elapsed = std::chrono::duration<double>(
+											 std::chrono::steady_clock::now() - start)
+											 .count();
+		std::cout << mode
+							<< " replies/s: " << (hot.replies + cold.replies) / elapsed
+							<< " failed: " << hot.failed + cold.failed << std::endl;
+		std::cout << "  sessions " << cold.latencies << std::endl;
+		if (hot_depth)
+			std::cout << "  hot session " << hot.latencies << std::endl;
+	}
+
+	if (server)
+		server->Shutdown();
+	for (auto &server_cq : server_cqs) {
+		server_cq->Shutdown();
+	}
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	return 0;
+}
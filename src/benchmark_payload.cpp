@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "flags.hpp"
+#include "payload.hpp"
+
+using grpc::ClientContext;
+using grpc::ServerContext;
+using grpc::Status;
+using helloworld::Greeter;
+using helloworld::PayloadReply;
+using helloworld::PayloadRequest;
+
+/// Replies with payloads of the size asked for. Client streams get a small
+/// reply once everything has been read and bidi streams get a reply of the
+/// same size for every request.
+class PayloadGreeter final : public Greeter::Service {
+	Status Payload(ServerContext *context, const PayloadRequest *request,
+								 PayloadReply *reply) override {
+		Fill(reply, request->reply_size(), request->reply_chunk_size());
+		return Status::OK;
+	}
+	Status Payloads(ServerContext *context, const PayloadRequest *request,
+									grpc::ServerWriter<PayloadReply> *writer) override {
+		PayloadReply reply;
+		Fill(&reply, request->reply_size(), request->reply_chunk_size());
+		for (std::uint32_t i = 0; i < request->reply_count(); ++i) {
+			if (!writer->Write(reply))
+				break;
+		}
+		return Status::OK;
+	}
+	Status PayloadsClient(ServerContext *context,
+												grpc::ServerReader<PayloadRequest> *reader,
+												PayloadReply *reply) override {
+		PayloadRequest request;
+		while (reader->Read(&request)) {
+		}
+		return Status::OK;
+	}
+	Status PayloadBidir(
+			ServerContext *context,
+			grpc::ServerReaderWriter<PayloadReply, PayloadRequest> *stream) override {
+		PayloadRequest request;
+		PayloadReply reply;
+		while (stream->Read(&request)) {
+			Fill(&reply, request.reply_size(), request.reply_chunk_size());
+			if (!stream->Write(reply))
+				break;
+		}
+		return Status::OK;
+	}
+};
+
+/// Sends count messages of size bytes with one of the four call shapes.
+/// @param chunk_size Splits payloads into repeated chunks of this size if set
+/// @return Whether every call succeeded
+using Shape = bool (*)(Greeter::Stub *stub, std::size_t size,
+											 std::size_t chunk_size, int count);
+
+PayloadRequest MakeRequest(std::size_t size, std::size_t reply_size,
+													 std::size_t chunk_size) {
+	PayloadRequest request;
+	Fill(&request, size, chunk_size);
+	request.set_reply_size(reply_size);
+	request.set_reply_chunk_size(chunk_size);
+	return request;
+}
+
+bool Unary(Greeter::Stub *stub, std::size_t size,
+					 std::size_t chunk_size, int count) {
+	auto request = MakeRequest(size, size, chunk_size);
+	PayloadReply reply;
+	for (auto i = 0; i < count; ++i) {
+		ClientContext context;
+		if (!stub->Payload(&context, request, &reply).ok())
+			return false;
+	}
+	return true;
+}
+
+bool ServerStream(Greeter::Stub *stub, std::size_t size,
+									std::size_t chunk_size, int count) {
+	auto request = MakeRequest(0, size, chunk_size);
+	request.set_reply_count(count);
+	ClientContext context;
+	auto reader = stub->Payloads(&context, request);
+	PayloadReply reply;
+	auto read = 0;
+	while (reader->Read(&reply)) {
+		++read;
+	}
+	return reader->Finish().ok() && read == count;
+}
+
+bool ClientStream(Greeter::Stub *stub, std::size_t size,
+									std::size_t chunk_size, int count) {
+	auto request = MakeRequest(size, 0, chunk_size);
+	PayloadReply reply;
+	ClientContext context;
+	auto writer = stub->PayloadsClient(&context, &reply);
+	for (auto i = 0; i < count; ++i) {
+		if (!writer->Write(request))
+			break;
+	}
+	writer->WritesDone();
+	return writer->Finish().ok();
+}
+
+bool Bidi(Greeter::Stub *stub, std::size_t size,
+					std::size_t chunk_size, int count) {
+	auto request = MakeRequest(size, size, chunk_size);
+	ClientContext context;
+	auto stream = stub->PayloadBidir(&context);
+	// Writes and reads overlap like a real pipelined stream.
+	std::thread writer([&] {
+		for (auto i = 0; i < count; ++i) {
+			if (!stream->Write(request))
+				break;
+		}
+		stream->WritesDone();
+	});
+	PayloadReply reply;
+	auto read = 0;
+	while (stream->Read(&reply)) {
+		++read;
+	}
+	writer.join();
+	return stream->Finish().ok() && read == count;
+}
+
+/// Sizes from 16 B to 16 MB for every call shape, against a server in the same
+/// process or the one at --address. Prints how many messages and bytes a second
+/// each one manages.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto sizes = flags.GetList<std::size_t>(
+			"sizes", {16, 256, 4 << 10, 64 << 10, 1 << 20, 16 << 20});
+	// Roughly how much each case sends, so small messages get more of them.
+	auto bytes_per_case = flags.Get<std::size_t>("bytes", 256 << 20);
+	auto max_messages = flags.Get("max-messages", 20000);
+	auto min_messages = flags.Get("min-messages", 8);
+	auto chunk_size = flags.Get<std::size_t>("chunk-size", 0);
+	auto shapes_wanted = flags.GetList<std::string>(
+			"shapes", {"unary", "server", "client", "bidi"});
+
+	// Larger than the biggest payload plus framing.
+	auto max_size = static_cast<int>(
+			*std::max_element(sizes.begin(), sizes.end()) + (1 << 20));
+	// Any server serving the payload methods, or one in this process.
+	auto address = flags.Get("address", "");
+	PayloadGreeter service;
+	std::unique_ptr<grpc::Server> server;
+	if (address.empty()) {
+		grpc::ServerBuilder builder;
+		int port = 0;
+		builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+														 &port);
+		builder.RegisterService(&service);
+		builder.SetMaxReceiveMessageSize(max_size);
+		builder.SetMaxSendMessageSize(max_size);
+		server = builder.BuildAndStart();
+		address = "127.0.0.1:" + std::to_string(port);
+	}
+
+	grpc::ChannelArguments args;
+	args.SetMaxReceiveMessageSize(max_size);
+	args.SetMaxSendMessageSize(max_size);
+	auto stub = Greeter::NewStub(grpc::CreateCustomChannel(
+			address, grpc::InsecureChannelCredentials(), args));
+
+	struct NamedShape {
+		char const *name;
+		Shape run;
+	};
+	std::vector<NamedShape> shapes;
+	for (auto &name : shapes_wanted) {
+		if (name == "unary")
+			shapes.push_back({"unary", Unary});
+		else if (name == "server")
+			shapes.push_back({"server", ServerStream});
+		else if (name == "client")
+			shapes.push_back({"client", ClientStream});
+		else if (name == "bidi")
+			shapes.push_back({"bidi", Bidi});
+	}
+
+	std::cout << std::left << std::setw(8) << "shape" << std::right
+						<< std::setw(10) << "size" << std::setw(10) << "messages"
+						<< std::setw(14) << "msg/s" << std::setw(12) << "MB/s"
+						<< std::setw(12) << "us/msg" << std::endl;
+	for (auto &shape : shapes) {
+		for (auto size : sizes) {
+			auto count = static_cast<int>(std::clamp<std::size_t>(
+					bytes_per_case / std::max<std::size_t>(size, 1), min_messages,
+					max_messages));
+			// Warm up the connection and allocator.
+			shape.run(stub.get(), size, chunk_size, std::min(count, 4));
+			auto start = std::chrono::steady_clock::now();
+			auto ok = shape.run(stub.get(), size, chunk_size, count);
+			auto elapsed = std::chrono::duration<double>(
+												 std::chrono::steady_clock::now() - start)
+												 .count();
+			std::cout << std::left << std::setw(8) << shape.name << std::right
+								<< std::setw(10) << size << std::setw(10) << count
+								<< std::setw(14) << std::fixed << std::setprecision(0)
+								<< count / elapsed << std::setw(12) << std::setprecision(1)
+								<< count * double(size) / elapsed / (1 << 20)
+								<< std::setw(12) << std::setprecision(2)
+								<< elapsed / count * 1e6 << (ok ? "" : " failed")
+								<< std::defaultfloat << std::endl;
+		}
+	}
+	if (server)
+		server->Shutdown();
+	return 0;
+}
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "async_call.hpp"
+#include "bidi_client.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "priority.hpp"
+#include "stats.hpp"
+
+using grpc::ServerContext;
+using grpc::Status;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+/// SayHello, high priority as a unary method.
+class Greet {
+public:
+	Status OnRequest(ServerContext &context, HelloRequest const &request,
+									 HelloReply &reply) {
+		reply.set_message("hello " + request.name());
+		reply.set_id(request.id());
+		return Status::OK;
+	}
+};
+
+/// SayHelloBidir replying to every request, low priority as a stream.
+class Echo {
+public:
+	Status OnRead(HelloRequest const &request, Replies<HelloReply> &replies) {
+		auto &reply = replies.emplace_back();
+		reply.set_message("You sent: " + request.name());
+		reply.set_id(request.id());
+		return Status::OK;
+	}
+	Status OnReadsDone(Replies<HelloReply> &replies) { return Status::OK; }
+};
+
+/// Server in this process dispatching with options.
+class TestServer {
+public:
+	TestServer(PriorityOptions options, int threads) : dispatcher(options) {
+		grpc::ServerBuilder builder;
+		builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+														 &port);
+		builder.RegisterService(&service);
+		for (auto i = 0; i < threads; ++i) {
+			cqs.emplace_back(builder.AddCompletionQueue());
+		}
+		server = builder.BuildAndStart();
+		for (auto &cq : cqs) {
+			for (auto i = 0; i < 16; ++i) {
+				Listen<&Greeter::AsyncService::RequestSayHello, Greet>(&service,
+																															 cq.get());
+			}
+			Listen<&Greeter::AsyncService::RequestSayHelloBidir, Echo>(&service,
+																																	cq.get());
+			this->threads.emplace_back(
+					[this, cq = cq.get()] { dispatcher.Run(cq); });
+		}
+	}
+	~TestServer() {
+		server->Shutdown();
+		for (auto &cq : cqs) {
+			cq->Shutdown();
+		}
+		for (auto &t : threads) {
+			t.join();
+		}
+	}
+	std::string Address() const { return "127.0.0.1:" + std::to_string(port); }
+	PriorityDispatcher &Dispatcher() { return dispatcher; }
+
+private:
+	Greeter::AsyncService service;
+	std::unique_ptr<grpc::Server> server;
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	PriorityDispatcher dispatcher;
+	std::vector<std::thread> threads;
+	int port = 0;
+};
+
+/// Keeps depth requests in flight on a stream until end, then waits for the
+/// rest of the replies.
+/// @return Replies received
+std::size_t Flood(SayHelloBidirClient *client, std::size_t depth,
+									std::chrono::steady_clock::time_point end) {
+	std::deque<std::future<SayHelloBidirClient::Result>> sent;
+	std::size_t replies = 0;
+	for (;;) {
+		if (std::chrono::steady_clock::now() < end && sent.size() < depth) {
+			sent.push_back(client->Write("flood"));
+			continue;
+		}
+		if (sent.empty())
+			return replies;
+		replies += sent.front().get().status.ok();
+		sent.pop_front();
+	}
+}
+
+/// Unary SayHello latency while SayHelloBidir streams flood the same server.
+/// For each of --modes a server in this process is started:
+/// - alone: no flood, for the latency to compare against
+/// - fifo: every event dispatched in the order of the completion queue
+/// - priority: events dispatched by priority, see PriorityDispatcher
+///
+/// --streams streams (16) each keep --depth requests (32) in flight while
+/// --unary-clients threads (1) send a SayHello every --interval-us (1000), for
+/// --duration-ms. --unary-priority=low sends the unary calls at low priority
+/// with metadata. The server polls with --server-threads threads (1) and takes
+/// the --priority-* flags.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto modes =
+			flags.GetList<std::string>("modes", {"alone", "fifo", "priority"});
+	auto streams = flags.Get("streams", 16);
+	auto depth = std::max<std::size_t>(flags.Get<std::size_t>("depth", 32), 1);
+	auto unary_clients = std::max(flags.Get("unary-clients", 1), 1);
+	auto interval = std::chrono::microseconds(flags.Get("interval-us", 1000));
+	auto duration = std::chrono::milliseconds(flags.Get("duration-ms", 3000));
+	auto unary_priority = flags.Get("unary-priority", "");
+	auto server_threads = std::max(flags.Get("server-threads", 1), 1);
+	auto options = PriorityOptionsFromFlags(flags);
+
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < flags.Get("client-threads", 2); ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+
+	for (auto &mode : modes) {
+		if (mode != "alone" && mode != "fifo" && mode != "priority")
+			continue;
+		auto mode_options = options;
+		mode_options.enabled = mode != "fifo";
+		TestServer server(mode_options, server_threads);
+		// Separate connections, so the unary calls don't queue behind the flood
+		// on the client. Channels with different arguments don't share one.
+		auto flood_channel = grpc::CreateChannel(
+				server.Address(), grpc::InsecureChannelCredentials());
+		grpc::ChannelArguments args;
+		args.SetInt("unary", 1);
+		auto unary_channel = grpc::CreateCustomChannel(
+				server.Address(), grpc::InsecureChannelCredentials(), args);
+
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + duration;
+		std::atomic<std::size_t> flood_replies{0};
+		std::vector<std::thread> flood_threads;
+		if (mode != "alone") {
+			for (auto s = 0; s < streams; ++s) {
+				flood_threads.emplace_back([&] {
+					auto client =
+							std::make_shared<SayHelloBidirClient>(flood_channel, &cq, depth);
+					client->Start();
+					flood_replies += Flood(client.get(), depth, end);
+					auto finished = client->Finished();
+					client->WritesDone();
+					finished.wait();
+				});
+			}
+		}
+
+		LatencyRecorder latencies;
+		std::atomic<std::size_t> failed{0};
+		std::vector<std::thread> unary_threads;
+		for (auto u = 0; u < unary_clients; ++u) {
+			unary_threads.emplace_back([&] {
+				auto stub = Greeter::NewStub(unary_channel);
+				while (std::chrono::steady_clock::now() < end) {
+					grpc::ClientContext context;
+					if (!unary_priority.empty())
+						context.AddMetadata(kPriorityKey, unary_priority);
+					HelloRequest request;
+					request.set_name("world");
+					HelloReply reply;
+					auto sent = std::chrono::steady_clock::now();
+					auto status = stub->SayHello(&context, request, &reply);
+					latencies.Record(std::chrono::steady_clock::now() - sent);
+					if (!status.ok())
+						++failed;
+					std::this_thread::sleep_for(interval);
+				}
+			});
+		}
+		for (auto &t : unary_threads) {
+			t.join();
+		}
+		for (auto &t : flood_threads) {
+			t.join();
+		}
+		auto elapsed = std::chrono::duration<double>(
+											 std::chrono::steady_clock::now() - start)
+											 .count();
+		std::cout << mode << " flood replies/s: " << flood_replies / elapsed
+							<< " unary failed: " << failed << std::endl;
+		std::cout << "  unary " << latencies << std::endl;
+		if (mode_options.enabled)
+			server.Dispatcher().Report(std::cout);
+	}
+
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	return 0;
+}
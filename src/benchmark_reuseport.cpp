@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "async_call.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "supervisor.hpp"
+#include "unary_load.hpp"
+
+using grpc::ServerContext;
+using grpc::Status;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+class Greet {
+public:
+	Status OnRequest(ServerContext &context, HelloRequest const &request,
+									 HelloReply &reply) {
+		reply.set_message("hello " + request.name());
+		reply.set_id(request.id());
+		return Status::OK;
+	}
+};
+
+namespace {
+std::atomic<bool> shutdown_requested{false};
+extern "C" void RequestShutdown(int) { shutdown_requested = true; }
+} // namespace
+
+/// Worker serving SayHello on port with num_cqs completion queues, each with a
+/// thread, until SIGTERM.
+int Serve(int port, int num_cqs, std::function<void()> ready) {
+	std::signal(SIGTERM, RequestShutdown);
+	Greeter::AsyncService service;
+	grpc::ServerBuilder builder;
+	builder.AddListeningPort("127.0.0.1:" + std::to_string(port),
+													 grpc::InsecureServerCredentials());
+	builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 1);
+	builder.RegisterService(&service);
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	for (auto i = 0; i < num_cqs; ++i) {
+		cqs.emplace_back(builder.AddCompletionQueue());
+	}
+	auto server = builder.BuildAndStart();
+	if (!server)
+		return 1;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto &cq : cqs) {
+		for (auto i = 0; i < 16; ++i) {
+			Listen<&Greeter::AsyncService::RequestSayHello, Greet>(&service,
+																														 cq.get());
+		}
+		threads.emplace_back([&poller, cq = cq.get()] { poller.Run(cq); });
+	}
+	ready();
+	while (!shutdown_requested) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	server->Shutdown();
+	for (auto &cq : cqs) {
+		cq->Shutdown();
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	return 0;
+}
+
+/// Loopback unary load against the same server run two ways: one process with
+/// --processes completion queues and threads (4), on --port (50061), and
+/// --processes processes with one each sharing --port + 1 through SO_REUSEPORT.
+/// Each is loaded from --channels connections (16) at every --concurrency
+/// level, for --duration-ms after --warmup-ms, from --threads client threads.
+///
+/// The kernel spreads connections over the processes, so use several channels
+/// per process.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto processes = std::max(flags.Get("processes", 4), 1);
+	auto port = flags.Get("port", 50061);
+	auto levels = flags.GetList<int>("concurrency", {16, 64, 256});
+	auto warmup = std::chrono::milliseconds(flags.Get("warmup-ms", 1000));
+	auto duration = std::chrono::milliseconds(flags.Get("duration-ms", 3000));
+	auto timeout = std::chrono::milliseconds(flags.Get("timeout-ms", 10000));
+
+	// Both are forked before this process uses gRPC.
+	SupervisorOptions one_options;
+	one_options.workers = 1;
+	Supervisor one(one_options, [&](int, std::function<void()> ready) {
+		return Serve(port, processes, ready);
+	});
+	SupervisorOptions many_options;
+	many_options.workers = processes;
+	Supervisor many(many_options, [&](int, std::function<void()> ready) {
+		return Serve(port + 1, 1, ready);
+	});
+	if (!one.Start() || !many.Start()) {
+		std::cerr << "servers didn't start" << std::endl;
+		return 1;
+	}
+
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < flags.Get("threads", 4); ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+	struct Setup {
+		std::string label;
+		int port;
+	};
+	for (auto &setup :
+			 {Setup{"1 process x " + std::to_string(processes) + " threads", port},
+				Setup{std::to_string(processes) + " processes x 1 thread", port + 1}}) {
+		auto stubs = MakeStubs("127.0.0.1:" + std::to_string(setup.port),
+													 flags.Get("channels", 16));
+		for (auto concurrency : levels) {
+			Load load{stubs, &cq, timeout};
+			auto elapsed = RunLoad(&load, concurrency, warmup, duration);
+			std::cout << setup.label << " concurrency: " << concurrency
+								<< " qps: " << load.succeeded / elapsed
+								<< " failed: " << load.failed << " " << load.latencies
+								<< std::endl;
+		}
+	}
+
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	one.Stop();
+	many.Stop();
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "flags.hpp"
+#include "reply_template.hpp"
+
+using helloworld::HelloReply;
+
+/// Bytes of buffer as a string.
+std::string Bytes(grpc::ByteBuffer const &buffer) {
+	std::vector<grpc::Slice> slices;
+	buffer.Dump(&slices);
+	std::string bytes;
+	for (auto &slice : slices) {
+		bytes.append(reinterpret_cast<char const *>(slice.begin()), slice.size());
+	}
+	return bytes;
+}
+
+/// Serializes with protobuf, the way a reply is built and written without a
+/// template.
+grpc::ByteBuffer Protobuf(std::string const &prefix, std::string const &suffix,
+													std::uint64_t id) {
+	HelloReply reply;
+	reply.set_message(prefix + suffix);
+	reply.set_id(id);
+	grpc::ByteBuffer buffer;
+	bool own_buffer;
+	grpc::SerializationTraits<HelloReply>::Serialize(reply, &buffer, &own_buffer);
+	return buffer;
+}
+grpc::ByteBuffer Templated(HelloReplyTemplate const &reply_template,
+													 std::string const &suffix, std::uint64_t id) {
+	grpc::ByteBuffer buffer;
+	bool own_buffer;
+	grpc::SerializationTraits<TemplatedHelloReply>::Serialize(
+			{&reply_template, suffix, id}, &buffer, &own_buffer);
+	return buffer;
+}
+
+/// Checks the template writes the same bytes as protobuf, for empty fields and
+/// lengths and ids around every varint size up to several bytes.
+/// @return Mismatches, each printed
+std::size_t Validate() {
+	std::vector<std::string> prefixes{"", "hello ", "You sent: ",
+																		std::string(200, 'p')};
+	std::vector<std::size_t> lengths{0,		 1,		5,		100,	 121,
+																	 127,	128,	200,	16383, 16384,
+																	 70000, 2100000};
+	std::vector<std::uint64_t> ids{0, 1, 127, 128, 16384, std::uint64_t(1) << 35,
+																 ~std::uint64_t(0)};
+	std::size_t mismatches = 0;
+	for (auto &prefix : prefixes) {
+		HelloReplyTemplate reply_template(prefix);
+		for (auto length : lengths) {
+			// Not just ASCII, but valid UTF-8 so protobuf parses it back.
+			std::string suffix(length % 2, 'a');
+			for (std::size_t i = 0; i < length / 2; ++i) {
+				suffix += "\xc3\xa9";
+			}
+			for (auto id : ids) {
+				auto expected = Bytes(Protobuf(prefix, suffix, id));
+				auto actual = Bytes(Templated(reply_template, suffix, id));
+				HelloReply parsed;
+				if (actual != expected || !parsed.ParseFromString(actual) ||
+						parsed.message() != prefix + suffix || parsed.id() != id) {
+					++mismatches;
+					std::cerr << "mismatch for prefix of " << prefix.size()
+										<< " bytes, suffix of " << length << " bytes, id " << id
+										<< ": " << actual.size() << " bytes, protobuf wrote "
+										<< expected.size() << std::endl;
+				}
+			}
+		}
+	}
+	return mismatches;
+}
+
+/// Checks HelloReplyTemplate against protobuf, then times how long each takes
+/// to serialize a reply of --prefix followed by names of --name-sizes bytes
+/// (5,100,1000), --iterations times (1000000). Exits with 1 if the bytes
+/// differ.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto prefix = flags.Get("prefix", "hello ");
+	auto sizes = flags.GetList<std::size_t>("name-sizes", {5, 100, 1000});
+	auto iterations = flags.Get<std::size_t>("iterations", 1000000);
+
+	auto mismatches = Validate();
+	std::cout << "validation: " << (mismatches ? "FAILED" : "ok") << std::endl;
+	if (mismatches)
+		return 1;
+
+	HelloReplyTemplate reply_template(prefix);
+	for (auto size : sizes) {
+		std::string name(size, 'n');
+		auto time = [&](char const *what, auto serialize) {
+			std::size_t bytes = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (std::size_t i = 0; i < iterations; ++i) {
+				bytes += serialize(i + 1).Length();
+			}
+			std::chrono::duration<double, std::nano> elapsed =
+					std::chrono::steady_clock::now() - start;
+			std::cout << what << " name bytes: " << size
+								<< " ns/reply: " << elapsed.count() / iterations
+								<< " bytes/reply: " << bytes / iterations << std::endl;
+		};
+		time("protobuf",
+				 [&](std::uint64_t id) { return Protobuf(prefix, name, id); });
+		time("template", [&](std::uint64_t id) {
+			return Templated(reply_template, name, id);
+		});
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "flags.hpp"
+#include "poller.hpp"
+#include "unary_load.hpp"
+
+/// Closed loop unary load against a running server, at each concurrency level
+/// in turn. Start the server to measure first, for example
+/// `server_sync --max-pollers=8` or `server`.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto address = flags.Get("address", "localhost:50051");
+	auto levels = flags.GetList<int>("concurrency", {1, 4, 16, 64, 256});
+	auto warmup = std::chrono::milliseconds(flags.Get("warmup-ms", 1000));
+	auto duration = std::chrono::milliseconds(flags.Get("duration-ms", 5000));
+	auto num_channels = flags.Get("channels", 4);
+	auto num_threads = flags.Get("threads", 4);
+	auto label = flags.Get("label", address.c_str());
+
+	auto stubs = MakeStubs(address, num_channels);
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < num_threads; ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+
+	auto timeout = std::chrono::milliseconds(flags.Get("timeout-ms", 10000));
+	for (auto concurrency : levels) {
+		Load load{stubs, &cq, timeout};
+		auto elapsed = RunLoad(&load, concurrency, warmup, duration);
+		std::cout << label << " concurrency: " << concurrency
+							<< " qps: " << load.succeeded / elapsed
+							<< " failed: " << load.failed << " " << load.latencies
+							<< std::endl;
+	}
+
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	return 0;
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+#include "mpsc_queue.hpp"
+
+/// SayHelloBidir stream that any number of threads can send requests on, each
+/// getting a future for its reply.
+///
+/// Requests are queued without locking and written one at a time by whichever
+/// thread gets to be the writer: the one that queued into an idle stream, or
+/// the poller finishing the previous write. Each request gets an id the server
+/// copies into its reply. Replies are expected in the order the requests were
+/// written, so the oldest entry of the correlation table is checked first, but
+/// any order works.
+///
+/// At most max_outstanding requests are queued or waiting for replies, and
+/// Write blocks while that many are.
+class SayHelloBidirClient
+		: public std::enable_shared_from_this<SayHelloBidirClient> {
+public:
+	struct Result {
+		grpc::Status status;
+		helloworld::HelloReply reply;
+	};
+
+	SayHelloBidirClient(std::shared_ptr<grpc::Channel> channel,
+											grpc::CompletionQueue *cq,
+											std::size_t max_outstanding = 1024)
+			: stub(helloworld::Greeter::NewStub(channel)), cq(cq),
+				max_outstanding(std::max<std::size_t>(max_outstanding, 1)) {}
+
+	/// Two stage initialization because shared_from_this is used.
+	void Start() {
+		stream = stub->PrepareAsyncSayHelloBidir(&context, cq);
+		stream->StartCall(OnCreate());
+	}
+
+	/// Sends request, safe from any thread. The id is filled in.
+	std::future<Result> Write(helloworld::HelloRequest request) {
+		Submission submission;
+		auto future = submission.promise.get_future();
+		if (closing || !AcquireSlot()) {
+			submission.promise.set_value({Unavailable("stream closed"), {}});
+			return future;
+		}
+		// WritesDone may have been called while waiting for the slot.
+		if (closing) {
+			ReleaseSlot();
+			submission.promise.set_value({Unavailable("stream closed"), {}});
+			return future;
+		}
+		request.set_id(next_id.fetch_add(1, std::memory_order_relaxed));
+		submission.request = std::move(request);
+		queue.Push(std::move(submission));
+		queued.fetch_add(1);
+		TryWrite();
+		return future;
+	}
+	std::future<Result> Write(std::string name) {
+		helloworld::HelloRequest request;
+		request.set_name(std::move(name));
+		return Write(std::move(request));
+	}
+	/// Half closes the stream once everything queued has been written. Later
+	/// writes fail straight away.
+	void WritesDone() {
+		closing = true;
+		{
+			// Wake writers waiting for room so they see the stream is closing.
+			std::lock_guard l{slot_mutex};
+			slot_freed.notify_all();
+		}
+		TryWrite();
+	}
+	/// Ends the stream now. Requests without replies fail with CANCELLED.
+	void Cancel() { context.TryCancel(); }
+
+	/// Requests queued or waiting for their reply.
+	std::size_t Outstanding() const { return outstanding.load(); }
+	/// Ready with the status of the stream once it has ended. Only call once.
+	std::future<grpc::Status> Finished() { return finished_promise.get_future(); }
+
+private:
+	struct Submission {
+		helloworld::HelloRequest request;
+		std::promise<Result> promise;
+	};
+	struct Waiting {
+		std::uint64_t id;
+		std::promise<Result> promise;
+	};
+
+	Handler *OnCreate() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			stream->Read(&reply, OnRead());
+			created = true;
+			TryWrite();
+		});
+	}
+	Handler *OnWrite() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				// The stream is broken, so the read fails and finishes it.
+				broken = true;
+			}
+			writing.store(false);
+			TryWrite();
+		});
+	}
+	Handler *OnWritesDone() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			writing.store(false);
+			// Fails anything queued after the half close.
+			TryWrite();
+		});
+	}
+	Handler *OnRead() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			std::promise<Result> promise;
+			bool found = false;
+			{
+				std::lock_guard l{waiting_mutex};
+				// Servers that don't copy the id reply in order.
+				auto it = waiting.begin();
+				if (reply.id() != 0 && it != waiting.end() && it->id != reply.id()) {
+					it = std::find_if(waiting.begin(), waiting.end(), [&](auto &w) {
+						return w.id == reply.id();
+					});
+				}
+				if (it != waiting.end()) {
+					promise = std::move(it->promise);
+					waiting.erase(it);
+					found = true;
+				}
+			}
+			if (found) {
+				promise.set_value({grpc::Status::OK, std::move(reply)});
+				ReleaseSlot();
+			}
+			reply.Clear();
+			stream->Read(&reply, OnRead());
+		});
+	}
+	Handler *OnFinish() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			auto result = status.ok() ? Unavailable("stream ended before reply")
+																: status;
+			std::deque<Waiting> failed;
+			{
+				std::lock_guard l{waiting_mutex};
+				finished = true;
+				failed.swap(waiting);
+			}
+			for (auto &w : failed) {
+				w.promise.set_value({result, {}});
+				ReleaseSlot();
+			}
+			{
+				// Wake writers waiting for room so they see the stream is over.
+				std::lock_guard l{slot_mutex};
+				slot_freed.notify_all();
+			}
+			TryWrite();
+			finished_promise.set_value(status);
+		});
+	}
+
+	/// Becomes the writer if nobody is and writes the next request. Fails
+	/// whatever is queued once the stream is over.
+	///
+	/// queued and writing are seq_cst: the writer stores writing then loads
+	/// queued, a producer adds to queued then exchanges writing. With
+	/// release/acquire the writer's store and load could be reordered, both
+	/// would see the other as busy and a request would be left with no writer.
+	void TryWrite() {
+		while (queued.load() > 0 ||
+					 (closing && !writes_done)) {
+			if (!created && !finished)
+				return;
+			if (writing.exchange(true))
+				return;
+			if (WriteNext())
+				return;
+			writing.store(false);
+			// Nothing was popped, a push may not have finished linking yet. The
+			// thread pushing it tries again once it has.
+			if (queued.load() == 0 || !created)
+				return;
+		}
+	}
+	/// Called only by the writer.
+	/// @return Whether an operation was started, which keeps the writer busy
+	bool WriteNext() {
+		Submission submission;
+		while (queue.Pop(submission)) {
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			// Queued by a Write that checked closing just before WritesDone.
+			bool over = broken || writes_done;
+			{
+				// In the table before the write so the reply always finds it, unless
+				// OnFinish has already failed everything in it.
+				std::lock_guard l{waiting_mutex};
+				over = over || finished;
+				if (!over) {
+					waiting.push_back(
+							{submission.request.id(), std::move(submission.promise)});
+				}
+			}
+			if (over) {
+				submission.promise.set_value({Unavailable("stream closed"), {}});
+				ReleaseSlot();
+				continue;
+			}
+			current = std::move(submission.request);
+			stream->Write(current, OnWrite());
+			return true;
+		}
+		if (closing && queued == 0 && !writes_done && !finished && !broken) {
+			writes_done = true;
+			stream->WritesDone(OnWritesDone());
+			return true;
+		}
+		return false;
+	}
+
+	bool AcquireSlot() {
+		auto n = outstanding.load();
+		for (;;) {
+			if (n < max_outstanding) {
+				if (outstanding.compare_exchange_weak(n, n + 1))
+					return true;
+				continue;
+			}
+			std::unique_lock l{slot_mutex};
+			slot_freed.wait(l, [&] {
+				n = outstanding.load();
+				return n < max_outstanding || finished || closing;
+			});
+			if (finished || closing)
+				return false;
+		}
+	}
+	void ReleaseSlot() {
+		if (outstanding.fetch_sub(1) == max_outstanding) {
+			std::lock_guard l{slot_mutex};
+			slot_freed.notify_all();
+		}
+	}
+	static grpc::Status Unavailable(char const *why) {
+		return {grpc::StatusCode::UNAVAILABLE, why};
+	}
+
+private:
+	grpc::ClientContext context;
+	std::unique_ptr<helloworld::Greeter::Stub> stub;
+	grpc::CompletionQueue *cq;
+	std::unique_ptr<grpc::ClientAsyncReaderWriter<helloworld::HelloRequest,
+																								helloworld::HelloReply>>
+			stream;
+	grpc::Status status;
+	std::promise<grpc::Status> finished_promise;
+	helloworld::HelloReply reply;
+
+	MpscQueue<Submission> queue;
+	/// Pushes that have finished, so a pop is sure to find them.
+	std::atomic<std::size_t> queued{0};
+	/// Held by the thread writing, there's only ever one write in flight.
+	std::atomic<bool> writing{false};
+	/// Only used by the writer, stays alive until its write finishes.
+	helloworld::HelloRequest current;
+	std::atomic<bool> writes_done{false};
+	std::atomic<bool> created{false};
+	std::atomic<bool> closing{false};
+	std::atomic<bool> broken{false};
+	std::atomic<bool> finished{false};
+	std::atomic<std::uint64_t> next_id{1};
+
+	/// Written requests waiting for their reply, oldest first.
+	std::deque<Waiting> waiting;
+	std::mutex waiting_mutex;
+
+	std::size_t const max_outstanding;
+	std::atomic<std::size_t> outstanding{0};
+	std::mutex slot_mutex;
+	std::condition_variable slot_freed;
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+
+/// SayHellos is served raw so the hub can write the same serialized message to
+/// every subscriber instead of serializing it once per stream.
+using BroadcastService = helloworld::Greeter::WithRawMethod_SayHellos<
+		helloworld::Greeter::AsyncService>;
+
+/// What to do with a subscriber whose queue is full.
+enum class SlowSubscriberPolicy {
+	/// Drop the new message for that subscriber only.
+	Drop,
+	/// Cancel the subscriber's stream.
+	Disconnect,
+};
+
+struct BroadcastStats {
+	std::atomic<std::uint64_t> published{0};
+	/// Messages queued to a subscriber.
+	std::atomic<std::uint64_t> enqueued{0};
+	/// Messages written to a subscriber.
+	std::atomic<std::uint64_t> written{0};
+	/// Messages a slow subscriber didn't get.
+	std::atomic<std::uint64_t> dropped{0};
+	/// Subscribers cancelled for being too slow.
+	std::atomic<std::uint64_t> disconnected{0};
+	std::atomic<std::int64_t> subscribers{0};
+
+	friend std::ostream &operator<<(std::ostream &os, BroadcastStats const &s) {
+		return os << "subscribers: " << s.subscribers
+							<< " published: " << s.published << " enqueued: " << s.enqueued
+							<< " written: " << s.written << " dropped: " << s.dropped
+							<< " disconnected: " << s.disconnected;
+	}
+};
+
+class SayHellosSubscriber;
+
+/// Fans messages out from any number of producers to every subscribed
+/// SayHellos stream.
+///
+/// A message is serialized once into a ByteBuffer. Copying a ByteBuffer only
+/// takes a reference on its slices so all the subscribers share the same
+/// bytes.
+///
+/// Subscribers are kept in shards, one per completion queue, so streams that
+/// start and end on different queues don't fight over a lock.
+class BroadcastHub {
+public:
+	/// @param num_shards Usually the number of completion queues
+	/// @param queue_size Messages a subscriber can have waiting, including the
+	/// one being written
+	BroadcastHub(std::size_t num_shards, std::size_t queue_size,
+							 SlowSubscriberPolicy policy)
+			: shards(num_shards), queue_size(queue_size), policy(policy) {}
+
+	template <typename Message> void Publish(Message const &message) {
+		grpc::ByteBuffer buffer;
+		bool own_buffer;
+		grpc::SerializationTraits<Message>::Serialize(message, &buffer,
+																									&own_buffer);
+		Publish(std::make_shared<grpc::ByteBuffer const>(std::move(buffer)));
+	}
+	inline void Publish(std::shared_ptr<grpc::ByteBuffer const> const &message);
+
+	void Subscribe(std::size_t shard,
+								 std::shared_ptr<SayHellosSubscriber> const &subscriber) {
+		auto &s = shards[shard % shards.size()];
+		std::lock_guard l{s.mutex};
+		s.subscribers.emplace(subscriber.get(), subscriber);
+		++stats.subscribers;
+	}
+	void Unsubscribe(std::size_t shard, SayHellosSubscriber *subscriber) {
+		auto &s = shards[shard % shards.size()];
+		std::lock_guard l{s.mutex};
+		if (s.subscribers.erase(subscriber))
+			--stats.subscribers;
+	}
+
+	std::size_t QueueSize() const { return queue_size; }
+	SlowSubscriberPolicy Policy() const { return policy; }
+	BroadcastStats &Stats() { return stats; }
+
+private:
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<SayHellosSubscriber *,
+											 std::shared_ptr<SayHellosSubscriber>>
+				subscribers;
+	};
+	std::vector<Shard> shards;
+	std::size_t queue_size;
+	SlowSubscriberPolicy policy;
+	BroadcastStats stats;
+};
+
+/// A SayHellos stream that gets everything published to the hub until the
+/// client goes away.
+class SayHellosSubscriber
+		: public std::enable_shared_from_this<SayHellosSubscriber> {
+public:
+	/// @param shard Shard of the hub this stream goes into
+	SayHellosSubscriber(BroadcastService *service,
+											grpc::ServerCompletionQueue *cq, BroadcastHub *hub,
+											std::size_t shard)
+			: service(service), cq(cq), hub(hub), shard(shard), stream(&context) {}
+	/// Two stage initialization because shared_from_this is used.
+	void Start() {
+		context.AsyncNotifyWhenDone(OnDone());
+		service->RequestSayHellos(&context, &request, &stream, cq, cq, OnCreate());
+	}
+
+	/// Queue a message for this subscriber. Called by the hub from any thread.
+	void Offer(std::shared_ptr<grpc::ByteBuffer const> const &message) {
+		std::lock_guard l{write_mutex};
+		if (done)
+			return;
+		auto &stats = hub->Stats();
+		if (writes.size() >= hub->QueueSize()) {
+			if (hub->Policy() == SlowSubscriberPolicy::Drop) {
+				++stats.dropped;
+			} else if (!disconnecting) {
+				disconnecting = true;
+				++stats.disconnected;
+				stats.dropped += writes.size();
+				context.TryCancel();
+			}
+			return;
+		}
+		++stats.enqueued;
+		writes.push_back(message);
+		// Start writing unless a write is already in flight.
+		if (writes.size() == 1) {
+			stream.Write(*writes.front(), OnWrite());
+		}
+	}
+
+private: // Handlers
+	Handler *OnCreate() {
+		TraceTag tag{"SayHellos.OnCreate"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
+			if (ok) {
+				std::make_shared<SayHellosSubscriber>(service, cq, hub, shard)->Start();
+				stream.SendInitialMetadata(OnSendInitialMetadata());
+			}
+		});
+	}
+	Handler *OnSendInitialMetadata() {
+		TraceTag tag{"SayHellos.OnSendInitialMetadata"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
+			if (!ok)
+				return;
+			// Subscribing under write_mutex would invert the lock order used by
+			// Publish, so check afterwards whether OnDone got in first.
+			hub->Subscribe(shard, me);
+			bool finished;
+			{
+				std::lock_guard l{write_mutex};
+				finished = done;
+			}
+			if (finished)
+				hub->Unsubscribe(shard, this);
+		});
+	}
+	Handler *OnWrite() {
+		TraceTag tag{"SayHellos.OnWrite"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
+			std::lock_guard l{write_mutex};
+			if (!ok || done) {
+				// The stream is broken so there's no point keeping the rest.
+				writes.clear();
+				return;
+			}
+			++hub->Stats().written;
+			writes.pop_front();
+			if (!writes.empty()) {
+				stream.Write(*writes.front(), OnWrite());
+			}
+		});
+	}
+	Handler *OnDone() {
+		TraceTag tag{"SayHellos.OnDone"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
+			{
+				std::lock_guard l{write_mutex};
+				done = true;
+			}
+			// The hub's reference is dropped here so the stream is freed once the
+			// last in flight handler is done with it.
+			hub->Unsubscribe(shard, this);
+		});
+	}
+
+private:
+	BroadcastService *service;
+	grpc::ServerCompletionQueue *cq;
+	BroadcastHub *hub;
+	std::size_t shard;
+	grpc::ServerContext context;
+	grpc::ServerAsyncWriter<grpc::ByteBuffer> stream;
+	grpc::ByteBuffer request;
+	std::deque<std::shared_ptr<grpc::ByteBuffer const>> writes;
+	std::mutex write_mutex;
+	bool done = false;
+	bool disconnecting = false;
+};
+
+void BroadcastHub::Publish(
+		std::shared_ptr<grpc::ByteBuffer const> const &message) {
+	++stats.published;
+	for (auto &s : shards) {
+		std::lock_guard l{s.mutex};
+		for (auto &&[p, subscriber] : s.subscribers) {
+			subscriber->Offer(message);
+		}
+	}
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+/// Another program run in the background, such as a server to load. Its stdin
+/// is a pipe that Stop closes, which is how most of the servers here are told
+/// to shut down, and its output goes to a log file.
+class ChildProcess {
+public:
+	/// Starts program with args. Check Running() to see whether it did.
+	/// @param log File the output goes to, truncated first
+	ChildProcess(std::string const &program, std::vector<std::string> args,
+							 std::string const &log) {
+#ifdef _WIN32
+		std::string command = "\"" + program + "\"";
+		for (auto &arg : args) {
+			command += " \"" + arg + "\"";
+		}
+		SECURITY_ATTRIBUTES inherit{sizeof(inherit), nullptr, TRUE};
+		HANDLE read_end;
+		if (!CreatePipe(&read_end, &stdin_write, &inherit, 0))
+			return;
+		SetHandleInformation(stdin_write, HANDLE_FLAG_INHERIT, 0);
+		auto out = CreateFileA(log.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+													 &inherit, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+													 nullptr);
+		STARTUPINFOA startup{sizeof(startup)};
+		startup.dwFlags = STARTF_USESTDHANDLES;
+		startup.hStdInput = read_end;
+		startup.hStdOutput = out;
+		startup.hStdError = out;
+		PROCESS_INFORMATION info{};
+		if (CreateProcessA(nullptr, command.data(), nullptr, nullptr, TRUE, 0,
+											 nullptr, nullptr, &startup, &info)) {
+			process = info.hProcess;
+			CloseHandle(info.hThread);
+		}
+		CloseHandle(read_end);
+		if (out != INVALID_HANDLE_VALUE)
+			CloseHandle(out);
+#else
+		int fds[2];
+		if (pipe(fds) != 0)
+			return;
+		auto out = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, fds[0], 0);
+		if (out >= 0) {
+			posix_spawn_file_actions_adddup2(&actions, out, 1);
+			posix_spawn_file_actions_adddup2(&actions, out, 2);
+		}
+		posix_spawn_file_actions_addclose(&actions, fds[0]);
+		posix_spawn_file_actions_addclose(&actions, fds[1]);
+		if (out >= 0)
+			posix_spawn_file_actions_addclose(&actions, out);
+		std::vector<char *> argv{const_cast<char *>(program.c_str())};
+		for (auto &arg : args) {
+			argv.push_back(arg.data());
+		}
+		argv.push_back(nullptr);
+		if (posix_spawn(&pid, program.c_str(), &actions, nullptr, argv.data(),
+										environ) != 0)
+			pid = -1;
+		posix_spawn_file_actions_destroy(&actions);
+		close(fds[0]);
+		if (out >= 0)
+			close(out);
+		stdin_write = fds[1];
+#endif
+	}
+	~ChildProcess() { Stop(); }
+	ChildProcess(ChildProcess const &) = delete;
+	ChildProcess &operator=(ChildProcess const &) = delete;
+
+	bool Running() const {
+#ifdef _WIN32
+		return process && WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+#else
+		return pid > 0 && waitpid(pid, nullptr, WNOHANG) == 0;
+#endif
+	}
+
+	/// Closes its stdin, sends it SIGINT if that doesn't end it within a second,
+	/// then kills it if it hasn't exited within timeout.
+	/// @return Whether it exited by itself
+	bool Stop(std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+#ifdef _WIN32
+		if (stdin_write) {
+			CloseHandle(stdin_write);
+			stdin_write = nullptr;
+		}
+		if (!process)
+			return true;
+		auto exited = WaitForSingleObject(process, static_cast<DWORD>(
+																									 timeout.count())) ==
+									WAIT_OBJECT_0;
+		if (!exited)
+			TerminateProcess(process, 1);
+		CloseHandle(process);
+		process = nullptr;
+		return exited;
+#else
+		if (stdin_write >= 0) {
+			close(stdin_write);
+			stdin_write = -1;
+		}
+		if (pid <= 0)
+			return true;
+		auto start = std::chrono::steady_clock::now();
+		auto interrupted = false;
+		while (waitpid(pid, nullptr, WNOHANG) == 0) {
+			auto waited = std::chrono::steady_clock::now() - start;
+			if (!interrupted && waited >= std::chrono::seconds(1)) {
+				kill(pid, SIGINT);
+				interrupted = true;
+			}
+			if (waited >= timeout) {
+				kill(pid, SIGKILL);
+				waitpid(pid, nullptr, 0);
+				pid = -1;
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		pid = -1;
+		return true;
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE process = nullptr;
+	HANDLE stdin_write = nullptr;
+#else
+	pid_t pid = -1;
+	int stdin_write = -1;
+#endif
+};
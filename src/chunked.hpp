@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "mapped_file.hpp"
+
+/// Initial metadata the server sends on an upload so the client can size its
+/// chunks, and give up early if the upload is too large.
+constexpr char kMaxChunkSizeKey[] = "x-max-chunk-size";
+constexpr char kMaxUploadSizeKey[] = "x-max-upload-size";
+
+/// Parses one of those limits.
+/// @return false unless value is a whole number above 0
+inline bool ParseLimit(grpc::string_ref value, std::uint64_t *limit) {
+	auto last = value.data() + value.size();
+	auto [end, error] = std::from_chars(value.data(), last, *limit);
+	return error == std::errc() && end == last && *limit > 0;
+}
+
+/// CRC-32 (the one zlib and gzip use) of data, continuing from crc. Works on 8
+/// bytes at a time.
+inline std::uint32_t Crc32(std::string_view data, std::uint32_t crc = 0) {
+	static auto const table = [] {
+		std::array<std::array<std::uint32_t, 256>, 8> t{};
+		for (std::uint32_t i = 0; i < 256; ++i) {
+			auto c = i;
+			for (auto k = 0; k < 8; ++k) {
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			}
+			t[0][i] = c;
+		}
+		for (std::uint32_t i = 0; i < 256; ++i) {
+			for (auto k = 1; k < 8; ++k) {
+				t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+			}
+		}
+		return t;
+	}();
+	auto p = reinterpret_cast<unsigned char const *>(data.data());
+	auto n = data.size();
+	auto word = [](unsigned char const *p) {
+		return std::uint32_t(p[0]) | std::uint32_t(p[1]) << 8 |
+					 std::uint32_t(p[2]) << 16 | std::uint32_t(p[3]) << 24;
+	};
+	crc = ~crc;
+	for (; n >= 8; p += 8, n -= 8) {
+		auto lo = crc ^ word(p);
+		auto hi = word(p + 4);
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+					table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+					table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+					table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+	}
+	for (; n > 0; ++p, --n) {
+		crc = table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/// Where the server puts an upload, in order as the chunks arrive.
+class UploadSink {
+public:
+	virtual ~UploadSink() = default;
+	/// Called once with the size the client announced, before any Write.
+	/// @return false to refuse the upload
+	virtual bool Begin(std::uint64_t total_size) { return true; }
+	/// @return false to fail the upload
+	virtual bool Write(std::string_view data) = 0;
+	/// Called after the last chunk.
+	/// @return false to fail the upload
+	virtual bool End() { return true; }
+};
+
+/// Keeps the whole upload in a buffer. The size the client announces is only
+/// trusted up to kMaxReserve, past that the buffer grows as data arrives.
+class BufferSink : public UploadSink {
+public:
+	/// Most bytes reserved up front.
+	static constexpr std::uint64_t kMaxReserve = 16 << 20;
+
+	bool Begin(std::uint64_t total_size) override {
+		buffer.reserve(std::min(total_size, kMaxReserve));
+		return true;
+	}
+	/// @return false if the buffer can't grow, rather than throwing out of the
+	/// handler
+	bool Write(std::string_view data) override {
+		try {
+			buffer.append(data);
+		} catch (std::bad_alloc const &) {
+			return false;
+		}
+		return true;
+	}
+	std::string &Buffer() { return buffer; }
+
+private:
+	std::string buffer;
+};
+
+/// Writes the upload to a file as it arrives, holding no more than a chunk.
+class FileSink : public UploadSink {
+public:
+	explicit FileSink(std::string path) : path(std::move(path)) {}
+	bool Begin(std::uint64_t total_size) override {
+		out.open(path, std::ios::binary | std::ios::trunc);
+		return out.is_open();
+	}
+	bool Write(std::string_view data) override {
+		out.write(data.data(), data.size());
+		return out.good();
+	}
+	bool End() override {
+		out.close();
+		return !out.fail();
+	}
+
+private:
+	std::string path;
+	std::ofstream out;
+};
+
+/// Checks the chunks of one upload arrive in order and intact, and passes them
+/// on to a sink.
+class ChunkAssembler {
+public:
+	ChunkAssembler(std::unique_ptr<UploadSink> sink, std::uint64_t max_size,
+								 std::uint64_t max_chunk_size)
+			: sink(std::move(sink)), max_size(max_size),
+				max_chunk_size(max_chunk_size) {}
+
+	/// @return Why the upload has to be failed, OK to carry on
+	grpc::Status Add(helloworld::UploadChunk const &chunk) {
+		if (sequence == 0) {
+			total_size = chunk.total_size();
+			if (total_size > max_size) {
+				return {grpc::StatusCode::RESOURCE_EXHAUSTED,
+								"upload larger than " + std::to_string(max_size) + " bytes"};
+			}
+			if (!sink->Begin(total_size))
+				return {grpc::StatusCode::INTERNAL, "can't store upload"};
+		}
+		if (chunk.sequence() != sequence || chunk.offset() != received) {
+			return {grpc::StatusCode::INVALID_ARGUMENT,
+							"expected chunk " + std::to_string(sequence) + " at " +
+									std::to_string(received)};
+		}
+		auto &data = chunk.data();
+		if (data.size() > max_chunk_size || received + data.size() > total_size) {
+			return {grpc::StatusCode::INVALID_ARGUMENT,
+							"chunk " + std::to_string(sequence) + " too large"};
+		}
+		if (Crc32(data) != chunk.crc32()) {
+			return {grpc::StatusCode::DATA_LOSS,
+							"chunk " + std::to_string(sequence) + " corrupted"};
+		}
+		if (!sink->Write(data))
+			return {grpc::StatusCode::INTERNAL, "can't store upload"};
+		crc = Crc32(data, crc);
+		received += data.size();
+		++sequence;
+		return grpc::Status::OK;
+	}
+	/// Called once the client is done sending.
+	grpc::Status End(helloworld::UploadReply *reply) {
+		reply->set_received(received);
+		reply->set_crc32(crc);
+		if (sequence == 0 || received != total_size) {
+			return {grpc::StatusCode::DATA_LOSS,
+							"got " + std::to_string(received) + " of " +
+									std::to_string(total_size) + " bytes"};
+		}
+		if (!sink->End())
+			return {grpc::StatusCode::INTERNAL, "can't store upload"};
+		return grpc::Status::OK;
+	}
+
+	UploadSink &Sink() { return *sink; }
+
+private:
+	std::unique_ptr<UploadSink> sink;
+	std::uint64_t max_size;
+	std::uint64_t max_chunk_size;
+	std::uint64_t total_size = 0;
+	std::uint64_t sequence = 0;
+	std::uint64_t received = 0;
+	std::uint32_t crc = 0;
+};
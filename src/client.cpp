@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -6,6 +7,10 @@
 
 #include "helloworld.grpc.pb.h"
 
+#include "common.hpp"
+#include "flags.hpp"
+#include "hedging.hpp"
+
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::CompletionQueue;
@@ -17,56 +22,65 @@ using helloworld::HelloRequest;
 class GreeterClient {
 private:
   std::unique_ptr<Greeter::Stub> stub_;
+  HedgingPolicy policy_;
+  RetryBudget budget_;
+  HedgingStats stats_;
 
 public:
-  GreeterClient(std::shared_ptr<Channel> channel)
-      : stub_(Greeter::NewStub(channel)) {}
+  GreeterClient(std::shared_ptr<Channel> channel, HedgingPolicy policy = {})
+      : stub_(Greeter::NewStub(channel)), policy_(std::move(policy)) {}
 
   std::string SayHello(const std::string &user) {
     HelloRequest request;
     request.set_name(user);
-    HelloReply reply;
-    ClientContext context;
-    /* {
-    Status status = stub_->SayHello(&context, request, &reply);
-    if (status.ok()) {
-    return reply.message();
-    }
-    std::cout << status.error_code() << ": " << status.error_message()
-      << std::endl;
-        }*/
+    std::string result = "RPC failed";
+    bool done = false;
 
-    {
-      CompletionQueue cq;
-      std::unique_ptr<grpc::ClientAsyncResponseReader<HelloReply>> rpc(
-          stub_->AsyncSayHello(&context, request, &cq));
-      Status status;
-      rpc->Finish(&reply, &status, (void *)1);
-      void *got_tag;
-      bool ok = false;
-      // call blocks
-      std::chrono::system_clock::time_point tp =
-          std::chrono::system_clock::now() + std::chrono::milliseconds(3000);
-      if (cq.Next(&got_tag, &ok)) {
-        if (ok && got_tag == (void *)1) {
-          /// check reply and status
+    // SayHello is idempotent so extra attempts are safe. The policy's timeout is
+    // the deadline for all of them and it's sent to the server so it can skip
+    // the work too.
+    CompletionQueue cq;
+    std::make_shared<HedgedSayHello>(stub_.get(), &cq, policy_, &budget_,
+                                     &stats_)
+        ->Start(request, [&](Status const &status, HelloReply const &reply) {
+          done = true;
           if (status.ok()) {
-            return reply.message();
+            result = reply.message();
+            return;
           }
           std::cout << status.error_code() << ": " << status.error_message()
                     << std::endl;
-        }
+        });
+    void *tag;
+    bool ok = false;
+    // Blocks until the reply or the deadline. The losing attempts are cancelled
+    // and still have to be drained from the queue after shutdown.
+    while (cq.Next(&tag, &ok)) {
+      static_cast<Handler *>(tag)->Proceed(ok);
+      if (done) {
+        done = false;
+        cq.Shutdown();
       }
     }
-    return "RPC failed";
+    return result;
   }
+
+  HedgingStats const &Stats() const { return stats_; }
 };
-int main() {
-  std::string server_address("localhost:50051");
+int main(int argc, char **argv) {
+  Flags flags(argc, argv);
+  std::string server_address = flags.Get("address", "localhost:50051");
+  HedgingPolicy policy;
+  policy.max_attempts = flags.Get<std::size_t>("max-attempts", 3);
+  policy.hedge_delay =
+      std::chrono::milliseconds(flags.Get<int>("hedge-delay-ms", 0));
+  policy.timeout = std::chrono::milliseconds(flags.Get<int>("timeout-ms", 3000));
   GreeterClient greeter(
-      grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()));
+      grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()),
+      policy);
   std::string user = "world";
   std::string reply = greeter.SayHello(user);
   std::cout << "Greeter received: " << reply << std::endl;
+  std::cout << greeter.Stats() << std::endl;
   return 0;
 }
\ No newline at end of file
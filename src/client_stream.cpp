@@ -1,13 +1,16 @@
+#include <chrono>
 #include <iostream>
 #include <list>
 #include <memory>
 #include <string>
+#include <thread>
 
 #include <grpcpp/grpcpp.h>
 
 #include "helloworld.grpc.pb.h"
 
 #include "common.hpp"
+#include "poller.hpp"
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -21,11 +24,13 @@ class SayHellosServerStreamClient
 		: public std::enable_shared_from_this<SayHellosServerStreamClient> {
 public:
 	SayHellosServerStreamClient(std::shared_ptr<Channel> channel,
-															grpc::CompletionQueue *cq, bool *done)
-			: cq(cq), done(done) {
+															grpc::CompletionQueue *cq)
+			: cq(cq) {
 		stub = Greeter::NewStub(channel);
 	}
-	void Start(HelloRequest const &request) {
+	void Start(HelloRequest const &request,
+						 std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+		context.set_deadline(std::chrono::system_clock::now() + timeout);
 		stream = stub->AsyncSayHellos(&context, request, cq, OnCreate());
 	}
 	Handler *OnCreate() {
@@ -61,7 +66,8 @@ public:
 				std::cout << "SayHellosServerStreamClient finished in error status: "
 									<< status.error_code() << std::endl;
 			}
-			*done = true;
+			// Nothing else uses the queue so the poller can stop.
+			cq->Shutdown();
 		});
 	}
 
@@ -71,7 +77,6 @@ private:
 	grpc::ClientContext context;
 	grpc::Status status;
 	HelloReply reply;
-	bool *done;
 	std::unique_ptr<grpc::ClientAsyncReader<HelloReply>> stream;
 };
 class GreeterClient {
@@ -89,18 +94,9 @@ public:
 		std::thread t([&] {
 			HelloRequest request;
 			request.set_name(user);
-			bool done = false;
-			std::make_shared<SayHellosServerStreamClient>(channel, &cq, &done)
+			std::make_shared<SayHellosServerStreamClient>(channel, &cq)
 					->Start(request);
-			void *tag;
-			bool ok;
-			while (cq.Next(&tag, &ok)) {
-				static_cast<Handler *>(tag)->Proceed(ok);
-				if (done) {
-					done = false;
-					cq.Shutdown();
-				}
-			}
+			Poller().Run(&cq);
 		});
 		std::string j;
 		std::cin >> j;
@@ -1,186 +1,97 @@
 #include <atomic>
-#include <cassert>
 #include <chrono>
 #include <iostream>
-#include <list>
 #include <memory>
-#include <mutex>
 #include <string>
 #include <thread>
-#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include <grpcpp/grpcpp.h>
 
 #include "helloworld.grpc.pb.h"
 
-#include "common.hpp"
+#include "bidi_client.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
 
-using grpc::Channel;
-using grpc::ClientContext;
 using grpc::CompletionQueue;
-using grpc::Status;
-using helloworld::Greeter;
-using helloworld::HelloReply;
-using helloworld::HelloRequest;
-
-class SayHelloBidirClient
-		: public std::enable_shared_from_this<SayHelloBidirClient> {
-
-public:
-	///  Construct a new Say Hello Bidir Client object
-	///
-	/// @param channel Used in the creation of the stub when starting
-	/// @param cq call completion queue
-	SayHelloBidirClient(std::shared_ptr<Channel> channel,
-											grpc::CompletionQueue *cq)
-			: channel(channel), cq(cq) {}
-
-	/// Two stage initialization because shared_from_this is used.
-	void Start() {
-		stub = Greeter::NewStub(channel);
-		stream = stub->AsyncSayHelloBidir(&context, cq, OnCreate());
-	}
-
-public:
-	void Write(std::string something) {
-		std::lock_guard l{pending_requests_mutex};
-		HelloRequest request;
-		request.set_name(something);
-		pending_requests.push_back(std::move(request));
-		if (pending_requests.size() == 1) { // there weren't any pending
-			stream->Write(pending_requests.front(), OnWrite());
-		}
-	}
-	void Quit() {
-		std::lock_guard l{pending_requests_mutex};
-		quit = true;
-		context.TryCancel();
-	}
-
-private: //
-	Handler *OnCreate() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
-			if (ok) {
-				stream->ReadInitialMetadata(OnReadInitialMetadata());
-				std::cout << std::this_thread::get_id() << " create" << std::endl;
-			} else {
-				std::cout << std::this_thread::get_id() << " create error" << std::endl;
-			}
-		});
-	}
-	Handler *OnReadInitialMetadata() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
-			if (ok) {
-				stream->Read(&reply, OnRead());
-				std::cout << std::this_thread::get_id() << " read metadata"
-									<< std::endl;
-			} else {
-				std::cout << std::this_thread::get_id() << " read metadata error"
-									<< std::endl;
-			}
-		});
-	}
-	Handler *OnRead() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
-			if (ok) {
-				std::cout << std::this_thread::get_id() << " read: " << reply.message()
-									<< std::endl;
-				if (!quit)
-					stream->Read(&reply, OnRead());
-			} else {
-				std::cout << std::this_thread::get_id() << " read error " << std::endl;
-			}
-		});
+using Result = SayHelloBidirClient::Result;
+
+/// Sends each name read from stdin and prints the reply, until "end".
+///
+/// With --producers=N, N threads instead send --requests=M each at the same
+/// time and the replies are checked against the requests.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto channel = grpc::CreateChannel(flags.Get("address", "localhost:50051"),
+																		 grpc::InsecureChannelCredentials());
+	CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < flags.Get("threads", 4); ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
 	}
-	Handler *OnWrite() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
-			std::lock_guard l{pending_requests_mutex};
-			if (ok) {
-				std::cout << std::this_thread::get_id()
-									<< " write: " << pending_requests.front().name() << std::endl;
-				pending_requests.pop_front();
-				if (!quit && !pending_requests.empty()) {
-					stream->Write(pending_requests.front(), OnWrite());
+	auto client = std::make_shared<SayHelloBidirClient>(
+			channel, &cq, flags.Get<std::size_t>("max-outstanding", 1024));
+	auto finished = client->Finished();
+	client->Start();
+
+	if (auto producers = flags.Get("producers", 0); producers > 0) {
+		auto requests = flags.Get("requests", 10000);
+		std::atomic<int> failed{0};
+		std::atomic<int> mismatched{0};
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> writers;
+		for (auto p = 0; p < producers; ++p) {
+			writers.emplace_back([&, p] {
+				std::vector<std::pair<std::string, std::future<Result>>> replies;
+				for (auto i = 0; i < requests; ++i) {
+					auto name = std::to_string(p) + "." + std::to_string(i);
+					auto reply = client->Write(name);
+					replies.emplace_back(std::move(name), std::move(reply));
 				}
+				for (auto &[name, reply] : replies) {
+					auto result = reply.get();
+					if (!result.status.ok())
+						++failed;
+					else if (result.reply.message() != "You sent: " + name)
+						++mismatched;
+				}
+			});
+		}
+		for (auto &t : writers) {
+			t.join();
+		}
+		auto elapsed = std::chrono::duration<double>(
+											 std::chrono::steady_clock::now() - start)
+											 .count();
+		std::cout << "producers: " << producers << " requests: "
+							<< producers * requests
+							<< " per second: " << producers * requests / elapsed
+							<< " failed: " << failed << " mismatched: " << mismatched
+							<< std::endl;
+	} else {
+		std::string j;
+		while (std::cin >> j && j != "end") {
+			auto result = client->Write(j).get();
+			if (result.status.ok()) {
+				std::cout << "read: " << result.reply.message() << std::endl;
 			} else {
-				std::cout << std::this_thread::get_id() << " write error " << std::endl;
-			}
-		});
-	}
-	Handler *OnWritesDone() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
-			std::lock_guard l{pending_requests_mutex};
-			pending_requests.clear();
-			if (ok) {
-				std::cout << std::this_thread::get_id() << " write done " << std::endl;
-			} else {
-				std::cout << std::this_thread::get_id() << " write done error"
-									<< std::endl;
+				std::cout << "error: " << result.status.error_message() << std::endl;
 			}
-		});
-	}
-	Handler *OnFinish() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
-			std::cout << std::this_thread::get_id()
-								<< " finished: " << status.error_code() << " "
-								<< status.error_details() << " " << status.error_message()
-								<< std::endl;
-		});
-	}
-
-private:
-	std::shared_ptr<Channel> channel;
-	grpc::CompletionQueue *cq;
-	std::unique_ptr<Greeter::Stub> stub;
-	grpc::ClientContext context;
-	std::unique_ptr<grpc::ClientAsyncReaderWriter<HelloRequest, HelloReply>>
-			stream;
-	grpc::Status status;
-	HelloReply reply;
-	std::list<HelloRequest> pending_requests;
-	std::mutex pending_requests_mutex;
-	bool quit = false;
-};
-
-int main() {
-	std::string server_address("localhost:50051");
-
-	auto channel =
-			grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
-	CompletionQueue cq;
-	auto p = std::make_shared<SayHelloBidirClient>(channel, &cq);
-	auto c = p.get();
-	c->Start();
-	p.reset();
-
-	auto f = [&]() {
-		void *tag;
-		bool ok = false;
-		while (cq.Next(&tag, &ok)) {
-			std::cout << "ok: " << ok << std::endl;
-			static_cast<Handler *>(tag)->Proceed(ok);
-		}
-	};
-
-	std::thread t1(f);
-	std::thread t2(f);
-	std::thread t3(f);
-	std::thread t4(f);
-	std::string j;
-	while (std::cin >> j) {
-		if (j == "end") {
-			c->Quit();
-			break;
 		}
-		c->Write(j);
 	}
-	cq.Shutdown();
-	t1.join();
-	t2.join();
-	t3.join();
-	t4.join();
 
+	// The server keeps the stream open, so cancel it once every reply is in.
+	client->WritesDone();
+	client->Cancel();
+	finished.wait();
+	client.reset();
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
 	std::cout << " Good" << std::endl;
-
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <string>
 #include <thread>
@@ -7,7 +11,10 @@
 
 #include "helloworld.grpc.pb.h"
 
+#include "chunked.hpp"
 #include "common.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -16,12 +23,16 @@ using grpc::Status;
 using helloworld::Greeter;
 using helloworld::HelloReply;
 using helloworld::HelloRequest;
+using helloworld::UploadChunk;
+using helloworld::UploadReply;
 
 class SayHellosClientStreamClient
 		: public std::enable_shared_from_this<SayHellosClientStreamClient> {
 public:
-	SayHellosClientStreamClient(std::shared_ptr<Channel> channel,
-															grpc::CompletionQueue *cq) {
+	SayHellosClientStreamClient(
+			std::shared_ptr<Channel> channel, grpc::CompletionQueue *cq,
+			std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+		context.set_deadline(std::chrono::system_clock::now() + timeout);
 		stub = Greeter::NewStub(channel);
 		stream = stub->PrepareAsyncSayHellosClient(&context, &response, cq);
 	}
@@ -89,12 +100,159 @@ private:
 	std::list<std::string> msgs;
 };
 
+/// Uploads a file in chunks read straight from a mapping of it. Only one chunk
+/// is in flight at a time, so memory use doesn't grow with the file.
+class ChunkedUploadClient
+		: public std::enable_shared_from_this<ChunkedUploadClient> {
+public:
+	ChunkedUploadClient(std::shared_ptr<Channel> channel,
+											grpc::CompletionQueue *cq, std::string const &path,
+											std::size_t chunk_size)
+			: cq(cq), file(path),
+				chunk_size(std::max<std::size_t>(chunk_size, 1)) {
+		stub = Greeter::NewStub(channel);
+	}
+	/// @return false if the file couldn't be opened
+	bool Start(std::chrono::milliseconds timeout = std::chrono::minutes(10)) {
+		if (!file)
+			return false;
+		context.set_deadline(std::chrono::system_clock::now() + timeout);
+		start = std::chrono::steady_clock::now();
+		stream = stub->PrepareAsyncUpload(&context, &reply, cq);
+		stream->StartCall(OnCreate());
+		return true;
+	}
+	Handler *OnCreate() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (ok) {
+				stream->ReadInitialMetadata(OnReadInitialMetadata());
+			} else {
+				stream->Finish(&status, OnFinish());
+			}
+		});
+	}
+	Handler *OnReadInitialMetadata() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			// Send chunks no larger than the server accepts, and nothing at all if
+			// the file is too big for it or its limits make no sense.
+			auto &metadata = context.GetServerInitialMetadata();
+			std::uint64_t limit = 0;
+			if (auto it = metadata.find(kMaxChunkSizeKey); it != metadata.end()) {
+				if (!ParseLimit(it->second, &limit)) {
+					Fail(Status(grpc::StatusCode::INTERNAL,
+											"server sent a bad max chunk size"));
+					return;
+				}
+				chunk_size = std::min<std::uint64_t>(chunk_size, limit);
+			}
+			if (auto it = metadata.find(kMaxUploadSizeKey); it != metadata.end()) {
+				if (!ParseLimit(it->second, &limit)) {
+					Fail(Status(grpc::StatusCode::INTERNAL,
+											"server sent a bad max upload size"));
+					return;
+				}
+				if (file.Size() > limit) {
+					Fail(Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+											"file larger than the server accepts"));
+					return;
+				}
+			}
+			WriteChunk();
+		});
+	}
+	Handler *OnWriteChunk() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				// The server failed the upload, Finish says why.
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			file.Release(offset);
+			if (offset == file.Size()) {
+				stream->WritesDone(OnWritesDone());
+			} else {
+				WriteChunk();
+			}
+		});
+	}
+	Handler *OnWritesDone() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			stream->Finish(&status, OnFinish());
+		});
+	}
+	Handler *OnFinish() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			auto seconds = std::chrono::duration<double>(
+												 std::chrono::steady_clock::now() - start)
+												 .count();
+			if (!failure.ok()) {
+				status = failure;
+			} else if (status.ok() &&
+								 (reply.received() != offset || reply.crc32() != crc)) {
+				status = Status(grpc::StatusCode::DATA_LOSS, "checksum mismatch");
+			}
+			std::cout << "Upload finished with status: " << status.error_code()
+								<< " " << status.error_message() << " sent: " << offset
+								<< " bytes in " << sequence << " chunks crc32: " << std::hex
+								<< crc << std::dec << " MB/s: " << offset / seconds / (1 << 20)
+								<< std::endl;
+			// Nothing else uses the queue so the poller can stop.
+			cq->Shutdown();
+		});
+	}
+
+private:
+	/// Ends the upload before anything is sent, with why as its status.
+	void Fail(Status why) {
+		failure = std::move(why);
+		context.TryCancel();
+		stream->Finish(&status, OnFinish());
+	}
+	/// Sends the next chunk. An empty file is still sent as one empty chunk so
+	/// the server learns its size.
+	void WriteChunk() {
+		auto data = file.View(offset, chunk_size);
+		chunk.set_total_size(file.Size());
+		chunk.set_sequence(sequence++);
+		chunk.set_offset(offset);
+		chunk.set_data(data.data(), data.size());
+		chunk.set_crc32(Crc32(data));
+		crc = Crc32(data, crc);
+		offset += data.size();
+		stream->Write(chunk, OnWriteChunk());
+	}
+
+private:
+	grpc::CompletionQueue *cq;
+	MappedFile file;
+	std::size_t chunk_size;
+	grpc::ClientContext context;
+	std::unique_ptr<Greeter::Stub> stub;
+	std::unique_ptr<grpc::ClientAsyncWriter<UploadChunk>> stream;
+	grpc::Status status;
+	UploadReply reply;
+	/// Reused for every chunk so its buffer is only allocated once.
+	UploadChunk chunk;
+	std::uint64_t sequence = 0;
+	std::size_t offset = 0;
+	std::uint32_t crc = 0;
+	/// Set if the upload was ended by this side, overrides the call's status.
+	Status failure;
+	std::chrono::steady_clock::time_point start;
+};
+
 class SayHellosClientStreamClientSync {
 public:
 	SayHellosClientStreamClientSync(std::shared_ptr<Channel> channel) {
 		stub = Greeter::NewStub(channel);
 	}
-	void Run(std::list<std::string> msgs) {
+	void Run(std::list<std::string> msgs,
+					 std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+		context.set_deadline(std::chrono::system_clock::now() + timeout);
 		auto stream = stub->SayHellosClient(&context, &response);
 		for (auto &&m : msgs) {
 			HelloRequest r;
@@ -130,6 +288,19 @@ public:
 		std::cin >> j;
 		t.join();
 	}
+	/// Sends the file at path with an Upload call.
+	void Upload(std::string const &path, std::size_t chunk_size) {
+		grpc::ChannelArguments args;
+		args.SetMaxSendMessageSize(-1);
+		channel = grpc::CreateCustomChannel(
+				server_address, grpc::InsecureChannelCredentials(), args);
+		if (!std::make_shared<ChunkedUploadClient>(channel, &cq, path, chunk_size)
+						 ->Start()) {
+			std::cout << "Can't open " << path << std::endl;
+			return;
+		}
+		Poller().Run(&cq);
+	}
 	void Run() {
 		std::cout << "Async call" << std::endl;
 		channel =
@@ -159,9 +330,14 @@ private:
 	CompletionQueue cq;
 	std::unique_ptr<Greeter::Stub> stub_;
 };
-int main() {
-	std::string server_address("localhost:50051");
-	ClientImpl client(server_address);
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	ClientImpl client(flags.Get("address", "localhost:50051"));
+	if (flags.Has("upload")) {
+		client.Upload(flags.Get("upload", ""),
+									flags.Get<std::size_t>("chunk-kb", 256) << 10);
+		return 0;
+	}
 	client.Run();
 	client.RunSync();
 	return 0;
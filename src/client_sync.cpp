@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -6,6 +7,9 @@
 
 #include "helloworld.grpc.pb.h"
 
+#include "flags.hpp"
+#include "hedging.hpp"
+
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::CompletionQueue;
@@ -27,6 +31,8 @@ public:
 		request.set_name(user);
 		HelloReply reply;
 		ClientContext context;
+		context.set_deadline(std::chrono::system_clock::now() +
+												 std::chrono::milliseconds(3000));
 		Status status = stub_->SayHello(&context, request, &reply);
 		if (status.ok()) {
 			return reply.message();
@@ -36,10 +42,18 @@ public:
 		return "RPC failed";
 	}
 };
-int main() {
-	std::string server_address("localhost:50051");
-	GreeterClient greeter(
-			grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()));
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	std::string server_address = flags.Get("address", "localhost:50051");
+	// The sync api can't hedge so let the channel retry failed attempts instead.
+	HedgingPolicy policy;
+	policy.max_attempts = flags.Get<std::size_t>("max-attempts", 3);
+	grpc::ChannelArguments args;
+	args.SetServiceConfigJSON(RetryServiceConfig(
+			policy, flags.Get("retry-max-tokens", 10.0),
+			flags.Get("retry-token-ratio", 0.1)));
+	GreeterClient greeter(grpc::CreateCustomChannel(
+			server_address, grpc::InsecureChannelCredentials(), args));
 	std::string user = "world";
 	std::string reply = greeter.SayHello(user);
 	std::cout << "Greeter received: " << reply << std::endl;
@@ -1,16 +1,53 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <type_traits>
 #include <utility>
 
-struct Handler {
+#include "trace.hpp"
+
+/// Scheduling class of a completion queue event, see priority.hpp. Tags are
+/// high priority unless their call says otherwise.
+enum class Priority : std::uint8_t { High, Low };
+constexpr std::size_t kPriorities = 2;
+
+/// What gets passed to the completion queue as a tag. Proceed calls the
+/// function the tag was made with, so a call can embed its tags and dispatch
+/// them without allocating or type erasing anything (see async_call.hpp).
+struct Tag {
+	using Function = void (*)(Tag *, bool);
+	explicit Tag(Function function) : function(function) {}
+	void Proceed(bool ok) { function(this, ok); }
+
+	Function function;
+	/// What the tag is for, only set when made with a TraceTag.
+	TraceTag trace;
+	/// When the operation was started, only set if the call is traced.
+	std::int64_t issued = 0;
+	/// Which queue the event waits in when dispatched by priority.
+	Priority priority = Priority::High;
+};
+
+/// Tag that calls a function and deletes itself.
+struct Handler : Tag {
 	std::function<void(bool)> func;
-	Handler() = default;
+	Handler() : Tag(&Dispatch) {}
 	template <typename F, typename = std::enable_if_t<!std::is_base_of_v<
 														Handler, std::remove_reference_t<F>>>>
-	Handler(F &&f) : func(std::forward<F>(f)) {}
+	Handler(F &&f) : Tag(&Dispatch), func(std::forward<F>(f)) {}
+	/// Make the handler right before starting the operation it completes, the
+	/// time until Proceed is traced as the operation pending.
+	template <typename F>
+	Handler(TraceTag trace, F &&f) : Tag(&Dispatch), func(std::forward<F>(f)) {
+		this->trace = trace;
+		issued = trace.id ? Tracer::Now() : 0;
+	}
 	void Proceed(bool ok) {
+		auto trace = this->trace;
+		auto issued = this->issued;
+		auto start = trace.id ? Tracer::Now() : 0;
 		try {
 			func(ok);
 			delete this;
@@ -18,6 +55,13 @@ struct Handler {
 			delete this;
 			throw;
 		}
+		if (trace.id)
+			Tracer::Get().Record(trace, issued, start, Tracer::Now());
 	}
 	explicit operator bool() const noexcept { return (bool)func; }
+
+private:
+	static void Dispatch(Tag *tag, bool ok) {
+		static_cast<Handler *>(tag)->Proceed(ok);
+	}
 };
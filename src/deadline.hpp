@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include <grpcpp/grpcpp.h>
+
+/// Counters for work that was skipped because the caller had already given up
+/// on the rpc. Shared by every call in the process.
+struct WastedWork {
+	/// Calls whose deadline had (nearly) expired before any processing was done.
+	std::atomic<std::uint64_t> expired{0};
+	/// Calls the client had cancelled before any processing was done.
+	std::atomic<std::uint64_t> cancelled{0};
+	/// Reads that were not issued because the call was already done.
+	std::atomic<std::uint64_t> reads_skipped{0};
+	/// Writes that were dropped or not issued because the call was already done.
+	std::atomic<std::uint64_t> writes_skipped{0};
+
+	static WastedWork &Get() {
+		static WastedWork counters;
+		return counters;
+	}
+	friend std::ostream &operator<<(std::ostream &os, WastedWork const &w) {
+		return os << "expired: " << w.expired << " cancelled: " << w.cancelled
+							<< " reads skipped: " << w.reads_skipped
+							<< " writes skipped: " << w.writes_skipped;
+	}
+};
+
+/// Smallest budget that is still worth starting work for. A call with less
+/// time left than this would most likely expire before the reply got back.
+constexpr std::chrono::milliseconds kMinimumBudget{1};
+
+/// Time left before the deadline of the call. Calls without a deadline have
+/// nanoseconds::max() left.
+inline std::chrono::nanoseconds
+Remaining(grpc::ServerContext const &context) {
+	auto deadline = context.deadline();
+	if (deadline == std::chrono::system_clock::time_point::max())
+		return std::chrono::nanoseconds::max();
+	return deadline - std::chrono::system_clock::now();
+}
+
+/// Whether the call has less than budget left before its deadline.
+inline bool Expired(grpc::ServerContext const &context,
+										std::chrono::nanoseconds budget = kMinimumBudget) {
+	return Remaining(context) < budget;
+}
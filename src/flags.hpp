@@ -0,0 +1,81 @@
+#pragma once
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/// Minimal command line parsing for the examples.
+///
+/// Options look like --name=value or just --name (which is the same as
+/// --name=true). Anything else is kept as a positional argument.
+class Flags {
+public:
+	Flags(int argc, char **argv) {
+		for (auto i = 1; i < argc; ++i) {
+			std::string arg(argv[i]);
+			if (arg.rfind("--", 0) != 0) {
+				positional.push_back(std::move(arg));
+				continue;
+			}
+			auto eq = arg.find('=');
+			if (eq == std::string::npos) {
+				values[arg.substr(2)] = "true";
+			} else {
+				values[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+			}
+		}
+	}
+
+	bool Has(std::string const &name) const { return values.count(name) != 0; }
+
+	/// Value of --name converted to the type of def, or def if it wasn't given or
+	/// doesn't convert.
+	template <typename T> T Get(std::string const &name, T def) const {
+		auto it = values.find(name);
+		if (it == values.end())
+			return def;
+		if constexpr (std::is_same_v<T, std::string>) {
+			return it->second;
+		} else if constexpr (std::is_same_v<T, bool>) {
+			return it->second == "true" || it->second == "1";
+		} else {
+			std::istringstream is(it->second);
+			T value;
+			if (!(is >> value))
+				return def;
+			return value;
+		}
+	}
+	std::string Get(std::string const &name, char const *def) const {
+		return Get<std::string>(name, def);
+	}
+
+	/// Comma separated list given to --name, or def if it wasn't given.
+	template <typename T>
+	std::vector<T> GetList(std::string const &name, std::vector<T> def) const {
+		auto it = values.find(name);
+		if (it == values.end())
+			return def;
+		std::vector<T> list;
+		std::istringstream is(it->second);
+		std::string item;
+		while (std::getline(is, item, ',')) {
+			std::istringstream iis(item);
+			T value;
+			if (iis >> value)
+				list.push_back(value);
+		}
+		return list;
+	}
+
+	/// Positional argument i, or def if there aren't that many.
+	std::string Positional(std::size_t i, std::string def) const {
+		return i < positional.size() ? positional[i] : def;
+	}
+
+private:
+	std::map<std::string, std::string> values;
+	std::vector<std::string> positional;
+};
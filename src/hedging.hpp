@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+
+/// Limits the extra attempts that hedging and retries can make so a server
+/// that is already struggling doesn't get even more load.
+///
+/// Follows the rules of retryThrottling in the grpc service config. The bucket
+/// starts full with max_tokens. Every successful attempt adds token_ratio
+/// tokens, up to max_tokens, and every attempt failing with a retryable code
+/// takes one out. Extra attempts are only made while there are more than
+/// max_tokens / 2 tokens left.
+class RetryBudget {
+public:
+	RetryBudget(double max_tokens = 10, double token_ratio = 0.1)
+			: max_tokens(max_tokens), token_ratio(token_ratio), tokens(max_tokens) {
+	}
+	/// Called for every attempt that succeeded.
+	void RecordSuccess() {
+		std::lock_guard l{mutex};
+		tokens = std::min(max_tokens, tokens + token_ratio);
+	}
+	/// Called for every attempt that failed with a retryable code.
+	void RecordFailure() {
+		std::lock_guard l{mutex};
+		tokens = std::max(0.0, tokens - 1);
+	}
+	/// Whether an extra attempt may be made.
+	bool Allowed() {
+		std::lock_guard l{mutex};
+		return tokens > max_tokens / 2;
+	}
+
+private:
+	std::mutex mutex;
+	double max_tokens;
+	double token_ratio;
+	double tokens;
+};
+
+/// How a unary call is hedged and retried. Only use this for idempotent
+/// methods since the server can see the same request more than once.
+struct HedgingPolicy {
+	/// Total attempts including the first one. 1 turns hedging and retries off.
+	std::size_t max_attempts = 3;
+	/// Another attempt is sent if there's no reply after this long. Zero only
+	/// retries after a failure.
+	std::chrono::milliseconds hedge_delay{0};
+	/// Deadline for the whole call across all the attempts.
+	std::chrono::milliseconds timeout{3000};
+	/// Failures worth another attempt. Anything else ends the call.
+	std::vector<grpc::StatusCode> retryable_codes{grpc::StatusCode::UNAVAILABLE};
+};
+
+/// Service config that makes the channel retry SayHello on its own, for
+/// callers that can't use HedgedSayHello such as the sync api.
+///
+/// The C++ core only implements retryPolicy so hedge_delay is ignored here.
+inline std::string RetryServiceConfig(HedgingPolicy const &policy,
+																			double max_tokens = 10,
+																			double token_ratio = 0.1) {
+	static char const *const names[] = {
+			"OK",
+			"CANCELLED",
+			"UNKNOWN",
+			"INVALID_ARGUMENT",
+			"DEADLINE_EXCEEDED",
+			"NOT_FOUND",
+			"ALREADY_EXISTS",
+			"PERMISSION_DENIED",
+			"RESOURCE_EXHAUSTED",
+			"FAILED_PRECONDITION",
+			"ABORTED",
+			"OUT_OF_RANGE",
+			"UNIMPLEMENTED",
+			"INTERNAL",
+			"UNAVAILABLE",
+			"DATA_LOSS",
+			"UNAUTHENTICATED",
+	};
+	std::ostringstream os;
+	os << R"({"methodConfig":[{"name":[{"service":"helloworld.Greeter",)"
+		 << R"("method":"SayHello"}],)";
+	os << R"("timeout":")" << policy.timeout.count() / 1000.0 << R"(s")";
+	// maxAttempts has to be at least 2 or the whole config is rejected.
+	if (policy.max_attempts > 1) {
+		os << R"(,"retryPolicy":{"maxAttempts":)" << policy.max_attempts
+			 << R"(,"initialBackoff":"0.01s","maxBackoff":"0.1s",)"
+			 << R"("backoffMultiplier":2,"retryableStatusCodes":[)";
+		for (std::size_t i = 0; i < policy.retryable_codes.size(); ++i) {
+			os << (i ? "," : "") << '"' << names[policy.retryable_codes[i]] << '"';
+		}
+		os << "]}";
+	}
+	os << R"(}],"retryThrottling":{"maxTokens":)" << max_tokens
+		 << R"(,"tokenRatio":)" << token_ratio << "}}";
+	return os.str();
+}
+
+struct HedgingStats {
+	std::atomic<std::uint64_t> calls{0};
+	/// Attempts sent because the earlier ones were slow.
+	std::atomic<std::uint64_t> hedges{0};
+	/// Attempts sent because an earlier one failed.
+	std::atomic<std::uint64_t> retries{0};
+	/// Calls where an attempt other than the first one won.
+	std::atomic<std::uint64_t> wins{0};
+	/// Extra attempts not sent because the budget was at half or below.
+	std::atomic<std::uint64_t> throttled{0};
+
+	friend std::ostream &operator<<(std::ostream &os, HedgingStats const &s) {
+		return os << "calls: " << s.calls << " hedges: " << s.hedges
+							<< " retries: " << s.retries << " hedge wins: " << s.wins
+							<< " throttled: " << s.throttled;
+	}
+};
+
+/// SayHello call that sends extra attempts when the first one is slow
+/// (hedging) or fails (retries). The first successful reply wins and the other
+/// attempts are cancelled.
+///
+/// Everything runs on the completion queue that's passed in, which can have
+/// any number of threads.
+class HedgedSayHello : public std::enable_shared_from_this<HedgedSayHello> {
+public:
+	using Callback = std::function<void(grpc::Status const &,
+																			helloworld::HelloReply const &)>;
+
+	/// @param stub Used for every attempt. Must outlive the call.
+	/// @param cq Completes the attempts and the hedge timer
+	/// @param budget Shared by all calls that should be throttled together
+	/// @param stats Optional counters
+	HedgedSayHello(helloworld::Greeter::Stub *stub, grpc::CompletionQueue *cq,
+								 HedgingPolicy const &policy, RetryBudget *budget,
+								 HedgingStats *stats = nullptr)
+			: stub(stub), cq(cq), policy(policy), budget(budget), stats(stats) {}
+
+	/// Two stage initialization because shared_from_this is used.
+	///
+	/// @param callback Called exactly once with the winning (or last) attempt.
+	void Start(helloworld::HelloRequest request, Callback callback) {
+		this->request = std::move(request);
+		this->callback = std::move(callback);
+		deadline = std::chrono::system_clock::now() + policy.timeout;
+		if (stats)
+			++stats->calls;
+		std::lock_guard l{mutex};
+		StartAttempt();
+		ArmHedge();
+	}
+
+private:
+	struct Attempt {
+		grpc::ClientContext context;
+		helloworld::HelloReply reply;
+		grpc::Status status;
+		std::unique_ptr<grpc::ClientAsyncResponseReader<helloworld::HelloReply>>
+				rpc;
+	};
+
+	// These all need the mutex to be held.
+
+	void StartAttempt() {
+		auto &attempt = attempts.emplace_back(std::make_unique<Attempt>());
+		// Every attempt shares the deadline of the call.
+		attempt->context.set_deadline(deadline);
+		attempt->rpc = stub->AsyncSayHello(&attempt->context, request, cq);
+		attempt->rpc->Finish(&attempt->reply, &attempt->status,
+												 OnFinish(attempts.size() - 1));
+		++outstanding;
+	}
+	void ArmHedge() {
+		if (policy.hedge_delay.count() > 0 &&
+				attempts.size() < policy.max_attempts) {
+			alarm.Set(cq, std::chrono::system_clock::now() + policy.hedge_delay,
+								OnHedge());
+		}
+	}
+	bool Retryable(grpc::Status const &status) const {
+		return std::find(policy.retryable_codes.begin(),
+										 policy.retryable_codes.end(),
+										 status.error_code()) != policy.retryable_codes.end();
+	}
+	/// Cancels the other attempts and the hedge timer. The callback is called by
+	/// the caller once the mutex is released.
+	void Complete(std::size_t winner) {
+		completed = true;
+		alarm.Cancel();
+		for (std::size_t i = 0; i < attempts.size(); ++i) {
+			if (i != winner)
+				attempts[i]->context.TryCancel();
+		}
+		if (stats && winner != 0 && attempts[winner]->status.ok())
+			++stats->wins;
+	}
+
+private: // Handlers
+	Handler *OnHedge() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			std::lock_guard l{mutex};
+			// Cancelled because the call already completed.
+			if (!ok || completed)
+				return;
+			if (!budget->Allowed()) {
+				if (stats)
+					++stats->throttled;
+				return;
+			}
+			if (stats)
+				++stats->hedges;
+			StartAttempt();
+			ArmHedge();
+		});
+	}
+	Handler *OnFinish(std::size_t index) {
+		return new Handler([this, index, me = shared_from_this()](bool ok) {
+			std::unique_lock l{mutex};
+			--outstanding;
+			// Another attempt already won and this one was cancelled.
+			if (completed)
+				return;
+			auto &attempt = *attempts[index];
+			if (attempt.status.ok())
+				budget->RecordSuccess();
+			if (!attempt.status.ok() && Retryable(attempt.status)) {
+				budget->RecordFailure();
+				if (attempts.size() < policy.max_attempts &&
+						std::chrono::system_clock::now() < deadline) {
+					if (budget->Allowed()) {
+						if (stats)
+							++stats->retries;
+						StartAttempt();
+						return;
+					}
+					if (stats)
+						++stats->throttled;
+				}
+				// One of the hedges might still succeed.
+				if (outstanding > 0)
+					return;
+			}
+			Complete(index);
+			l.unlock();
+			// Nothing touches the winning attempt after completion.
+			callback(attempt.status, attempt.reply);
+		});
+	}
+
+private:
+	helloworld::Greeter::Stub *stub;
+	grpc::CompletionQueue *cq;
+	HedgingPolicy policy;
+	RetryBudget *budget;
+	HedgingStats *stats;
+	helloworld::HelloRequest request;
+	Callback callback;
+	std::chrono::system_clock::time_point deadline;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<Attempt>> attempts;
+	std::size_t outstanding = 0;
+	bool completed = false;
+	grpc::Alarm alarm;
+};
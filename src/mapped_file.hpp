@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// A whole file mapped read only. Pages are read in as they're touched, so a
+/// file can be sent in chunks without reading it into memory first, and
+/// Release gives back the ones that have been sent.
+class MappedFile {
+public:
+	explicit MappedFile(std::string const &path) {
+#ifdef _WIN32
+		auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+														nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+														nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size)) {
+			CloseHandle(file);
+			return;
+		}
+		size = static_cast<std::size_t>(file_size.QuadPart);
+		if (size == 0) {
+			ok = true;
+		} else if (auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY,
+																								 0, 0, nullptr)) {
+			// The view keeps the mapping open.
+			data = static_cast<char const *>(
+					MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			CloseHandle(mapping);
+			ok = data != nullptr;
+		}
+		CloseHandle(file);
+#else
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return;
+		}
+		size = static_cast<std::size_t>(st.st_size);
+		if (size == 0) {
+			ok = true;
+		} else if (auto p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+							 p != MAP_FAILED) {
+			data = static_cast<char const *>(p);
+			madvise(p, size, MADV_SEQUENTIAL);
+			ok = true;
+		}
+		close(fd);
+#endif
+		if (!ok)
+			size = 0;
+	}
+	MappedFile(MappedFile const &) = delete;
+	MappedFile &operator=(MappedFile const &) = delete;
+	~MappedFile() {
+		if (!data)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(const_cast<char *>(data), size);
+#endif
+	}
+
+	explicit operator bool() const { return ok; }
+	std::size_t Size() const { return size; }
+	std::string_view View(std::size_t offset, std::size_t length) const {
+		return {data + offset, std::min(length, size - offset)};
+	}
+	/// Tells the OS the pages before offset won't be read again. They're clean
+	/// so dropping them costs nothing, and the process doesn't grow by the size
+	/// of the file as it's sent.
+	void Release(std::size_t offset) {
+#ifndef _WIN32
+		// Windows trims the working set of a sequential scan by itself.
+		static auto const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+		auto end = offset / page * page;
+		if (end > released) {
+			madvise(const_cast<char *>(data) + released, end - released,
+							MADV_DONTNEED);
+			released = end;
+		}
+#endif
+	}
+
+private:
+	char const *data = nullptr;
+	std::size_t size = 0;
+	std::size_t released = 0;
+	bool ok = false;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+/// Unbounded queue any number of threads can push to without locking, and one
+/// thread at a time pops from. A linked list with a stub node at the tail, so
+/// a push is one exchange and one store.
+///
+/// A pop can miss an element whose push hasn't finished yet, so the pushing
+/// thread has to check for that itself afterwards.
+template <typename T> class MpscQueue {
+	struct Node {
+		Node() = default;
+		explicit Node(T value) : value(std::move(value)) {}
+		std::atomic<Node *> next{nullptr};
+		T value;
+	};
+
+public:
+	MpscQueue() : head(new Node), tail(head.load()) {}
+	MpscQueue(MpscQueue const &) = delete;
+	MpscQueue &operator=(MpscQueue const &) = delete;
+	~MpscQueue() {
+		T value;
+		while (Pop(value)) {
+		}
+		delete tail;
+	}
+
+	/// Safe from any thread.
+	void Push(T value) {
+		auto node = new Node(std::move(value));
+		auto prev = head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+	/// Only one thread may pop at a time.
+	/// @return false if there's nothing to pop
+	bool Pop(T &value) {
+		auto next = tail->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+		// next becomes the stub, its value is no longer needed.
+		value = std::move(next->value);
+		delete tail;
+		tail = next;
+		return true;
+	}
+
+private:
+	/// Last pushed, where producers add.
+	std::atomic<Node *> head;
+	/// Stub before the oldest element, only used by the consumer.
+	Node *tail;
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+
+/// Initial metadata key for how many requests a client may have waiting for
+/// replies on each channel of SayHelloMux before it needs more credit.
+constexpr char const *kMuxWindowKey = "x-mux-window";
+
+/// Frames waiting to go out on a stream carrying many channels, with a queue
+/// for each channel. Channels take turns in deficit round robin order, so each
+/// one with something to send gets about the same share of bytes however much
+/// the others have queued.
+///
+/// Frames can use credit, one each. A channel without credit is passed over
+/// until it gets some, the rest keep going.
+template <typename Frame> class FairQueue {
+public:
+	static constexpr auto kUnlimited = std::numeric_limits<std::uint32_t>::max();
+
+	/// @param quantum Bytes a channel can send each turn
+	/// @param initial_credit Credit new channels start with
+	explicit FairQueue(std::size_t quantum,
+										 std::uint32_t initial_credit = kUnlimited)
+			: quantum(quantum ? quantum : 1), initial_credit(initial_credit) {}
+
+	/// @param cost Bytes the frame takes up on the stream
+	/// @param uses_credit Whether the frame has to wait for credit
+	void Push(std::uint32_t channel, Frame frame, std::size_t cost,
+						bool uses_credit = true) {
+		auto &c = Get(channel);
+		c.frames.push_back({std::move(frame), cost, uses_credit});
+		++size;
+		Activate(channel, c);
+	}
+	/// Takes the next frame to send.
+	/// @param channel Set to the channel of the frame
+	/// @return false if no channel has anything it can send
+	bool Pop(Frame &frame, std::uint32_t *channel = nullptr) {
+		while (!active.empty()) {
+			auto id = active.front();
+			auto &c = channels.at(id);
+			auto &next = c.frames.front();
+			if (next.uses_credit && c.credit == 0) {
+				Deactivate(c);
+				continue;
+			}
+			if (!c.turn) {
+				c.turn = true;
+				c.deficit += quantum;
+			}
+			// Frames larger than the quantum go out once enough turns add up.
+			if (next.cost > c.deficit) {
+				c.turn = false;
+				active.pop_front();
+				active.push_back(id);
+				continue;
+			}
+			c.deficit -= next.cost;
+			if (next.uses_credit && c.credit != kUnlimited)
+				--c.credit;
+			frame = std::move(next.frame);
+			c.frames.pop_front();
+			--size;
+			if (channel)
+				*channel = id;
+			if (c.frames.empty())
+				Deactivate(c);
+			return true;
+		}
+		return false;
+	}
+	void AddCredit(std::uint32_t channel, std::uint32_t credit) {
+		auto &c = Get(channel);
+		c.credit =
+				credit >= kUnlimited - c.credit ? kUnlimited : c.credit + credit;
+		Activate(channel, c);
+	}
+	/// Adds credit to every channel, including ones made later.
+	void AddCreditToAll(std::uint32_t credit) {
+		initial_credit += credit;
+		for (auto &[id, c] : channels) {
+			AddCredit(id, credit);
+		}
+	}
+	/// Frames waiting on channel.
+	std::size_t Queued(std::uint32_t channel) const {
+		auto it = channels.find(channel);
+		return it == channels.end() ? 0 : it->second.frames.size();
+	}
+	/// Forgets a channel once it has nothing queued.
+	void Erase(std::uint32_t channel) {
+		auto it = channels.find(channel);
+		if (it != channels.end() && it->second.frames.empty())
+			channels.erase(it);
+	}
+	std::size_t Channels() const { return channels.size(); }
+	/// Frames waiting on every channel, including those without credit.
+	std::size_t Size() const { return size; }
+	bool Empty() const { return size == 0; }
+	void Clear() {
+		channels.clear();
+		active.clear();
+		size = 0;
+	}
+
+private:
+	struct Entry {
+		Frame frame;
+		std::size_t cost;
+		bool uses_credit;
+	};
+	struct Channel {
+		std::deque<Entry> frames;
+		std::uint32_t credit;
+		std::size_t deficit = 0;
+		/// Whether the channel is in the active list.
+		bool active = false;
+		/// Whether the channel has had its quantum for the current turn.
+		bool turn = false;
+	};
+
+	Channel &Get(std::uint32_t channel) {
+		auto [it, added] = channels.try_emplace(channel);
+		if (added)
+			it->second.credit = initial_credit;
+		return it->second;
+	}
+	void Activate(std::uint32_t id, Channel &c) {
+		if (c.active || c.frames.empty())
+			return;
+		if (c.frames.front().uses_credit && c.credit == 0)
+			return;
+		c.active = true;
+		active.push_back(id);
+	}
+	/// Takes the channel at the front of the active list out of it. Whatever it
+	/// had left of its turn is lost, as in plain deficit round robin.
+	void Deactivate(Channel &c) {
+		c.active = false;
+		c.turn = false;
+		c.deficit = 0;
+		active.pop_front();
+	}
+
+	std::size_t const quantum;
+	std::uint32_t initial_credit;
+	std::unordered_map<std::uint32_t, Channel> channels;
+	/// Channels with a frame they can send, the one whose turn it is first.
+	std::deque<std::uint32_t> active;
+	std::size_t size = 0;
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+#include "mux.hpp"
+
+/// Client side of SayHelloMux: many logical channels of greetings over one
+/// stream, so they don't each cost a stream of their own.
+///
+/// Channels are only an id, opening one doesn't send anything. Each channel can
+/// have as many requests waiting for replies as the server's window, and more
+/// wait on the client until replies bring credit back. Channels with requests
+/// to send take turns, so a busy channel doesn't hold the others up.
+///
+/// Safe from any thread.
+class SayHelloMuxClient
+		: public std::enable_shared_from_this<SayHelloMuxClient> {
+public:
+	struct Result {
+		grpc::Status status;
+		helloworld::HelloReply reply;
+	};
+
+	/// @param quantum Bytes of requests each channel gets to send per turn
+	SayHelloMuxClient(std::shared_ptr<grpc::Channel> channel,
+										grpc::CompletionQueue *cq, std::size_t quantum = 256)
+			: stub(helloworld::Greeter::NewStub(channel)), cq(cq),
+				// Nothing can be sent before the server says how much.
+				queue(quantum, 0) {}
+
+	/// Two stage initialization because shared_from_this is used.
+	void Start() {
+		stream = stub->PrepareAsyncSayHelloMux(&context, cq);
+		stream->StartCall(OnCreate());
+	}
+
+	/// @return Id of a new channel
+	std::uint32_t Open() { return next_channel.fetch_add(1); }
+	/// Sends request on channel, safe from any thread. The id is filled in.
+	std::future<Result> Write(std::uint32_t channel,
+														helloworld::HelloRequest request) {
+		std::promise<Result> promise;
+		auto future = promise.get_future();
+		std::lock_guard l{mutex};
+		if (finished || closing) {
+			promise.set_value({Unavailable("stream closed"), {}});
+			return future;
+		}
+		request.set_id(next_id++);
+		waiting[channel].push_back({request.id(), std::move(promise)});
+		helloworld::MuxFrame frame;
+		frame.set_channel(channel);
+		*frame.mutable_request() = std::move(request);
+		auto cost = frame.ByteSizeLong();
+		queue.Push(channel, std::move(frame), cost);
+		TryWrite();
+		return future;
+	}
+	std::future<Result> Write(std::uint32_t channel, std::string name) {
+		helloworld::HelloRequest request;
+		request.set_name(std::move(name));
+		return Write(channel, std::move(request));
+	}
+	/// Closes channel after the requests already sent on it. Their replies still
+	/// arrive.
+	void Close(std::uint32_t channel) {
+		std::lock_guard l{mutex};
+		if (finished || closing)
+			return;
+		helloworld::MuxFrame frame;
+		frame.set_channel(channel);
+		frame.set_close(true);
+		queue.Push(channel, std::move(frame), 0, false);
+		TryWrite();
+	}
+	/// Half closes the stream once everything queued has been written. The
+	/// server finishes it after replying to everything.
+	void WritesDone() {
+		std::lock_guard l{mutex};
+		closing = true;
+		TryWrite();
+	}
+	/// Ends the stream now. Requests without replies fail with CANCELLED.
+	void Cancel() { context.TryCancel(); }
+	/// Ready with the status of the stream once it has ended. Only call once.
+	std::future<grpc::Status> Finished() { return finished_promise.get_future(); }
+
+private:
+	struct Waiting {
+		std::uint64_t id;
+		std::promise<Result> promise;
+	};
+
+	Handler *OnCreate() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			stream->ReadInitialMetadata(OnReadInitialMetadata());
+		});
+	}
+	Handler *OnReadInitialMetadata() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			std::uint32_t window = 1;
+			auto &metadata = context.GetServerInitialMetadata();
+			if (auto it = metadata.find(kMuxWindowKey); it != metadata.end()) {
+				auto value = std::string(it->second.data(), it->second.size());
+				window = static_cast<std::uint32_t>(
+						std::max(std::strtoul(value.c_str(), nullptr, 10), 1ul));
+			}
+			stream->Read(&frame, OnRead());
+			std::lock_guard l{mutex};
+			queue.AddCreditToAll(window);
+			created = true;
+			TryWrite();
+		});
+	}
+	Handler *OnWrite() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			std::lock_guard l{mutex};
+			writing = false;
+			// The stream is broken, so the read fails and finishes it.
+			if (!ok)
+				broken = true;
+			TryWrite();
+		});
+	}
+	Handler *OnWritesDone() {
+		return new Handler([me = shared_from_this()](bool ok) {});
+	}
+	Handler *OnRead() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok) {
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			std::promise<Result> promise;
+			bool found = false;
+			{
+				std::lock_guard l{mutex};
+				auto channel = frame.channel();
+				if (frame.credit()) {
+					queue.AddCredit(channel, frame.credit());
+					TryWrite();
+				}
+				auto it = waiting.find(channel);
+				if (frame.has_reply() && it != waiting.end()) {
+					// Replies on a channel come back in the order of its requests.
+					auto &w = it->second;
+					if (!w.empty() && w.front().id == frame.reply().id()) {
+						promise = std::move(w.front().promise);
+						w.pop_front();
+						found = true;
+					}
+				}
+				if (frame.close()) {
+					queue.Erase(channel);
+					if (it != waiting.end() && it->second.empty())
+						waiting.erase(it);
+				}
+			}
+			if (found) {
+				promise.set_value(
+						{grpc::Status::OK, std::move(*frame.mutable_reply())});
+			}
+			frame.Clear();
+			stream->Read(&frame, OnRead());
+		});
+	}
+	Handler *OnFinish() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			auto result = status.ok() ? Unavailable("stream ended before reply")
+																: status;
+			std::unordered_map<std::uint32_t, std::deque<Waiting>> failed;
+			{
+				std::lock_guard l{mutex};
+				finished = true;
+				failed.swap(waiting);
+				queue.Clear();
+			}
+			for (auto &[channel, waits] : failed) {
+				for (auto &w : waits) {
+					w.promise.set_value({result, {}});
+				}
+			}
+			finished_promise.set_value(status);
+		});
+	}
+
+	/// Writes the next frame if nothing is being written. Must hold mutex.
+	void TryWrite() {
+		if (!created || writing || broken || finished || writes_done)
+			return;
+		if (queue.Pop(current)) {
+			writing = true;
+			stream->Write(current, OnWrite());
+		} else if (closing && queue.Empty()) {
+			writes_done = true;
+			stream->WritesDone(OnWritesDone());
+		}
+	}
+	static grpc::Status Unavailable(char const *why) {
+		return {grpc::StatusCode::UNAVAILABLE, why};
+	}
+
+	grpc::ClientContext context;
+	std::unique_ptr<helloworld::Greeter::Stub> stub;
+	grpc::CompletionQueue *cq;
+	std::unique_ptr<
+			grpc::ClientAsyncReaderWriter<helloworld::MuxFrame, helloworld::MuxFrame>>
+			stream;
+	grpc::Status status;
+	std::promise<grpc::Status> finished_promise;
+	helloworld::MuxFrame frame;
+	std::atomic<std::uint32_t> next_channel{1};
+
+	std::mutex mutex;
+	FairQueue<helloworld::MuxFrame> queue;
+	/// Only used by the writer, alive until its write finishes.
+	helloworld::MuxFrame current;
+	/// Written requests waiting for their reply on each channel, oldest first.
+	std::unordered_map<std::uint32_t, std::deque<Waiting>> waiting;
+	std::uint64_t next_id = 1;
+	bool created = false;
+	bool writing = false;
+	bool closing = false;
+	bool writes_done = false;
+	bool broken = false;
+	bool finished = false;
+};
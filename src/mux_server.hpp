@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+#include "deadline.hpp"
+#include "mux.hpp"
+
+struct MuxOptions {
+	/// Requests a client can have waiting for replies on each channel.
+	std::uint32_t window = 64;
+	/// Bytes of replies each channel gets to send per turn.
+	std::size_t quantum = 256;
+	/// Channels a client can have open on one stream, from its first request
+	/// until it closes it. More fail the stream with RESOURCE_EXHAUSTED.
+	std::size_t max_channels = 1024;
+};
+
+/// Server side of SayHelloMux. Requests on every channel are greeted as they
+/// arrive and the replies queue per channel, going out in turns so a busy
+/// channel can't hold the others up. Each reply gives its channel one more
+/// request of credit, so no channel can have more than the window queued, and
+/// no client can have more than max_channels open.
+class SayHelloMuxServer
+		: public std::enable_shared_from_this<SayHelloMuxServer> {
+public:
+	SayHelloMuxServer(helloworld::Greeter::AsyncService *service,
+										grpc::ServerCompletionQueue *cq, MuxOptions options)
+			: service(service), cq(cq), options(options), stream(&context),
+				queue(options.quantum) {}
+	/// Two stage initialization because shared_from_this is used.
+	void Start() {
+		context.AsyncNotifyWhenDone(OnDone());
+		service->RequestSayHelloMux(&context, &stream, cq, cq, OnCreate());
+	}
+
+private:
+	Handler *OnCreate() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (!ok)
+				return;
+			std::make_shared<SayHelloMuxServer>(service, cq, options)->Start();
+			if (Expired(context)) {
+				++WastedWork::Get().expired;
+				stream.Finish(
+						{grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"},
+						OnFinish());
+				return;
+			}
+			context.AddInitialMetadata(kMuxWindowKey,
+																 std::to_string(options.window));
+			stream.SendInitialMetadata(OnSendInitialMetadata());
+		});
+	}
+	Handler *OnSendInitialMetadata() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (ok)
+				stream.Read(&frame, OnRead());
+		});
+	}
+	Handler *OnRead() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			std::lock_guard l{mutex};
+			if (!ok) {
+				reads_done = true;
+				TryWrite();
+				return;
+			}
+			if (done) {
+				++WastedWork::Get().reads_skipped;
+				return;
+			}
+			auto channel = frame.channel();
+			if (frame.has_request()) {
+				if (open_channels.insert(channel).second &&
+						open_channels.size() > options.max_channels) {
+					Fail({grpc::StatusCode::RESOURCE_EXHAUSTED,
+								"more than " + std::to_string(options.max_channels) +
+										" channels open"});
+					return;
+				}
+				// The client is only allowed the window.
+				if (queue.Queued(channel) >= options.window) {
+					Fail({grpc::StatusCode::RESOURCE_EXHAUSTED,
+								"channel " + std::to_string(channel) +
+										" sent more than its window"});
+					return;
+				}
+				helloworld::MuxFrame out;
+				out.set_channel(channel);
+				out.set_credit(1);
+				auto &request = frame.request();
+				auto reply = out.mutable_reply();
+				reply->set_message("You sent: " + request.name());
+				reply->set_id(request.id());
+				auto cost = out.ByteSizeLong();
+				queue.Push(channel, std::move(out), cost);
+			} else if (frame.close()) {
+				open_channels.erase(channel);
+				// Closed back once everything before it has gone out.
+				helloworld::MuxFrame out;
+				out.set_channel(channel);
+				out.set_close(true);
+				queue.Push(channel, std::move(out), 0, false);
+			}
+			stream.Read(&frame, OnRead());
+			TryWrite();
+		});
+	}
+	Handler *OnWrite() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			std::lock_guard l{mutex};
+			writing = false;
+			if (!ok) {
+				// The read fails too, nothing more can be sent.
+				broken = true;
+				return;
+			}
+			TryWrite();
+		});
+	}
+	Handler *OnFinish() {
+		return new Handler([me = shared_from_this()](bool ok) {});
+	}
+	Handler *OnDone() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			done = true;
+			std::lock_guard l{mutex};
+			queue.Clear();
+		});
+	}
+
+	/// Writes the next frame, or finishes once the client has stopped sending
+	/// and everything has been written. Must hold mutex.
+	void TryWrite() {
+		if (writing || broken || finished)
+			return;
+		std::uint32_t channel;
+		if (!done && queue.Pop(current, &channel)) {
+			// Channels have unlimited credit here, so an empty one has nothing
+			// worth keeping and is made again by its next reply.
+			queue.Erase(channel);
+			writing = true;
+			stream.Write(current, OnWrite());
+		} else if (reads_done || !status.ok()) {
+			finished = true;
+			stream.Finish(status, OnFinish());
+		}
+	}
+	/// Drops everything queued and finishes with status as soon as nothing is
+	/// being written. Must hold mutex.
+	void Fail(grpc::Status const &error) {
+		status = error;
+		queue.Clear();
+		open_channels.clear();
+		TryWrite();
+	}
+
+	helloworld::Greeter::AsyncService *service;
+	grpc::ServerCompletionQueue *cq;
+	MuxOptions const options;
+	grpc::ServerContext context;
+	grpc::ServerAsyncReaderWriter<helloworld::MuxFrame, helloworld::MuxFrame>
+			stream;
+	helloworld::MuxFrame frame;
+	std::mutex mutex;
+	FairQueue<helloworld::MuxFrame> queue;
+	/// Channels that have had a request and haven't been closed.
+	std::unordered_set<std::uint32_t> open_channels;
+	/// Only used by the writer, alive until its write finishes.
+	helloworld::MuxFrame current;
+	/// What the call finishes with, set early if the client breaks the rules.
+	grpc::Status status;
+	bool writing = false;
+	bool reads_done = false;
+	bool broken = false;
+	bool finished = false;
+	/// Set once the call is done (finished, cancelled or past its deadline).
+	std::atomic<bool> done{false};
+};
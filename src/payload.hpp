@@ -0,0 +1,19 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+/// Fills in size bytes of a PayloadRequest or PayloadReply, as one payload or
+/// as chunks of chunk_size.
+template <typename Message>
+void Fill(Message *message, std::size_t size, std::size_t chunk_size) {
+	message->clear_payload();
+	message->clear_chunks();
+	if (chunk_size == 0) {
+		message->mutable_payload()->resize(size);
+		return;
+	}
+	for (std::size_t done = 0; done < size; done += chunk_size) {
+		message->add_chunks()->resize(std::min(chunk_size, size - done));
+	}
+}
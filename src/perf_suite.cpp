@@ -0,0 +1,499 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/struct.pb.h>
+#include <google/protobuf/util/json_util.h>
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "bidi_client.hpp"
+#include "child_process.hpp"
+#include "chunked.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "stats.hpp"
+#include "unary_load.hpp"
+
+using google::protobuf::Struct;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+using helloworld::UploadChunk;
+using helloworld::UploadReply;
+
+/// One number a scenario measured.
+struct Metric {
+	std::string name;
+	double value;
+	bool higher_is_better;
+};
+
+/// How long and how hard every scenario runs.
+struct Settings {
+	std::chrono::milliseconds warmup;
+	std::chrono::milliseconds duration;
+	int concurrency;
+};
+
+/// What a scenario returns, false if something failed that isn't slowness.
+struct Outcome {
+	bool ok = true;
+	std::string error;
+	std::vector<Metric> metrics;
+};
+
+double Us(std::chrono::nanoseconds ns) { return ns.count() / 1000.0; }
+
+/// SayHello closed loop from several connections.
+Outcome Unary(std::string const &address, Settings const &settings) {
+	auto stubs = MakeStubs(address, 8);
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < 2; ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+	Load load{stubs, &cq, std::chrono::seconds(10)};
+	auto elapsed =
+			RunLoad(&load, settings.concurrency, settings.warmup, settings.duration);
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	Outcome outcome;
+	if (load.failed) {
+		outcome.ok = false;
+		outcome.error = std::to_string(load.failed) + " calls failed";
+	}
+	outcome.metrics = {{"qps", load.succeeded / elapsed, true},
+										 {"p50_us", Us(load.latencies.Percentile(0.5)), false},
+										 {"p99_us", Us(load.latencies.Percentile(0.99)), false}};
+	return outcome;
+}
+
+/// Runs call on concurrency threads, each calling it over and over until the
+/// warmup and duration are up. Only calls that finish after the warmup count.
+/// @param call Returns the messages it got, or -1 if it failed
+/// @return Messages and calls a second, and how many calls failed
+struct Loop {
+	double messages_per_s = 0;
+	double calls_per_s = 0;
+	std::uint64_t failed = 0;
+};
+Loop RunLoop(Settings const &settings, std::function<std::int64_t()> call) {
+	using Clock = std::chrono::steady_clock;
+	auto start = Clock::now() + settings.warmup;
+	auto end = start + settings.duration;
+	std::atomic<std::uint64_t> messages{0}, calls{0}, failed{0};
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < settings.concurrency; ++i) {
+		threads.emplace_back([&] {
+			while (Clock::now() < end) {
+				auto got = call();
+				if (Clock::now() < start)
+					continue;
+				if (got < 0) {
+					++failed;
+					continue;
+				}
+				messages += got;
+				++calls;
+			}
+		});
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	return {messages / seconds, calls / seconds, failed};
+}
+
+/// SayHellos streams read to the end, one per thread at a time.
+Outcome ServerStream(std::string const &address, Settings const &settings) {
+	auto stub = Greeter::NewStub(
+			grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+	auto loop = RunLoop(settings, [&]() -> std::int64_t {
+		grpc::ClientContext context;
+		context.set_deadline(std::chrono::system_clock::now() +
+												 std::chrono::seconds(10));
+		HelloRequest request;
+		request.set_name("perf");
+		auto reader = stub->SayHellos(&context, request);
+		HelloReply reply;
+		std::int64_t messages = 0;
+		while (reader->Read(&reply)) {
+			++messages;
+		}
+		return reader->Finish().ok() ? messages : -1;
+	});
+	Outcome outcome;
+	if (loop.failed) {
+		outcome.ok = false;
+		outcome.error = std::to_string(loop.failed) + " streams failed";
+	}
+	outcome.metrics = {{"messages_per_s", loop.messages_per_s, true},
+										 {"streams_per_s", loop.calls_per_s, true}};
+	return outcome;
+}
+
+/// Uploads of 16MB in 256KB chunks, checked against the server's reply.
+Outcome ClientStream(std::string const &address, Settings const &settings) {
+	constexpr std::size_t kUploadSize = 16 << 20;
+	constexpr std::size_t kChunkSize = 256 << 10;
+	std::string data(kChunkSize, '\0');
+	for (std::size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<char>(i * 31 + 7);
+	}
+	auto chunk_crc = Crc32(data);
+	auto stub = Greeter::NewStub(
+			grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+	auto loop = RunLoop(settings, [&]() -> std::int64_t {
+		grpc::ClientContext context;
+		context.set_deadline(std::chrono::system_clock::now() +
+												 std::chrono::seconds(30));
+		UploadReply reply;
+		auto writer = stub->Upload(&context, &reply);
+		UploadChunk chunk;
+		std::uint32_t crc = 0;
+		std::uint64_t offset = 0;
+		for (std::uint64_t sequence = 0; offset < kUploadSize; ++sequence) {
+			chunk.set_total_size(kUploadSize);
+			chunk.set_sequence(sequence);
+			chunk.set_offset(offset);
+			chunk.set_data(data);
+			chunk.set_crc32(chunk_crc);
+			if (!writer->Write(chunk))
+				break;
+			crc = Crc32(data, crc);
+			offset += data.size();
+		}
+		writer->WritesDone();
+		auto status = writer->Finish();
+		auto ok = status.ok() && reply.received() == offset &&
+							reply.crc32() == crc && offset == kUploadSize;
+		return ok ? static_cast<std::int64_t>(offset) : -1;
+	});
+	Outcome outcome;
+	if (loop.failed) {
+		outcome.ok = false;
+		outcome.error = std::to_string(loop.failed) + " uploads failed";
+	}
+	outcome.metrics = {{"mb_per_s", loop.messages_per_s / (1 << 20), true}};
+	return outcome;
+}
+
+/// SayHelloBidir echo round trips, one request in flight on each stream.
+Outcome BidiEcho(std::string const &address, Settings const &settings) {
+	auto channel =
+			grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < 2; ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+	LatencyRecorder latencies;
+	std::vector<std::shared_ptr<SayHelloBidirClient>> clients;
+	for (auto i = 0; i < settings.concurrency; ++i) {
+		clients.push_back(std::make_shared<SayHelloBidirClient>(channel, &cq, 1));
+		clients.back()->Start();
+	}
+	// Each thread keeps to a stream of its own.
+	std::atomic<std::size_t> next{0};
+	auto loop = RunLoop(settings, [&] {
+		thread_local auto client = clients[next++ % clients.size()];
+		auto sent = std::chrono::steady_clock::now();
+		auto ok = client->Write("perf").get().status.ok();
+		latencies.Record(std::chrono::steady_clock::now() - sent);
+		return std::int64_t(ok ? 1 : -1);
+	});
+	for (auto &client : clients) {
+		// The server keeps a stream open after the client half closes it.
+		auto finished = client->Finished();
+		client->WritesDone();
+		client->Cancel();
+		finished.wait();
+	}
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	Outcome outcome;
+	if (loop.failed) {
+		outcome.ok = false;
+		outcome.error = std::to_string(loop.failed) + " echoes failed";
+	}
+	outcome.metrics = {{"echoes_per_s", loop.messages_per_s, true},
+										 {"p50_us", Us(latencies.Percentile(0.5)), false},
+										 {"p99_us", Us(latencies.Percentile(0.99)), false}};
+	return outcome;
+}
+
+struct Scenario {
+	char const *name;
+	/// Executable of the server it runs against.
+	char const *server;
+	Outcome (*run)(std::string const &, Settings const &);
+	/// Flag of the server's setting for how many threads serve calls, null if
+	/// it has none.
+	char const *threads_flag;
+};
+constexpr Scenario kScenarios[] = {
+		{"unary", "server", Unary, "cqs"},
+		{"server_stream", "server_stream", ServerStream, "threads"},
+		{"client_stream", "server_stream_client", ClientStream, "threads"},
+		{"bidi", "server_stream_bidir", BidiEcho, nullptr},
+};
+
+/// Starts program listening on address, runs scenario against it and stops it.
+/// @param started Called once the server has been started, before the load
+/// @return false if the server didn't start
+bool RunWithServer(Scenario const &scenario, std::string const &program,
+									 std::vector<std::string> args, std::string const &address,
+									 std::string const &log, Settings const &settings,
+									 Outcome *outcome, std::function<void()> started = {}) {
+	args.push_back("--address=" + address);
+	ChildProcess server(program, args, log);
+	if (started)
+		started();
+	auto channel =
+			grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+	if (!channel->WaitForConnected(std::chrono::system_clock::now() +
+																 std::chrono::seconds(10))) {
+		std::cerr << program << " didn't start listening on " << address
+							<< ", see " << log << std::endl;
+		return false;
+	}
+	*outcome = scenario.run(address, settings);
+	channel.reset();
+	if (!server.Stop())
+		std::cerr << scenario.server << " had to be killed" << std::endl;
+	return true;
+}
+
+#ifdef __linux__
+/// Pins the calling thread, and the threads and processes it starts from then
+/// on, to count of the allowed cores, skipping the first.
+void Pin(cpu_set_t const &allowed, int first, int count) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu = 0, seen = 0; cpu < CPU_SETSIZE && seen < first + count;
+			 ++cpu) {
+		if (CPU_ISSET(cpu, &allowed) && seen++ >= first)
+			CPU_SET(cpu, &set);
+	}
+	sched_setaffinity(0, sizeof(set), &set);
+}
+#endif
+
+/// Runs scenario once for each of cores, with the server given that many
+/// threads and, on Linux, pinned to that many cores. The load runs on as many
+/// of the other cores, or on every core if there aren't enough. Prints each
+/// metric and how much it changed from the first core count.
+/// @return Exit code
+int Sweep(Scenario const &scenario, std::string const &program,
+					std::vector<int> const &cores, std::string const &address,
+					std::string const &log, Settings const &settings) {
+	if (!scenario.threads_flag) {
+		std::cerr << scenario.server << " has no thread count to sweep"
+							<< std::endl;
+		return 2;
+	}
+#ifdef __linux__
+	cpu_set_t allowed;
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	auto available = CPU_COUNT(&allowed);
+#endif
+	std::vector<Metric> first;
+	for (auto n : cores) {
+		n = std::max(n, 1);
+#ifdef __linux__
+		if (2 * n > available)
+			std::cout << "cores=" << n << ": only " << available
+								<< " cores, the load isn't pinned" << std::endl;
+		Pin(allowed, 0, std::min(n, available));
+		std::function<void()> started = [&] {
+			if (2 * n > available)
+				sched_setaffinity(0, sizeof(allowed), &allowed);
+			else
+				Pin(allowed, n, n);
+		};
+#else
+		std::function<void()> started;
+#endif
+		Outcome outcome;
+		auto threads =
+				"--" + std::string(scenario.threads_flag) + "=" + std::to_string(n);
+		auto ran = RunWithServer(scenario, program, {threads}, address, log,
+														 settings, &outcome, started);
+#ifdef __linux__
+		sched_setaffinity(0, sizeof(allowed), &allowed);
+#endif
+		if (!ran)
+			return 1;
+		if (!outcome.ok) {
+			std::cerr << "cores=" << n << " failed: " << outcome.error << std::endl;
+			return 1;
+		}
+		if (first.empty())
+			first = outcome.metrics;
+		std::cout << "cores=" << n;
+		for (std::size_t i = 0; i < outcome.metrics.size(); ++i) {
+			auto &m = outcome.metrics[i];
+			std::cout << " " << m.name << ": " << m.value;
+			if (i < first.size() && first[i].value > 0)
+				std::cout << " (x" << m.value / first[i].value << ")";
+		}
+		std::cout << std::endl;
+	}
+	return 0;
+}
+
+bool ReadJson(std::string const &path, Struct *json) {
+	std::ifstream in(path);
+	if (!in)
+		return false;
+	std::string text((std::istreambuf_iterator<char>(in)),
+									 std::istreambuf_iterator<char>());
+	return google::protobuf::util::JsonStringToMessage(text, json).ok();
+}
+bool WriteJson(std::string const &path, Struct const &json) {
+	std::string text;
+	google::protobuf::util::JsonPrintOptions options;
+	options.add_whitespace = true;
+	if (!google::protobuf::util::MessageToJsonString(json, &text, options).ok())
+		return false;
+	std::ofstream out(path, std::ios::trunc);
+	out << text;
+	return static_cast<bool>(out);
+}
+
+/// Runs one scenario against a server it starts on localhost, writes what it
+/// measured as JSON and compares it with a baseline.
+///
+///     perf_suite --scenario=unary --bin-dir=<dir with the servers>
+///       --baseline=perf/baseline.json --out=unary.json --threshold=0.25
+///
+/// Fails if a metric is worse than the baseline's by more than --threshold (a
+/// fraction), or if calls fail. A scenario missing from the baseline passes.
+/// --update-baseline writes the results into the baseline instead.
+///
+/// Every scenario warms up for --warmup-ms (1000), measures for --duration-ms
+/// (3000) and keeps --concurrency calls in flight (16). The server listens on
+/// --port (50090) and writes its output to --out with .log for .json.
+///
+/// --cores=1,2,4,8 measures how the server scales instead: the scenario runs
+/// once per core count, see Sweep. Nothing is written or compared.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto name = flags.Get("scenario", "");
+	auto scenario = std::find_if(
+			std::begin(kScenarios), std::end(kScenarios),
+			[&](Scenario const &s) { return name == s.name; });
+	if (scenario == std::end(kScenarios)) {
+		std::cerr << "unknown --scenario=" << name << ", one of:";
+		for (auto &s : kScenarios) {
+			std::cerr << " " << s.name;
+		}
+		std::cerr << std::endl;
+		return 2;
+	}
+	auto bin_dir = flags.Get("bin-dir", ".");
+	auto baseline_path = flags.Get("baseline", "");
+	auto out_path = flags.Get("out", name + ".json");
+	auto threshold = flags.Get("threshold", 0.25);
+	Settings settings{std::chrono::milliseconds(flags.Get("warmup-ms", 1000)),
+										std::chrono::milliseconds(flags.Get("duration-ms", 3000)),
+										std::max(flags.Get("concurrency", 16), 1)};
+	auto address = "127.0.0.1:" + std::to_string(flags.Get("port", 50090));
+
+#ifdef _WIN32
+	auto program = bin_dir + "/" + scenario->server + ".exe";
+#else
+	auto program = bin_dir + "/" + scenario->server;
+#endif
+	auto log = out_path.substr(0, out_path.rfind(".json")) + ".log";
+	auto cores = flags.GetList<int>("cores", {});
+	if (!cores.empty())
+		return Sweep(*scenario, program, cores, address, log, settings);
+	Outcome outcome;
+	if (!RunWithServer(*scenario, program, {}, address, log, settings, &outcome))
+		return 1;
+
+	Struct results;
+	auto &fields = *results.mutable_fields();
+	fields["scenario"].set_string_value(name);
+	fields["server"].set_string_value(scenario->server);
+	auto &metrics = *fields["metrics"].mutable_struct_value()->mutable_fields();
+	for (auto &m : outcome.metrics) {
+		metrics[m.name].set_number_value(m.value);
+	}
+	if (!WriteJson(out_path, results)) {
+		std::cerr << "couldn't write --out=" << out_path << std::endl;
+		return 1;
+	}
+	if (!outcome.ok) {
+		std::cerr << name << " failed: " << outcome.error << std::endl;
+		return 1;
+	}
+
+	Struct baseline;
+	auto have_baseline =
+			!baseline_path.empty() && ReadJson(baseline_path, &baseline);
+	if (flags.Get("update-baseline", false)) {
+		auto &entry = (*baseline.mutable_fields())[name];
+		entry.mutable_struct_value()->CopyFrom(fields["metrics"].struct_value());
+		if (baseline_path.empty() || !WriteJson(baseline_path, baseline)) {
+			std::cerr << "couldn't write --baseline=" << baseline_path << std::endl;
+			return 1;
+		}
+		std::cout << "updated " << name << " in " << baseline_path << std::endl;
+		return 0;
+	}
+	auto const &expected = baseline.fields();
+	auto it = expected.find(name);
+	if (!have_baseline || it == expected.end()) {
+		std::cout << "no baseline for " << name << ", not compared" << std::endl;
+		for (auto &m : outcome.metrics) {
+			std::cout << "  " << m.name << ": " << m.value << std::endl;
+		}
+		return 0;
+	}
+	auto regressed = false;
+	auto const &base = it->second.struct_value().fields();
+	for (auto &m : outcome.metrics) {
+		auto b = base.find(m.name);
+		if (b == base.end() || b->second.number_value() <= 0) {
+			std::cout << "  " << m.name << ": " << m.value << " (no baseline)"
+								<< std::endl;
+			continue;
+		}
+		auto was = b->second.number_value();
+		// How much worse than the baseline, as a fraction of it.
+		auto worse = m.higher_is_better ? (was - m.value) / was
+																		: (m.value - was) / was;
+		auto bad = worse > threshold;
+		regressed |= bad;
+		std::cout << "  " << m.name << ": " << m.value << " baseline: " << was
+							<< " change: " << (m.higher_is_better ? -worse : worse) * 100
+							<< "%" << (bad ? " REGRESSED" : "") << std::endl;
+	}
+	return regressed ? 1 : 0;
+}
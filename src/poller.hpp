@@ -0,0 +1,352 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+
+#include "common.hpp"
+#include "flags.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
+
+struct PollerOptions {
+	/// Measure every event. Costs two clock reads per event.
+	bool instrument = false;
+	/// Handlers that run for longer than this are reported as they finish, zero
+	/// to not check. Needs instrument.
+	std::chrono::milliseconds slow_handler{0};
+	/// Report to stdout this often, zero to only report when asked. Needs
+	/// instrument.
+	std::chrono::milliseconds report_every{0};
+	/// Resolution of timers set with Poller::After.
+	std::chrono::nanoseconds timer_tick = std::chrono::milliseconds(1);
+};
+
+/// --poller-stats turns on instrumentation, which --slow-handler-ms=N and
+/// --poller-report-ms=N also imply.
+inline PollerOptions PollerOptionsFromFlags(Flags const &flags) {
+	PollerOptions options;
+	options.slow_handler =
+			std::chrono::milliseconds(flags.Get("slow-handler-ms", 0));
+	options.report_every =
+			std::chrono::milliseconds(flags.Get("poller-report-ms", 0));
+	options.instrument = flags.Get("poller-stats", false) ||
+											 options.slow_handler.count() ||
+											 options.report_every.count();
+	return options;
+}
+
+/// Histogram of durations with a bucket per power of two nanoseconds.
+///
+/// Only one thread records into it but any thread can read it.
+class DurationHistogram {
+public:
+	void Record(std::int64_t ns) {
+		std::size_t bucket = 0;
+		while (bucket + 1 < buckets.size() && (std::int64_t(1) << bucket) <= ns)
+			++bucket;
+		buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+		if (ns > max.load(std::memory_order_relaxed))
+			max.store(ns, std::memory_order_relaxed);
+	}
+	using Counts = std::array<std::uint64_t, 48>;
+	Counts Snapshot() const {
+		Counts counts;
+		for (std::size_t i = 0; i < buckets.size(); ++i)
+			counts[i] = buckets[i].load(std::memory_order_relaxed);
+		return counts;
+	}
+	std::int64_t Max() const { return max.load(std::memory_order_relaxed); }
+
+	/// @return Upper bound in nanoseconds of the bucket holding percentile p
+	static std::int64_t Percentile(Counts const &counts, double p) {
+		std::uint64_t total = 0;
+		for (auto c : counts)
+			total += c;
+		if (!total)
+			return 0;
+		auto rank = static_cast<std::uint64_t>(p / 100 * (total - 1));
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < counts.size(); ++i) {
+			seen += counts[i];
+			if (seen > rank)
+				return std::int64_t(1) << i;
+		}
+		return std::int64_t(1) << (counts.size() - 1);
+	}
+
+private:
+	std::array<std::atomic<std::uint64_t>, 48> buckets{};
+	std::atomic<std::int64_t> max{0};
+};
+
+/// Runs completion queue loops and measures how busy each polling thread is.
+///
+/// For every event it records the time spent waiting in Next (idle), the time
+/// spent in the handler (busy) and the handler's duration. For handlers of a
+/// traced call it also records how long the operation was pending, which
+/// includes waiting in the completion queue. Handlers that block a thread for
+/// too long are reported by name (see TraceTag).
+///
+/// Polling uses AsyncNext with a deadline set by the thread's timer wheel
+/// (timer_wheel.hpp). Without timers that is the same as Next.
+class Poller {
+public:
+	explicit Poller(PollerOptions options = {}) : options(options) {
+		if (options.instrument && options.report_every.count())
+			ReportEvery(options.report_every, std::cout);
+	}
+	~Poller() { StopReporting(); }
+
+	bool Instrumented() const { return options.instrument; }
+
+	/// Polls cq on the calling thread until it's shut down and drained.
+	///
+	/// Handlers run from here can set timers on this thread with After(). Timers
+	/// still pending at shutdown are dropped without being called.
+	void Run(grpc::CompletionQueue *cq) {
+		TimerWheel wheel;
+		auto &local = Local();
+		local = {&wheel, Tracer::Now(), options.timer_tick.count()};
+		auto thread = options.instrument ? &Register() : nullptr;
+		auto slow = std::chrono::nanoseconds(options.slow_handler).count();
+		void *tag;
+		bool ok;
+		auto before = thread ? Tracer::Now() : 0;
+		while (true) {
+			auto status = cq->AsyncNext(&tag, &ok, Deadline(wheel));
+			if (status == grpc::CompletionQueue::SHUTDOWN)
+				break;
+			if (!thread) {
+				if (status == grpc::CompletionQueue::GOT_EVENT)
+					static_cast<Tag *>(tag)->Proceed(ok);
+				if (wheel.Size())
+					wheel.Advance(local.Ticks());
+				continue;
+			}
+
+			auto start = Tracer::Now();
+			thread->idle_ns.fetch_add(start - before, std::memory_order_relaxed);
+			if (status == grpc::CompletionQueue::GOT_EVENT) {
+				auto handler = static_cast<Tag *>(tag);
+				// Handlers delete themselves.
+				auto name = handler->trace.name;
+				auto issued = handler->issued;
+				handler->Proceed(ok);
+				auto end = Tracer::Now();
+				thread->events.fetch_add(1, std::memory_order_relaxed);
+				thread->exec.Record(end - start);
+				if (issued)
+					thread->pending.Record(start - issued);
+				if (slow && end - start > slow) {
+					thread->slow.fetch_add(1, std::memory_order_relaxed);
+					std::cerr << "slow handler " << (name ? name : "unnamed")
+										<< " took " << (end - start) / 1e6 << "ms on poller "
+										<< thread->index << std::endl;
+				}
+			}
+			if (wheel.Size())
+				wheel.Advance(local.Ticks());
+			before = Tracer::Now();
+			thread->busy_ns.fetch_add(before - start, std::memory_order_relaxed);
+		}
+		local = {};
+	}
+
+	/// Calls f on the calling thread after delay. Only for handlers and timers
+	/// run by Run, which are the only ones that don't need a lock for it.
+	static TimerWheel::Handle After(std::chrono::nanoseconds delay,
+																	std::function<void()> f) {
+		auto &local = Local();
+		assert(local.wheel && "After() called off a polling thread");
+		auto now = local.Ticks();
+		// The wheel is only moved on while it has timers, an empty one can catch
+		// up without firing anything.
+		if (!local.wheel->Size())
+			local.wheel->Advance(now);
+		// Rounded up so the timer never fires early.
+		auto ticks = (delay.count() + local.tick_ns - 1) / local.tick_ns;
+		return local.wheel->Schedule(now + std::max<std::int64_t>(ticks, 1),
+																 std::move(f));
+	}
+	/// Cancels a timer set with After() on the same thread.
+	/// @return Whether it hadn't fired yet
+	static bool Cancel(TimerWheel::Handle handle) {
+		auto &local = Local();
+		return local.wheel && local.wheel->Cancel(handle);
+	}
+	/// Calls f on a thread polling cq. Safe to call from any thread, for example
+	/// to set a timer on a call's own thread. Wakes the thread with an Alarm
+	/// that has already expired.
+	///
+	/// The caller has to make sure cq->Shutdown() hasn't been called yet, gRPC
+	/// asserts on an alarm set on a queue that's shut down. f may still not be
+	/// called if the queue shuts down after Post and before the alarm fires.
+	static void Post(grpc::CompletionQueue *cq, std::function<void()> f) {
+		auto alarm = std::make_shared<grpc::Alarm>();
+		alarm->Set(cq, gpr_now(GPR_CLOCK_MONOTONIC),
+							 new Handler([alarm, f = std::move(f)](bool ok) {
+								 if (ok)
+									 f();
+							 }));
+	}
+
+	/// Writes a line per polling thread with what happened since the last
+	/// report.
+	void Report(std::ostream &os) {
+		std::lock_guard l{report_mutex};
+		auto now = Tracer::Now();
+		auto elapsed = (now - last_report) / 1e9;
+		last_report = now;
+		std::vector<std::shared_ptr<Thread>> all;
+		{
+			std::lock_guard l{threads_mutex};
+			all = threads;
+		}
+		for (auto &t : all) {
+			auto &last = t->last;
+			auto events = t->events.load(std::memory_order_relaxed);
+			auto busy = t->busy_ns.load(std::memory_order_relaxed);
+			auto idle = t->idle_ns.load(std::memory_order_relaxed);
+			auto slow = t->slow.load(std::memory_order_relaxed);
+			auto exec = t->exec.Snapshot();
+			auto pending = t->pending.Snapshot();
+			auto d_busy = busy - last.busy_ns;
+			auto d_idle = idle - last.idle_ns;
+			auto total = d_busy + d_idle;
+			DurationHistogram::Counts d_exec, d_pending;
+			std::uint64_t pending_count = 0;
+			for (std::size_t i = 0; i < exec.size(); ++i) {
+				d_exec[i] = exec[i] - last.exec[i];
+				d_pending[i] = pending[i] - last.pending[i];
+				pending_count += d_pending[i];
+			}
+			// Buckets are rounded up to a power of two, which can't be over the max.
+			auto us = [](std::int64_t ns) { return ns / 1000.0; };
+			auto exec_us = [&](double p) {
+				return us(std::min(DurationHistogram::Percentile(d_exec, p),
+													 t->exec.Max()));
+			};
+			auto pending_us = [&](double p) {
+				return us(std::min(DurationHistogram::Percentile(d_pending, p),
+													 t->pending.Max()));
+			};
+			os << "poller " << t->index << ": " << (events - last.events) / elapsed
+				 << " events/s busy: " << std::fixed << std::setprecision(1)
+				 << (total ? 100.0 * d_busy / total : 0.0) << "%"
+				 << std::defaultfloat << std::setprecision(6) << " exec us p50: "
+				 << exec_us(50) << " p99: " << exec_us(99)
+				 << " max since start: " << us(t->exec.Max())
+				 << " slow: " << slow - last.slow;
+			if (pending_count) {
+				os << " pending us p50: " << pending_us(50)
+					 << " p99: " << pending_us(99) << " (" << pending_count << " traced)";
+			}
+			os << "\n";
+			last = {events, busy, idle, slow, exec, pending};
+		}
+		os << std::flush;
+	}
+
+	/// Calls Report every interval on a background thread until
+	/// StopReporting.
+	void ReportEvery(std::chrono::milliseconds interval, std::ostream &os) {
+		StopReporting();
+		stop = false;
+		reporter = std::thread([this, interval, &os] {
+			std::unique_lock l{stop_mutex};
+			while (!stop_cv.wait_for(l, interval, [this] { return stop; })) {
+				Report(os);
+			}
+		});
+	}
+	void StopReporting() {
+		{
+			std::lock_guard l{stop_mutex};
+			stop = true;
+		}
+		stop_cv.notify_all();
+		if (reporter.joinable())
+			reporter.join();
+	}
+
+private:
+	/// Timers of the Run on this thread.
+	struct LocalTimers {
+		TimerWheel *wheel = nullptr;
+		std::int64_t epoch = 0;
+		std::int64_t tick_ns = 1;
+		std::uint64_t Ticks() const { return (Tracer::Now() - epoch) / tick_ns; }
+	};
+	static LocalTimers &Local() {
+		thread_local LocalTimers local;
+		return local;
+	}
+	/// Wakes up in time for the next timer, or never without timers.
+	gpr_timespec Deadline(TimerWheel const &wheel) const {
+		auto ticks = wheel.TicksUntilNext();
+		if (ticks == std::numeric_limits<std::uint64_t>::max())
+			return gpr_inf_future(GPR_CLOCK_MONOTONIC);
+		auto &local = Local();
+		auto ns = static_cast<std::int64_t>(wheel.Now() + ticks) * local.tick_ns +
+							local.epoch - Tracer::Now();
+		return gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC),
+												gpr_time_from_nanos(std::max<std::int64_t>(ns, 0),
+																						GPR_TIMESPAN));
+	}
+
+	struct Snapshot {
+		std::uint64_t events = 0;
+		std::int64_t busy_ns = 0;
+		std::int64_t idle_ns = 0;
+		std::uint64_t slow = 0;
+		DurationHistogram::Counts exec{};
+		DurationHistogram::Counts pending{};
+	};
+	/// Written by its polling thread only.
+	struct Thread {
+		std::size_t index;
+		std::atomic<std::uint64_t> events{0};
+		std::atomic<std::int64_t> busy_ns{0};
+		std::atomic<std::int64_t> idle_ns{0};
+		std::atomic<std::uint64_t> slow{0};
+		DurationHistogram exec;
+		DurationHistogram pending;
+		/// What the previous report saw, guarded by report_mutex.
+		Snapshot last;
+	};
+
+	Thread &Register() {
+		auto thread = std::make_shared<Thread>();
+		std::lock_guard l{threads_mutex};
+		thread->index = threads.size();
+		threads.push_back(thread);
+		return *thread;
+	}
+
+	PollerOptions options;
+	std::mutex threads_mutex;
+	std::vector<std::shared_ptr<Thread>> threads;
+	std::mutex report_mutex;
+	std::int64_t last_report = Tracer::Now();
+	std::mutex stop_mutex;
+	std::condition_variable stop_cv;
+	bool stop = false;
+	std::thread reporter;
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "common.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "trace.hpp"
+
+/// Client metadata key a call can set to "high" or "low" to pick its priority
+/// instead of its method's.
+constexpr char const *kPriorityKey = "x-priority";
+
+inline char const *PriorityName(Priority priority) {
+	return priority == Priority::High ? "high" : "low";
+}
+/// @return false if value isn't the name of a priority
+inline bool ParsePriority(std::string const &value, Priority *priority) {
+	if (value == "high")
+		*priority = Priority::High;
+	else if (value == "low")
+		*priority = Priority::Low;
+	else
+		return false;
+	return true;
+}
+
+struct PriorityOptions {
+	/// Dispatch events in order of priority, otherwise in the order the queue
+	/// returns them.
+	bool enabled = true;
+	/// Share of the events dispatched while every class has some waiting,
+	/// by Priority. High gets weight / sum of weights of the thread's time.
+	std::array<int, kPriorities> weights{4, 1};
+	/// Most events taken from the completion queue ahead of dispatching one.
+	std::size_t max_batch = 64;
+};
+
+/// --priority=false dispatches in order, --priority-weights=4,1 sets the
+/// weights of high and low priority and --priority-batch=N the batch.
+inline PriorityOptions PriorityOptionsFromFlags(Flags const &flags) {
+	PriorityOptions options;
+	options.enabled = flags.Get("priority", options.enabled);
+	auto weights = flags.GetList<int>(
+			"priority-weights",
+			{options.weights.begin(), options.weights.end()});
+	for (std::size_t i = 0; i < kPriorities && i < weights.size(); ++i) {
+		options.weights[i] = std::max(weights[i], 1);
+	}
+	options.max_batch = std::max<std::size_t>(
+			flags.Get<std::size_t>("priority-batch", options.max_batch), 1);
+	return options;
+}
+
+/// Runs completion queue loops that dispatch events by the priority of their
+/// tag instead of in order.
+///
+/// A completion queue has a single FIFO, so with every method on the same
+/// queues a flood of stream events sits in front of a unary call's. Each
+/// thread takes whatever events are ready, up to max_batch, without waiting,
+/// and keeps them in a queue per class. It then dispatches one, picking the
+/// class by smooth weighted round robin among the classes with events waiting,
+/// and goes back for more. While both classes are busy high priority gets its
+/// weight's share of the dispatches, and low priority is never starved.
+///
+/// For each class it counts events and measures how long they waited between
+/// being taken from the completion queue and being dispatched. Time spent in
+/// the completion queue itself isn't seen.
+class PriorityDispatcher {
+public:
+	explicit PriorityDispatcher(PriorityOptions options = {})
+			: options(options) {}
+
+	PriorityOptions const &Options() const { return options; }
+
+	/// Dispatches events of cq on the calling thread until it's shut down and
+	/// drained.
+	void Run(grpc::CompletionQueue *cq) {
+		void *tag;
+		bool ok;
+		if (!options.enabled) {
+			while (cq->Next(&tag, &ok)) {
+				static_cast<Tag *>(tag)->Proceed(ok);
+			}
+			return;
+		}
+
+		auto &stats = Register();
+		std::array<std::deque<Event>, kPriorities> queues;
+		std::array<std::int64_t, kPriorities> current{};
+		std::size_t queued = 0;
+		bool shutdown = false;
+		while (true) {
+			// Waits only while there's nothing to dispatch.
+			for (std::size_t taken = 0; !shutdown && taken < options.max_batch;
+					 ++taken) {
+				auto deadline = queued ? gpr_inf_past(GPR_CLOCK_MONOTONIC)
+															 : gpr_inf_future(GPR_CLOCK_MONOTONIC);
+				auto status = cq->AsyncNext(&tag, &ok, deadline);
+				if (status == grpc::CompletionQueue::SHUTDOWN)
+					shutdown = true;
+				if (status != grpc::CompletionQueue::GOT_EVENT)
+					break;
+				auto event = static_cast<Tag *>(tag);
+				auto index = static_cast<std::size_t>(event->priority);
+				queues[std::min(index, kPriorities - 1)].push_back(
+						{event, ok, Tracer::Now()});
+				++queued;
+			}
+			if (!queued) {
+				if (shutdown)
+					break;
+				continue;
+			}
+
+			// Smooth weighted round robin: every class with events gains its
+			// weight, the one ahead is picked and drops back by the total.
+			std::size_t pick = kPriorities;
+			std::int64_t total = 0;
+			for (std::size_t i = 0; i < kPriorities; ++i) {
+				if (queues[i].empty())
+					continue;
+				current[i] += options.weights[i];
+				total += options.weights[i];
+				if (pick == kPriorities || current[i] > current[pick])
+					pick = i;
+			}
+			current[pick] -= total;
+			auto event = queues[pick].front();
+			queues[pick].pop_front();
+			--queued;
+			auto &c = stats.classes[pick];
+			c.events.fetch_add(1, std::memory_order_relaxed);
+			c.delay.Record(Tracer::Now() - event.taken);
+			// Handlers delete themselves.
+			event.tag->Proceed(event.ok);
+		}
+	}
+
+	/// Writes a line per class with the events dispatched and how long they
+	/// waited, over every thread since the start.
+	void Report(std::ostream &os) {
+		std::vector<std::shared_ptr<Stats>> all;
+		{
+			std::lock_guard l{threads_mutex};
+			all = threads;
+		}
+		for (std::size_t i = 0; i < kPriorities; ++i) {
+			std::uint64_t events = 0;
+			std::int64_t max = 0;
+			DurationHistogram::Counts delay{};
+			for (auto &t : all) {
+				auto &c = t->classes[i];
+				events += c.events.load(std::memory_order_relaxed);
+				max = std::max(max, c.delay.Max());
+				auto counts = c.delay.Snapshot();
+				for (std::size_t b = 0; b < delay.size(); ++b) {
+					delay[b] += counts[b];
+				}
+			}
+			// Buckets are rounded up to a power of two, which can't be over the max.
+			auto us = [&](double p) {
+				return std::min(DurationHistogram::Percentile(delay, p), max) / 1000.0;
+			};
+			os << PriorityName(static_cast<Priority>(i))
+				 << " priority events: " << events << " queued us p50: " << us(50)
+				 << " p99: " << us(99) << " max: " << max / 1000.0 << "\n";
+		}
+		os << std::flush;
+	}
+
+private:
+	struct Event {
+		Tag *tag;
+		bool ok;
+		/// When it was taken from the completion queue.
+		std::int64_t taken;
+	};
+	struct Class {
+		std::atomic<std::uint64_t> events{0};
+		DurationHistogram delay;
+	};
+	/// Written by its dispatching thread only.
+	struct Stats {
+		std::array<Class, kPriorities> classes;
+	};
+
+	Stats &Register() {
+		auto stats = std::make_shared<Stats>();
+		std::lock_guard l{threads_mutex};
+		threads.push_back(stats);
+		return *stats;
+	}
+
+	PriorityOptions const options;
+	std::mutex threads_mutex;
+	std::vector<std::shared_ptr<Stats>> threads;
+};
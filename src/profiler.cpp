@@ -0,0 +1,33 @@
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include "profiler.hpp"
+
+// The global operator new and delete, replaced so the heap profile sees every
+// allocation made with them.
+
+#ifndef _WIN32
+
+namespace {
+/// Not inlined, so GCC doesn't see free called on memory from operator new
+/// wherever operator delete is inlined and warn about a mismatch.
+__attribute__((noinline)) void Free(void *p) noexcept { std::free(p); }
+} // namespace
+
+void *operator new(std::size_t size) {
+	void *p;
+	while (!(p = std::malloc(size ? size : 1))) {
+		auto handler = std::get_new_handler();
+		if (!handler)
+			throw std::bad_alloc();
+		handler();
+	}
+	if (profiler::heap_on.load(std::memory_order_relaxed))
+		profiler::OnAllocate(size);
+	return p;
+}
+void operator delete(void *p) noexcept { Free(p); }
+void operator delete(void *p, std::size_t) noexcept { Free(p); }
+
+#endif
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <execinfo.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "flags.hpp"
+
+struct ProfilerOptions {
+	/// Directory the profiles are written to.
+	std::string dir = ".";
+	/// CPU profile samples a second of CPU time, up to 1000000.
+	int cpu_hz = 100;
+	/// Most CPU samples kept, later ones are dropped.
+	std::size_t max_cpu_samples = 1 << 16;
+	/// Bytes allocated between heap samples, on average.
+	std::size_t heap_sample_bytes = 512 << 10;
+};
+
+/// --profile-dir (.), --profile-hz (100) and --heap-sample-kb (512).
+inline ProfilerOptions ProfilerOptionsFromFlags(Flags const &flags) {
+	ProfilerOptions options;
+	options.dir = flags.Get("profile-dir", options.dir);
+	options.cpu_hz = flags.Get("profile-hz", options.cpu_hz);
+	options.heap_sample_bytes =
+			flags.Get<std::size_t>("heap-sample-kb", options.heap_sample_bytes >> 10)
+			<< 10;
+	return options;
+}
+
+namespace profiler {
+/// Frames kept per sample.
+constexpr int kMaxDepth = 64;
+/// Frames of the profiler itself at the top of every stack.
+constexpr int kSkip = 2;
+using Stack = std::vector<void *>;
+
+struct CpuSample {
+	int depth;
+	void *pcs[kMaxDepth + kSkip];
+};
+inline std::atomic<bool> cpu_on{false};
+inline std::vector<CpuSample> cpu_samples;
+inline std::atomic<std::size_t> cpu_next{0};
+/// Timer handlers between checking cpu_on and finishing their sample.
+inline std::atomic<int> cpu_in_flight{0};
+
+inline std::atomic<bool> heap_on{false};
+inline std::atomic<std::size_t> heap_sample_bytes{512 << 10};
+/// Changes with every heap profile so threads start counting afresh.
+inline std::atomic<std::uint64_t> heap_generation{0};
+struct HeapStack {
+	std::uint64_t objects = 0;
+	std::uint64_t bytes = 0;
+};
+inline std::mutex heap_mutex;
+inline std::map<Stack, HeapStack> heap_stacks;
+
+inline std::atomic<bool> toggle_cpu{false};
+inline std::atomic<bool> toggle_heap{false};
+
+#ifndef _WIN32
+/// Runs on whichever thread was using CPU time when the timer expired, so it
+/// only writes into a sample reserved up front.
+///
+/// cpu_in_flight and cpu_on are seq_cst: the handler adds to cpu_in_flight
+/// then loads cpu_on, StopCpu clears cpu_on then loads cpu_in_flight. Either
+/// the handler sees the profile is off or StopCpu waits for its sample.
+extern "C" inline void OnProfilingTimer(int) {
+	cpu_in_flight.fetch_add(1);
+	if (cpu_on.load()) {
+		auto saved_errno = errno;
+		auto i = cpu_next.fetch_add(1, std::memory_order_relaxed);
+		if (i < cpu_samples.size()) {
+			auto &sample = cpu_samples[i];
+			sample.depth = backtrace(sample.pcs, kMaxDepth + kSkip);
+		}
+		errno = saved_errno;
+	}
+	cpu_in_flight.fetch_sub(1);
+}
+extern "C" inline void OnToggleCpu(int) { toggle_cpu = true; }
+extern "C" inline void OnToggleHeap(int) { toggle_heap = true; }
+
+/// Bytes until the next sample, exponentially distributed around the mean so
+/// that allocation patterns don't line up with it.
+inline std::int64_t NextHeapSample() {
+	thread_local std::uint64_t state =
+			std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	auto uniform = (state >> 11) * (1.0 / 9007199254740992.0);
+	auto mean = static_cast<double>(heap_sample_bytes.load());
+	return static_cast<std::int64_t>(-std::log(1.0 - uniform) * mean) + 1;
+}
+
+/// Called by operator new while the heap profile is on. Not inlined so that
+/// the number of profiler frames is fixed.
+__attribute__((noinline)) inline void OnAllocate(std::size_t size) {
+	thread_local std::int64_t countdown = 0;
+	thread_local std::uint64_t generation = 0;
+	// Allocations the profiler makes itself aren't sampled.
+	thread_local bool busy = false;
+	if (busy)
+		return;
+	busy = true;
+	if (auto current = heap_generation.load(std::memory_order_relaxed);
+			generation != current) {
+		generation = current;
+		countdown = NextHeapSample();
+	}
+	countdown -= static_cast<std::int64_t>(size);
+	if (countdown <= 0) {
+		countdown = NextHeapSample();
+		void *pcs[kMaxDepth + kSkip];
+		auto depth = backtrace(pcs, kMaxDepth + kSkip);
+		Stack stack(pcs + std::min(depth, kSkip), pcs + depth);
+		std::lock_guard l{heap_mutex};
+		auto &entry = heap_stacks[stack];
+		++entry.objects;
+		entry.bytes += size;
+	}
+	busy = false;
+}
+
+/// Appends the memory map pprof needs to symbolize the addresses.
+inline void WriteMaps(std::ostream &os) {
+	std::ifstream maps("/proc/self/maps");
+	os << maps.rdbuf();
+}
+#endif
+} // namespace profiler
+
+/// Samples where the process spends CPU time and where it allocates, turned on
+/// and off while it runs and written as profiles pprof reads:
+///
+///     pprof -top <executable> cpu.<pid>.<n>.prof
+///     pprof -sample_index=alloc_space -top <executable> heap.<pid>.<n>.prof
+///
+/// The CPU profile comes from a SIGPROF timer interrupting whichever thread is
+/// running, like perf or gperftools, and is written in gperftools' format. Only
+/// the threads' own CPU time counts, so waiting in the completion queue
+/// doesn't show.
+///
+/// The heap profile samples allocations made with operator new, about one
+/// every heap_sample_bytes bytes, and is written in the heap_v2 format. It
+/// shows where memory is allocated, not what is still in use. In the servers
+/// that's mostly the handlers and the write queues. gRPC core allocates with
+/// malloc, so its allocations aren't seen.
+///
+/// Executables using it link profiler.cpp as well, which replaces the global
+/// operator new and delete. While the heap profile is off an allocation costs
+/// one more atomic load. There's one profiler per process. Needs POSIX
+/// signals, on Windows it says it can't and does nothing.
+class Profiler {
+public:
+	explicit Profiler(ProfilerOptions options) : options(options) {}
+	~Profiler() {
+		stop_watching = true;
+		if (watcher.joinable())
+			watcher.join();
+		if (profiler::cpu_on)
+			StopCpu();
+		if (profiler::heap_on)
+			StopHeap();
+	}
+	Profiler(Profiler const &) = delete;
+	Profiler &operator=(Profiler const &) = delete;
+
+	/// @return false if it's already on or can't be
+	bool StartCpu();
+	/// @return Path the profile was written to, empty if it wasn't
+	std::string StopCpu();
+	/// @return false if it's already on or can't be
+	bool StartHeap();
+	/// @return Path the profile was written to, empty if it wasn't
+	std::string StopHeap();
+
+	/// Makes SIGUSR1 turn the CPU profile on and off, and SIGUSR2 the heap
+	/// profile. A thread of the profiler's starts and stops them.
+	void HandleSignals();
+
+private:
+	/// Next file name for kind, unique to this process.
+	std::string NextPath(char const *kind) {
+		return options.dir + "/" + kind + "." + std::to_string(Pid()) + "." +
+					 std::to_string(profiles++) + ".prof";
+	}
+	/// Microseconds between CPU samples, at least 1 however high cpu_hz is.
+	long CpuPeriodUs() const { return std::max(1000000L / options.cpu_hz, 1L); }
+	static long Pid() {
+#ifdef _WIN32
+		return 0;
+#else
+		return static_cast<long>(getpid());
+#endif
+	}
+	/// Starts or stops kind and says what happened.
+	void Toggle(char const *kind, bool on, bool (Profiler::*start)(),
+							std::string (Profiler::*stop)()) {
+		if (!on) {
+			std::cout << ((this->*start)() ? "Started " : "Couldn't start ") << kind
+								<< " profile" << std::endl;
+		} else {
+			auto path = (this->*stop)();
+			std::cout << "Stopped " << kind << " profile"
+								<< (path.empty() ? ", couldn't write it" : ", wrote " + path)
+								<< std::endl;
+		}
+	}
+
+	ProfilerOptions options;
+	int profiles = 0;
+	std::thread watcher;
+	std::atomic<bool> stop_watching{false};
+};
+
+#ifndef _WIN32
+
+inline bool Profiler::StartCpu() {
+	if (profiler::cpu_on || options.cpu_hz <= 0)
+		return false;
+	// The first backtrace loads the unwinder, which isn't safe in a signal
+	// handler.
+	void *warm_up[1];
+	backtrace(warm_up, 1);
+	profiler::cpu_samples.assign(options.max_cpu_samples, {});
+	profiler::cpu_next = 0;
+	profiler::cpu_on = true;
+	struct sigaction action {};
+	action.sa_handler = profiler::OnProfilingTimer;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, nullptr);
+	itimerval timer{};
+	timer.it_interval.tv_usec = CpuPeriodUs();
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, nullptr);
+	return true;
+}
+
+inline std::string Profiler::StopCpu() {
+	if (!profiler::cpu_on)
+		return {};
+	itimerval off{};
+	setitimer(ITIMER_PROF, &off, nullptr);
+	profiler::cpu_on = false;
+	std::signal(SIGPROF, SIG_IGN);
+	// Handlers already running on other threads finish their sample before the
+	// samples are read and freed.
+	while (profiler::cpu_in_flight.load() != 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	auto taken = profiler::cpu_next.load();
+	auto kept = std::min(taken, profiler::cpu_samples.size());
+	std::map<profiler::Stack, std::uintptr_t> counts;
+	for (std::size_t i = 0; i < kept; ++i) {
+		auto &sample = profiler::cpu_samples[i];
+		auto skip = std::min(sample.depth, profiler::kSkip);
+		++counts[profiler::Stack(sample.pcs + skip, sample.pcs + sample.depth)];
+	}
+	profiler::cpu_samples = {};
+
+	auto path = NextPath("cpu");
+	std::ofstream out(path, std::ios::binary);
+	auto word = [&](std::uintptr_t value) {
+		out.write(reinterpret_cast<char const *>(&value), sizeof(value));
+	};
+	// Header: version 0 with 3 words of header after the count, the sampling
+	// period in microseconds and no flags.
+	for (std::uintptr_t value : {0L, 3L, 0L, CpuPeriodUs(), 0L}) {
+		word(value);
+	}
+	for (auto &[stack, count] : counts) {
+		word(count);
+		word(stack.size());
+		for (auto pc : stack) {
+			word(reinterpret_cast<std::uintptr_t>(pc));
+		}
+	}
+	// Trailer: a sample of 1 frame at address 0.
+	for (std::uintptr_t value : {0, 1, 0}) {
+		word(value);
+	}
+	profiler::WriteMaps(out);
+	if (taken > kept)
+		std::cout << "CPU profile dropped " << taken - kept << " of " << taken
+							<< " samples" << std::endl;
+	return out ? path : std::string();
+}
+
+inline bool Profiler::StartHeap() {
+	if (profiler::heap_on || options.heap_sample_bytes == 0)
+		return false;
+	void *warm_up[1];
+	backtrace(warm_up, 1);
+	{
+		std::lock_guard l{profiler::heap_mutex};
+		profiler::heap_stacks.clear();
+	}
+	profiler::heap_sample_bytes = options.heap_sample_bytes;
+	++profiler::heap_generation;
+	profiler::heap_on = true;
+	return true;
+}
+
+inline std::string Profiler::StopHeap() {
+	if (!profiler::heap_on)
+		return {};
+	profiler::heap_on = false;
+	std::map<profiler::Stack, profiler::HeapStack> stacks;
+	{
+		std::lock_guard l{profiler::heap_mutex};
+		stacks.swap(profiler::heap_stacks);
+	}
+	profiler::HeapStack total;
+	for (auto &[stack, entry] : stacks) {
+		total.objects += entry.objects;
+		total.bytes += entry.bytes;
+	}
+	auto path = NextPath("heap");
+	std::ofstream out(path);
+	// Nothing is tracked as in use, only what was allocated.
+	out << "heap profile: 0: 0 [" << total.objects << ": " << total.bytes
+			<< "] @ heap_v2/" << options.heap_sample_bytes << "\n";
+	for (auto &[stack, entry] : stacks) {
+		out << "0: 0 [" << entry.objects << ": " << entry.bytes << "] @"
+				<< std::hex;
+		for (auto pc : stack) {
+			out << " 0x" << reinterpret_cast<std::uintptr_t>(pc);
+		}
+		out << std::dec << "\n";
+	}
+	out << "\nMAPPED_LIBRARIES:\n";
+	profiler::WriteMaps(out);
+	return out ? path : std::string();
+}
+
+inline void Profiler::HandleSignals() {
+	std::signal(SIGUSR1, profiler::OnToggleCpu);
+	std::signal(SIGUSR2, profiler::OnToggleHeap);
+	watcher = std::thread([this] {
+		while (!stop_watching) {
+			if (profiler::toggle_cpu.exchange(false))
+				Toggle("CPU", profiler::cpu_on, &Profiler::StartCpu,
+							 &Profiler::StopCpu);
+			if (profiler::toggle_heap.exchange(false))
+				Toggle("heap", profiler::heap_on, &Profiler::StartHeap,
+							 &Profiler::StopHeap);
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	});
+}
+
+#else
+
+inline bool Profiler::StartCpu() { return false; }
+inline std::string Profiler::StopCpu() { return {}; }
+inline bool Profiler::StartHeap() { return false; }
+inline std::string Profiler::StopHeap() { return {}; }
+inline void Profiler::HandleSignals() {
+	std::cout << "Profiling needs POSIX signals, it's off" << std::endl;
+}
+
+#endif
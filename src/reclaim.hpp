@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+#include <grpcpp/grpcpp.h>
+
+#include "flags.hpp"
+
+/// Counters for long lived streams whose resources were given back. Shared by
+/// every call in the process.
+struct ReclaimStats {
+	/// Streams cancelled by the server for being idle too long.
+	std::atomic<std::uint64_t> idle_reaped{0};
+	/// Streams cancelled by the client or the transport, which includes
+	/// connections found dead by keepalive.
+	std::atomic<std::uint64_t> cancelled{0};
+	/// Estimate of the memory held by the reclaimed streams.
+	std::atomic<std::uint64_t> bytes_freed{0};
+
+	static ReclaimStats &Get() {
+		static ReclaimStats stats;
+		return stats;
+	}
+	friend std::ostream &operator<<(std::ostream &os, ReclaimStats const &s) {
+		return os << "idle reaped: " << s.idle_reaped
+							<< " cancelled: " << s.cancelled
+							<< " bytes freed: " << s.bytes_freed;
+	}
+};
+
+/// How long a stream of each method may go without reading or writing anything
+/// before it's cancelled.
+///
+/// --idle-timeout-ms=N sets the default and --idle-timeout-ms.<Method>=N the
+/// timeout of one method. Zero means never.
+class IdleTimeouts {
+public:
+	explicit IdleTimeouts(std::chrono::milliseconds default_timeout)
+			: default_timeout(default_timeout) {}
+	IdleTimeouts(Flags const &flags, std::chrono::milliseconds default_timeout)
+			: flags(&flags), default_timeout(flags.Get("idle-timeout-ms",
+																								 default_timeout.count())) {}
+
+	void Set(std::string const &method, std::chrono::milliseconds timeout) {
+		timeouts[method] = timeout;
+	}
+	std::chrono::milliseconds Get(std::string const &method) const {
+		if (auto it = timeouts.find(method); it != timeouts.end())
+			return it->second;
+		if (flags) {
+			return std::chrono::milliseconds(
+					flags->Get("idle-timeout-ms." + method, default_timeout.count()));
+		}
+		return default_timeout;
+	}
+
+private:
+	Flags const *flags = nullptr;
+	std::chrono::milliseconds default_timeout;
+	std::map<std::string, std::chrono::milliseconds> timeouts;
+};
+
+/// When a stream last read or wrote something. Safe to use from any thread.
+class IdleWatch {
+public:
+	IdleWatch() { Touch(); }
+	void Touch() { last.store(Now(), std::memory_order_relaxed); }
+	/// @return How long until the stream has been idle for timeout, zero or less
+	/// if it already has
+	std::chrono::nanoseconds Left(std::chrono::nanoseconds timeout) const {
+		return timeout - std::chrono::nanoseconds(
+												 Now() - last.load(std::memory_order_relaxed));
+	}
+
+private:
+	static std::int64_t Now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+							 std::chrono::steady_clock::now().time_since_epoch())
+				.count();
+	}
+	std::atomic<std::int64_t> last{0};
+};
+
+/// Sets up HTTP/2 keepalive so connections to clients that have gone away
+/// without closing them are found and their streams cancelled.
+///
+/// --keepalive-ms=N pings an idle connection every N ms (default 30s) and
+/// --keepalive-timeout-ms=N closes it if the ping isn't answered in time
+/// (default 10s). Clients may ping as often as --min-client-ping-ms=N (default
+/// 10s), even without calls.
+inline void AddKeepaliveArguments(grpc::ServerBuilder &builder,
+																	Flags const &flags) {
+	builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS,
+														 flags.Get("keepalive-ms", 30000));
+	builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+														 flags.Get("keepalive-timeout-ms", 10000));
+	builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+	builder.AddChannelArgument(
+			GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+			flags.Get("min-client-ping-ms", 10000));
+	// Keep pinging while streams are open but quiet.
+	builder.AddChannelArgument(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <google/protobuf/message_lite.h>
+
+#include "flags.hpp"
+#include "mapped_file.hpp"
+
+/// Greeter method a recorded request was sent to.
+enum class RecordedMethod : std::uint32_t {
+	SayHello,
+	SayHellos,
+	SayHellosClient,
+	SayHelloBidir,
+};
+
+inline char const *MethodPath(RecordedMethod method) {
+	switch (method) {
+	case RecordedMethod::SayHello:
+		return "/helloworld.Greeter/SayHello";
+	case RecordedMethod::SayHellos:
+		return "/helloworld.Greeter/SayHellos";
+	case RecordedMethod::SayHellosClient:
+		return "/helloworld.Greeter/SayHellosClient";
+	case RecordedMethod::SayHelloBidir:
+		return "/helloworld.Greeter/SayHelloBidir";
+	}
+	return "";
+}
+
+/// A recording starts with this, followed by the records. Each record is a
+/// RecordHeader and then the serialized request, padded to 8 bytes so the next
+/// header is aligned and a mapped recording can be read in place. Written in
+/// the byte order of the machine, which is little endian everywhere we run.
+struct RecordingHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t reserved;
+};
+struct RecordHeader {
+	/// Nanoseconds since the recording started.
+	std::int64_t time;
+	/// Requests of the same stream share a call, starting at 1.
+	std::uint64_t call;
+	RecordedMethod method;
+	/// Size of the serialized request that follows.
+	std::uint32_t size;
+};
+static_assert(sizeof(RecordingHeader) == 16 && sizeof(RecordHeader) == 24);
+constexpr char kRecordingMagic[8] = {'H', 'E', 'L', 'L', 'O', 'R', 'E', 'C'};
+constexpr std::uint32_t kRecordingVersion = 1;
+
+/// Captures the requests the servers receive, with when they arrived. Shared by
+/// every call in the process and does nothing until opened.
+///
+/// The file is written through a buffer that's flushed on Close and at exit, so
+/// a killed server loses the last few records. The reader stops at a truncated
+/// one.
+class Recorder {
+public:
+	static Recorder &Get() {
+		static Recorder recorder;
+		return recorder;
+	}
+	/// Starts recording to path, replacing anything in it.
+	bool Open(std::string const &path) {
+		std::lock_guard l{mutex};
+		out.open(path, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+		RecordingHeader header{};
+		std::memcpy(header.magic, kRecordingMagic, sizeof(header.magic));
+		header.version = kRecordingVersion;
+		out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+		start = std::chrono::steady_clock::now();
+		enabled = true;
+		return true;
+	}
+	void Close() {
+		std::lock_guard l{mutex};
+		enabled = false;
+		out.close();
+	}
+	bool Enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	/// Records one request of a stream. call is given an id by the first one
+	/// recorded so start it at 0.
+	void Record(RecordedMethod method, std::uint64_t &call,
+							google::protobuf::MessageLite const &request) {
+		if (!Enabled())
+			return;
+		if (call == 0)
+			call = ++calls;
+		thread_local std::string buffer;
+		request.SerializeToString(&buffer);
+		RecordHeader header{0, call, method,
+												static_cast<std::uint32_t>(buffer.size())};
+		static char const padding[8] = {};
+		std::lock_guard l{mutex};
+		if (!out)
+			return;
+		header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+											std::chrono::steady_clock::now() - start)
+											.count();
+		out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+		out.write(buffer.data(), buffer.size());
+		out.write(padding, (8 - buffer.size() % 8) % 8);
+	}
+	/// Records the request of a call that only has one.
+	void Record(RecordedMethod method,
+							google::protobuf::MessageLite const &request) {
+		std::uint64_t call = 0;
+		Record(method, call, request);
+	}
+
+private:
+	std::mutex mutex;
+	std::ofstream out;
+	std::atomic<bool> enabled{false};
+	std::atomic<std::uint64_t> calls{0};
+	std::chrono::steady_clock::time_point start;
+};
+
+/// Starts recording to the file given with --record=<file>, if any, with
+/// suffix added to its name.
+inline void RecordFromFlags(Flags const &flags,
+														std::string const &suffix = "") {
+	if (!flags.Has("record"))
+		return;
+	auto path = flags.Get("record", "") + suffix;
+	if (Recorder::Get().Open(path)) {
+		std::cout << "Recording requests to " << path << std::endl;
+	} else {
+		std::cout << "Can't record to " << path << std::endl;
+	}
+}
+
+/// Reads a recording in place from a mapping of it. The data of each record
+/// points into the mapping and is valid as long as the reader is.
+class RecordingReader {
+public:
+	struct Record {
+		std::int64_t time;
+		std::uint64_t call;
+		RecordedMethod method;
+		std::string_view data;
+	};
+
+	explicit RecordingReader(std::string const &path) : file(path) {
+		auto all = file.View(0, file.Size());
+		ok = file && all.size() >= sizeof(RecordingHeader) &&
+				 std::memcmp(all.data(), kRecordingMagic, sizeof(kRecordingMagic)) ==
+						 0 &&
+				 reinterpret_cast<RecordingHeader const *>(all.data())->version ==
+						 kRecordingVersion;
+		Rewind();
+	}
+	explicit operator bool() const { return ok; }
+
+	void Rewind() { offset = sizeof(RecordingHeader); }
+	/// @return false at the end of the recording or at a truncated record
+	bool Next(Record *record) {
+		if (!ok || file.Size() - offset < sizeof(RecordHeader))
+			return false;
+		auto header = reinterpret_cast<RecordHeader const *>(
+				file.View(offset, sizeof(RecordHeader)).data());
+		if (file.Size() - offset - sizeof(RecordHeader) < header->size)
+			return false;
+		*record = {header->time, header->call, header->method,
+							 file.View(offset + sizeof(RecordHeader), header->size)};
+		// The padding after the last record may have been cut off.
+		auto padded = (header->size + std::size_t(7)) & ~std::size_t(7);
+		offset = std::min(offset + sizeof(RecordHeader) + padded, file.Size());
+		return true;
+	}
+
+private:
+	MappedFile file;
+	bool ok = false;
+	std::size_t offset = 0;
+};
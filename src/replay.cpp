@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/grpcpp.h>
+
+#include "common.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "recording.hpp"
+#include "stats.hpp"
+
+/// Counts shared by every replayed call.
+struct ReplayStats {
+	std::atomic<std::uint64_t> calls{0};
+	std::atomic<std::uint64_t> failed{0};
+	std::atomic<std::uint64_t> sent{0};
+	std::atomic<std::uint64_t> received{0};
+	std::atomic<int> in_flight{0};
+	LatencyRecorder latencies;
+};
+
+/// One replayed call of any shape, made with the generic stub so requests go
+/// out as they are in the recording without being parsed. Each request is a
+/// slice pointing into the mapped recording, so it isn't copied either.
+class ReplayCall : public std::enable_shared_from_this<ReplayCall> {
+public:
+	/// @param messages How many requests the call will send
+	ReplayCall(grpc::GenericStub *stub, grpc::CompletionQueue *cq,
+						 RecordedMethod method, std::size_t messages,
+						 std::chrono::milliseconds timeout, ReplayStats *stats)
+			: stub(stub), cq(cq), method(method), left(messages), stats(stats) {
+		context.set_deadline(std::chrono::system_clock::now() + timeout);
+	}
+	/// Sends the next request of the call, starting it with the first one.
+	void Send(std::string_view data) {
+		grpc::Slice slice(data.data(), data.size(), grpc::Slice::STATIC_SLICE);
+		grpc::ByteBuffer buffer(&slice, 1);
+		std::lock_guard l{mutex};
+		if (!started) {
+			started = true;
+			start = std::chrono::steady_clock::now();
+			++stats->in_flight;
+			++stats->calls;
+			if (method == RecordedMethod::SayHello) {
+				++stats->sent;
+				unary =
+						stub->PrepareUnaryCall(&context, MethodPath(method), buffer, cq);
+				unary->StartCall();
+				unary->Finish(&reply, &status, OnFinish());
+				return;
+			}
+			stream = stub->PrepareCall(&context, MethodPath(method), cq);
+			stream->StartCall(OnCreate());
+		}
+		pending.push_back(std::move(buffer));
+		WriteLocked();
+	}
+	Handler *OnCreate() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			std::lock_guard l{mutex};
+			if (!ok) {
+				stream->Finish(&status, OnFinish());
+				return;
+			}
+			created = true;
+			stream->Read(&reply, OnRead());
+			WriteLocked();
+		});
+	}
+	Handler *OnWrite() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			std::lock_guard l{mutex};
+			writing = false;
+			if (!ok) {
+				// The read fails too and finishes the call.
+				pending.clear();
+				return;
+			}
+			++stats->sent;
+			WriteLocked();
+		});
+	}
+	Handler *OnWritesDone() {
+		return new Handler([me = shared_from_this()](bool ok) {});
+	}
+	Handler *OnRead() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (ok) {
+				++stats->received;
+				stream->Read(&reply, OnRead());
+			} else {
+				stream->Finish(&status, OnFinish());
+			}
+		});
+	}
+	Handler *OnFinish() {
+		return new Handler([this, me = shared_from_this()](bool ok) {
+			if (status.ok()) {
+				if (unary)
+					++stats->received;
+				stats->latencies.Record(std::chrono::steady_clock::now() - start);
+			} else {
+				++stats->failed;
+			}
+			--stats->in_flight;
+		});
+	}
+
+private:
+	/// Streams only have one write in flight, the rest wait here.
+	void WriteLocked() {
+		if (!created || writing)
+			return;
+		if (!pending.empty()) {
+			writing = true;
+			--left;
+			stream->Write(pending.front(), OnWrite());
+			pending.pop_front();
+		} else if (left == 0 && !writes_done) {
+			writes_done = true;
+			stream->WritesDone(OnWritesDone());
+		}
+	}
+
+private:
+	grpc::ClientContext context;
+	grpc::GenericStub *stub;
+	grpc::CompletionQueue *cq;
+	RecordedMethod method;
+	std::size_t left;
+	ReplayStats *stats;
+	std::mutex mutex;
+	bool started = false;
+	bool created = false;
+	bool writing = false;
+	bool writes_done = false;
+	std::deque<grpc::ByteBuffer> pending;
+	std::unique_ptr<grpc::GenericClientAsyncResponseReader> unary;
+	std::unique_ptr<grpc::GenericClientAsyncReaderWriter> stream;
+	grpc::ByteBuffer reply;
+	grpc::Status status;
+	std::chrono::steady_clock::time_point start;
+};
+
+/// Replays a recording made with --record against a server, at the speed it
+/// was recorded or --speed times that. --speed=0 sends everything as fast as
+/// possible.
+///
+/// --shape=unary|server|client|bidi sends every request with that shape instead
+/// of the recorded one. Requests keep their recorded streams, or are grouped
+/// into streams of --messages-per-stream for the client and bidi shapes.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto path = flags.Get("file", flags.Positional(0, "requests.rec").c_str());
+	auto address = flags.Get("address", "localhost:50051");
+	auto speed = flags.Get("speed", 1.0);
+	auto shape = flags.Get("shape", "");
+	auto per_stream = flags.Get<std::size_t>("messages-per-stream", 0);
+	auto timeout = std::chrono::milliseconds(flags.Get("timeout-ms", 10000));
+
+	RecordingReader reader(path);
+	if (!reader) {
+		std::cout << "Can't read recording " << path << std::endl;
+		return 1;
+	}
+	struct Request {
+		RecordingReader::Record record;
+		/// Index of the call the request is sent on.
+		std::size_t call;
+	};
+	struct Call {
+		RecordedMethod method;
+		std::size_t messages = 0;
+		std::shared_ptr<ReplayCall> replay;
+	};
+	std::vector<Request> requests;
+	std::vector<Call> calls;
+	std::unordered_map<std::uint64_t, std::size_t> recorded_calls;
+	RecordingReader::Record record;
+	while (reader.Next(&record)) {
+		auto method = record.method;
+		if (shape == "unary")
+			method = RecordedMethod::SayHello;
+		else if (shape == "server")
+			method = RecordedMethod::SayHellos;
+		else if (shape == "client")
+			method = RecordedMethod::SayHellosClient;
+		else if (shape == "bidi")
+			method = RecordedMethod::SayHelloBidir;
+		auto one_request = method == RecordedMethod::SayHello ||
+											 method == RecordedMethod::SayHellos;
+		std::size_t call;
+		if (one_request || (per_stream && calls.empty()) ||
+				(per_stream && calls.back().messages == per_stream)) {
+			call = calls.size();
+			calls.push_back({method});
+		} else if (per_stream) {
+			call = calls.size() - 1;
+		} else if (auto [it, added] =
+									 recorded_calls.try_emplace(record.call, calls.size());
+							 added) {
+			call = calls.size();
+			calls.push_back({method});
+		} else {
+			call = it->second;
+		}
+		++calls[call].messages;
+		requests.push_back({record, call});
+	}
+	std::cout << "Replaying " << requests.size() << " requests in "
+						<< calls.size() << " calls from " << path << std::endl;
+
+	grpc::GenericStub stub(
+			grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+	grpc::CompletionQueue cq;
+	Poller poller;
+	std::vector<std::thread> threads;
+	for (auto i = 0; i < flags.Get("threads", 2); ++i) {
+		threads.emplace_back([&] { poller.Run(&cq); });
+	}
+
+	ReplayStats stats;
+	std::chrono::nanoseconds max_lag{0};
+	auto start = std::chrono::steady_clock::now();
+	auto first = requests.empty() ? 0 : requests.front().record.time;
+	for (auto &request : requests) {
+		if (speed > 0) {
+			auto due = start + std::chrono::nanoseconds(static_cast<std::int64_t>(
+														 (request.record.time - first) / speed));
+			std::this_thread::sleep_until(due);
+			max_lag = std::max(max_lag, std::chrono::steady_clock::now() - due);
+		}
+		auto &call = calls[request.call];
+		if (!call.replay) {
+			call.replay = std::make_shared<ReplayCall>(
+					&stub, &cq, call.method, call.messages, timeout, &stats);
+		}
+		call.replay->Send(request.record.data);
+		// Nothing refers to a finished call but its own handlers.
+		if (--call.messages == 0)
+			call.replay.reset();
+	}
+	while (stats.in_flight) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	auto elapsed = std::chrono::duration<double>(
+										 std::chrono::steady_clock::now() - start)
+										 .count();
+
+	cq.Shutdown();
+	for (auto &t : threads) {
+		t.join();
+	}
+	std::cout << "calls: " << stats.calls << " failed: " << stats.failed
+						<< " sent: " << stats.sent << " received: " << stats.received
+						<< " in " << elapsed << "s max lag: "
+						<< std::chrono::duration<double, std::milli>(max_lag).count()
+						<< "ms" << std::endl;
+	std::cout << stats.latencies << std::endl;
+	return 0;
+}
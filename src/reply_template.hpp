@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <grpc/slice.h>
+#include <grpcpp/grpcpp.h>
+
+/// Writes HelloReply messages made of a constant prefix and a variable suffix
+/// straight in protobuf's wire format, without building a HelloReply or
+/// concatenating the strings.
+///
+/// The output is the same bytes protobuf writes for the message
+/// `{message: prefix + suffix, id: id}`: fields in number order, each left
+/// out when it's empty or zero. benchmark_serialize checks this against
+/// protobuf.
+class HelloReplyTemplate {
+public:
+	explicit HelloReplyTemplate(std::string prefix) : prefix(std::move(prefix)) {}
+
+	std::string const &Prefix() const { return prefix; }
+
+	/// Bytes of the serialized reply.
+	std::size_t Size(std::string_view suffix, std::uint64_t id) const {
+		auto length = prefix.size() + suffix.size();
+		std::size_t size = 0;
+		if (length)
+			size += 1 + VarintSize(length) + length;
+		if (id)
+			size += 1 + VarintSize(id);
+		return size;
+	}
+	/// Writes the reply to out, which must have room for Size bytes.
+	/// @return Past the last byte written
+	std::uint8_t *Write(std::string_view suffix, std::uint64_t id,
+											std::uint8_t *out) const {
+		auto length = prefix.size() + suffix.size();
+		if (length) {
+			*out++ = kMessageTag;
+			out = WriteVarint(length, out);
+			std::memcpy(out, prefix.data(), prefix.size());
+			out += prefix.size();
+			std::memcpy(out, suffix.data(), suffix.size());
+			out += suffix.size();
+		}
+		if (id) {
+			*out++ = kIdTag;
+			out = WriteVarint(id, out);
+		}
+		return out;
+	}
+	/// The reply in a single slice of exactly its size.
+	grpc::Slice Serialize(std::string_view suffix, std::uint64_t id) const {
+		auto slice = grpc_slice_malloc(Size(suffix, id));
+		Write(suffix, id, GRPC_SLICE_START_PTR(slice));
+		return grpc::Slice(slice, grpc::Slice::STEAL_REF);
+	}
+
+private:
+	/// Field 1 (message), length delimited.
+	static constexpr std::uint8_t kMessageTag = (1 << 3) | 2;
+	/// Field 2 (id), varint.
+	static constexpr std::uint8_t kIdTag = (2 << 3) | 0;
+
+	static std::size_t VarintSize(std::uint64_t value) {
+		std::size_t size = 1;
+		while (value >= 0x80) {
+			value >>= 7;
+			++size;
+		}
+		return size;
+	}
+	static std::uint8_t *WriteVarint(std::uint64_t value, std::uint8_t *out) {
+		while (value >= 0x80) {
+			*out++ = static_cast<std::uint8_t>(value | 0x80);
+			value >>= 7;
+		}
+		*out++ = static_cast<std::uint8_t>(value);
+		return out;
+	}
+
+	std::string const prefix;
+};
+
+/// A HelloReply to be written from a template, for calls whose reply type is
+/// serialized with SerializationTraits. Only refers to the template and the
+/// suffix, which have to outlive it.
+struct TemplatedHelloReply {
+	HelloReplyTemplate const *reply_template;
+	std::string_view suffix;
+	std::uint64_t id = 0;
+};
+
+namespace grpc {
+/// Serializes into one slice with HelloReplyTemplate. Replies can only be
+/// written this way, reading one back needs a HelloReply.
+template <> class SerializationTraits<TemplatedHelloReply, void> {
+public:
+	static Status Serialize(TemplatedHelloReply const &reply, ByteBuffer *buffer,
+													bool *own_buffer) {
+		auto slice = reply.reply_template->Serialize(reply.suffix, reply.id);
+		ByteBuffer serialized(&slice, 1);
+		buffer->Swap(&serialized);
+		*own_buffer = true;
+		return Status::OK;
+	}
+	static Status Deserialize(ByteBuffer *buffer, TemplatedHelloReply *reply) {
+		buffer->Clear();
+		return {StatusCode::UNIMPLEMENTED, "templated replies are write only"};
+	}
+};
+} // namespace grpc
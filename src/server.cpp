@@ -1,6 +1,15 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <csignal>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <windows.h>
 
@@ -8,99 +17,341 @@
 
 #include "helloworld.grpc.pb.h"
 
+#include "async_call.hpp"
+#include "flags.hpp"
+#include "payload.hpp"
+#include "priority.hpp"
+#include "profiler.hpp"
+#include "recording.hpp"
+#include "reply_template.hpp"
+#include "supervisor.hpp"
+#include "work_pool.hpp"
+
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::Status;
 using helloworld::Greeter;
+using helloworld::HelloBatchReply;
+using helloworld::HelloBatchRequest;
 using helloworld::HelloReply;
 using helloworld::HelloRequest;
+using helloworld::PayloadReply;
+using helloworld::PayloadRequest;
+
+/// What every greeting starts with.
+constexpr char const *kGreeting = "hello ";
+
+void Greet(HelloRequest const &request, HelloReply *reply) {
+	reply->set_message(kGreeting + request.name());
+	reply->set_id(request.id());
+}
 
-class CallBase {
-	enum CallStatus { CREATE, PROCESS, FINISH };
-	CallStatus status = CREATE;
+/// SayHello is served raw, so its replies can be written from a template
+/// instead of building a HelloReply for protobuf to serialize.
+using GreeterService = Greeter::WithRawMethod_SayHello<Greeter::AsyncService>;
 
+/// SayHello, served by AsyncCall. Replies are written from reply_template, or
+/// by protobuf without one.
+class SayHello {
 public:
-	virtual ~CallBase() {}
-	void Proceed() {
-		if (status == CREATE) {
-			status = PROCESS;
-			Create();
-		} else if (status == PROCESS) {
-			status = FINISH;
-			Process();
-		} else {
-			delete this;
+	explicit SayHello(HelloReplyTemplate const *reply_template)
+			: reply_template(reply_template) {}
+	Status OnRequest(ServerContext &context, grpc::ByteBuffer const &raw,
+									 grpc::ByteBuffer &reply) {
+		// Copying only takes a reference on the slices.
+		grpc::ByteBuffer buffer(raw);
+		HelloRequest request;
+		auto status =
+				grpc::SerializationTraits<HelloRequest>::Deserialize(&buffer, &request);
+		if (!status.ok())
+			return status;
+		Recorder::Get().Record(RecordedMethod::SayHello, request);
+		bool own_buffer;
+		if (reply_template) {
+			return grpc::SerializationTraits<TemplatedHelloReply>::Serialize(
+					{reply_template, request.name(), request.id()}, &reply,
+					&own_buffer);
 		}
+		HelloReply message;
+		Greet(request, &message);
+		return grpc::SerializationTraits<HelloReply>::Serialize(message, &reply,
+																													 &own_buffer);
 	}
 
 private:
-	virtual void Create() = 0;
-	virtual void Process() = 0;
+	HelloReplyTemplate const *reply_template;
 };
 
-class CallData : public CallBase {
-	helloworld::Greeter::AsyncService *service;
-	grpc::ServerCompletionQueue *cq;
-	ServerContext context;
-	HelloRequest request;
-	grpc::ServerAsyncResponseWriter<HelloReply> responder;
-	HelloReply reply;
+/// How SayHelloBatch splits large batches.
+struct BatchOptions {
+	/// Threads helping the poller that got the batch, none to greet every batch
+	/// on the poller.
+	int threads = 0;
+	/// Greetings per part a batch is split into.
+	std::size_t grain = 4096;
+};
 
+/// SayHelloBatch, splitting batches of more than grain greetings between the
+/// poller and the threads of pool.
+class SayHelloBatch {
 public:
-	CallData(helloworld::Greeter::AsyncService *service,
-					 grpc::ServerCompletionQueue *cq)
-			: service(service), cq(cq), responder(&context) {
-		Proceed();
+	/// Large batches take long enough to hold up single greetings.
+	static constexpr Priority kPriority = Priority::Low;
+
+	SayHelloBatch(WorkPool *pool, std::size_t grain) : pool(pool), grain(grain) {}
+	Status OnRequest(ServerContext &context, HelloBatchRequest const &request,
+									 HelloBatchReply &reply) {
+		auto n = static_cast<std::size_t>(request.requests_size());
+		// Added up front so every part fills in its own replies.
+		reply.mutable_replies()->Reserve(static_cast<int>(n));
+		for (std::size_t i = 0; i < n; ++i) {
+			reply.add_replies();
+		}
+		pool->ParallelFor(n, grain, [&](std::size_t begin, std::size_t end) {
+			for (auto i = begin; i < end; ++i) {
+				Greet(request.requests(static_cast<int>(i)),
+							reply.mutable_replies(static_cast<int>(i)));
+			}
+		});
+		return Status::OK;
 	}
 
 private:
-	void Create() override {
-		service->RequestSayHello(&context, &request, &responder, cq, cq, this);
+	WorkPool *pool;
+	std::size_t grain;
+};
+
+/// SayHelloBidir, greeting every request as it arrives. Low priority like every
+/// stream, so a flood of them doesn't hold up SayHello.
+class SayHelloBidir {
+public:
+	Status OnRead(HelloRequest const &request, Replies<HelloReply> &replies) {
+		Recorder::Get().Record(RecordedMethod::SayHelloBidir, request);
+		Greet(request, &replies.emplace_back());
+		return Status::OK;
 	}
-	void Process() override {
-		new CallData(service, cq);
-		std::string prefix("hello ");
-		reply.set_message(prefix + request.name());
-		responder.Finish(reply, Status::OK, this);
+	Status OnReadsDone(Replies<HelloReply> &replies) { return Status::OK; }
+};
+
+/// Checks the reply a payload request asks for fits in max_size bytes, so a
+/// client can't ask for more than the server accepts.
+Status CheckReplySize(PayloadRequest const &request, std::size_t max_size) {
+	auto size = request.reply_size();
+	auto chunk_size = request.reply_chunk_size();
+	auto chunks = chunk_size == 0
+										? 0
+										: size / chunk_size + (size % chunk_size != 0 ? 1 : 0);
+	// Every chunk takes at least a tag and a length byte as well.
+	if (size > max_size || chunks > (max_size - size) / 2) {
+		return {grpc::StatusCode::INVALID_ARGUMENT,
+						"reply larger than the max message size"};
 	}
+	return Status::OK;
+}
+
+/// Replies with a payload of the size asked for.
+class Payload {
+public:
+	explicit Payload(std::size_t max_size) : max_size(max_size) {}
+	Status OnRequest(ServerContext &context, PayloadRequest const &request,
+									 PayloadReply &reply) {
+		if (auto status = CheckReplySize(request, max_size); !status.ok())
+			return status;
+		Fill(&reply, request.reply_size(), request.reply_chunk_size());
+		return Status::OK;
+	}
+
+private:
+	std::size_t max_size;
 };
 
+/// Replies with reply_count payloads of the size asked for.
+class Payloads {
+public:
+	explicit Payloads(std::size_t max_size) : max_size(max_size) {}
+	Status OnRequest(ServerContext &context, PayloadRequest const &request) {
+		if (auto status = CheckReplySize(request, max_size); !status.ok())
+			return status;
+		count = request.reply_count();
+		size = request.reply_size();
+		chunk_size = request.reply_chunk_size();
+		return Status::OK;
+	}
+	bool Next(PayloadReply &reply) {
+		if (sent == count)
+			return false;
+		// The same reply every time, so it's only filled in once.
+		if (sent++ == 0)
+			Fill(&reply, size, chunk_size);
+		return true;
+	}
+
+private:
+	std::size_t max_size;
+	std::uint32_t count = 0;
+	std::uint32_t sent = 0;
+	std::size_t size = 0;
+	std::size_t chunk_size = 0;
+};
+
+/// Reads every payload and replies with an empty one.
+class PayloadsClient {
+public:
+	Status OnRead(PayloadRequest const &request) { return Status::OK; }
+	Status OnReadsDone(PayloadReply &reply) { return Status::OK; }
+};
+
+/// Replies to every request with a payload of the size it asks for.
+class PayloadBidir {
+public:
+	explicit PayloadBidir(std::size_t max_size) : max_size(max_size) {}
+	Status OnRead(PayloadRequest const &request, Replies<PayloadReply> &replies) {
+		if (auto status = CheckReplySize(request, max_size); !status.ok())
+			return status;
+		Fill(&replies.emplace_back(), request.reply_size(),
+				 request.reply_chunk_size());
+		return Status::OK;
+	}
+	Status OnReadsDone(Replies<PayloadReply> &replies) { return Status::OK; }
+
+private:
+	std::size_t max_size;
+};
+
+namespace {
+std::atomic<bool> shutdown_requested{false};
+extern "C" void RequestShutdown(int) { shutdown_requested = true; }
+} // namespace
+
 class ServerImpl {
 	std::string server_address;
-	helloworld::Greeter::AsyncService service;
+	GreeterService service;
 	std::unique_ptr<Server> server;
-	std::unique_ptr<grpc::ServerCompletionQueue> cq;
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	int max_message_size;
+	BatchOptions batch_options;
+	WorkPool batch_pool;
+	PriorityDispatcher dispatcher;
+	HelloReplyTemplate greeting{kGreeting};
+	bool template_replies;
 
 public:
-	ServerImpl(std::string server_address) : server_address(server_address) {}
-	void Run() {
+	/// @param max_message_size Largest request accepted, in bytes
+	/// @param template_replies Write SayHello replies from a template
+	ServerImpl(std::string server_address, int max_message_size,
+						 BatchOptions batch_options = {},
+						 PriorityOptions priority_options = {},
+						 bool template_replies = true)
+			: server_address(server_address), max_message_size(max_message_size),
+				batch_options(batch_options), batch_pool(batch_options.threads),
+				dispatcher(priority_options), template_replies(template_replies) {}
+	/// Serves until SIGINT or SIGTERM.
+	///
+	/// @param num_cqs Completion queues, each with its own threads
+	/// @param threads_per_cq Threads polling each completion queue
+	/// @param accepts_per_cq Calls waiting to be matched on each completion
+	/// queue, so a burst of new calls doesn't wait for one to be reposted
+	/// @param reuse_port Share the port with other processes (see Supervisor)
+	/// @param ready Called once the server is taking calls
+	void Run(int num_cqs, int threads_per_cq, int accepts_per_cq,
+					 bool reuse_port = false, std::function<void()> ready = {}) {
 		ServerBuilder builder;
 		builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
 		builder.RegisterService(&service);
-		cq = builder.AddCompletionQueue();
+		builder.SetMaxReceiveMessageSize(max_message_size);
+		builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, reuse_port ? 1 : 0);
+		for (auto i = 0; i < num_cqs; ++i) {
+			cqs.emplace_back(builder.AddCompletionQueue());
+		}
 		server = builder.BuildAndStart();
-		std::cout << "Server listening on " << server_address << std::endl;
-		HandleRpcs();
-	}
+		std::cout << "Server listening on " << server_address << " with "
+							<< num_cqs << " completion queues x " << threads_per_cq
+							<< " threads" << std::endl;
 
-private:
-	void HandleRpcs() {
-		new CallData(&service, cq.get());
-		void *tag;
-		bool ok;
-		while (true) {
-			cq->Next(&tag, &ok);
-			if (!ok)
-				break;
-			static_cast<CallData *>(tag)->Proceed();
+		for (auto &cq : cqs) {
+			for (auto i = 0; i < accepts_per_cq; ++i) {
+				Listen<&GreeterService::RequestSayHello, SayHello>(
+						&service, cq.get(), template_replies ? &greeting : nullptr);
+			}
+			Listen<&Greeter::AsyncService::RequestSayHelloBatch, SayHelloBatch>(
+					&service, cq.get(), &batch_pool, batch_options.grain);
+			Listen<&Greeter::AsyncService::RequestSayHelloBidir, SayHelloBidir>(
+					&service, cq.get());
+			// Replies are capped at the size of the largest request.
+			auto max_reply = static_cast<std::size_t>(max_message_size);
+			Listen<&Greeter::AsyncService::RequestPayload, Payload>(
+					&service, cq.get(), max_reply);
+			Listen<&Greeter::AsyncService::RequestPayloads, Payloads>(
+					&service, cq.get(), max_reply);
+			Listen<&Greeter::AsyncService::RequestPayloadsClient, PayloadsClient>(
+					&service, cq.get());
+			Listen<&Greeter::AsyncService::RequestPayloadBidir, PayloadBidir>(
+					&service, cq.get(), max_reply);
+		}
+		std::vector<std::thread> threads;
+		for (auto &cq : cqs) {
+			for (auto i = 0; i < threads_per_cq; ++i) {
+				threads.emplace_back([this, cq = cq.get()] { dispatcher.Run(cq); });
+			}
+		}
+		if (ready)
+			ready();
+
+		std::signal(SIGINT, RequestShutdown);
+		std::signal(SIGTERM, RequestShutdown);
+		while (!shutdown_requested) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		// Calls in progress are finished and pending accepts complete with !ok.
+		server->Shutdown();
+		// Only after the server, which may still be using them.
+		for (auto &cq : cqs) {
+			cq->Shutdown();
+		}
+		// The threads drain the queues, deleting the remaining calls.
+		for (auto &t : threads) {
+			t.join();
 		}
+		std::cout << "Server shutdown on " << server_address << std::endl;
+		std::cout << "Wasted work avoided: " << WastedWork::Get() << std::endl;
+		if (dispatcher.Options().enabled)
+			dispatcher.Report(std::cout);
 	}
 };
 
-int main() {
-	std::string server_address("0.0.0.0:50051");
-	ServerImpl server(server_address);
-	server.Run();
-	return 0;
-}
\ No newline at end of file
+/// --workers=N serves from N processes sharing the port, each with its share
+/// of the cores, restarted one at a time on SIGHUP.
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	auto workers = flags.Get("workers", 0);
+	auto cores = static_cast<int>(std::thread::hardware_concurrency());
+	if (workers > 0)
+		cores = std::max(cores / workers, 1);
+	auto serve = [&](int worker, std::function<void()> ready) {
+		// Workers record to a file each.
+		RecordFromFlags(flags, workers > 0 ? "." + std::to_string(worker) : "");
+		// SIGUSR1 and SIGUSR2 toggle the CPU and heap profiles, in each worker.
+		Profiler profiler(ProfilerOptionsFromFlags(flags));
+		profiler.HandleSignals();
+		BatchOptions batch_options;
+		batch_options.threads = flags.Get("batch-threads", std::max(cores - 1, 0));
+		batch_options.grain =
+				flags.Get<std::size_t>("batch-grain", batch_options.grain);
+		ServerImpl server(flags.Get("address", "0.0.0.0:50051"),
+											flags.Get("max-message-mb", 4) << 20, batch_options,
+											PriorityOptionsFromFlags(flags),
+											flags.Get("template-replies", true));
+		server.Run(flags.Get("cqs", std::max(cores, 1)),
+							 flags.Get("threads-per-cq", 1),
+							 flags.Get("accepts-per-cq", 16), workers > 0, ready);
+		return 0;
+	};
+	if (workers <= 0)
+		return serve(0, {});
+	SupervisorOptions options;
+	options.workers = workers;
+	options.drain_timeout =
+			std::chrono::milliseconds(flags.Get("drain-ms", 10000));
+	return Supervisor(options, serve).Run();
+}
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "broadcast.hpp"
+#include "common.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+
+using grpc::Server;
+using grpc::ServerBuilder;
+using helloworld::HelloReply;
+
+/// Every line typed in is sent to all the SayHellos streams.
+class ServerImpl {
+	std::string server_address;
+	BroadcastService service;
+	std::unique_ptr<Server> server;
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	Poller poller;
+
+public:
+	ServerImpl(std::string server_address, PollerOptions poller_options = {})
+			: server_address(server_address), poller(poller_options) {}
+	void Run(int num_threads, std::size_t queue_size,
+					 SlowSubscriberPolicy policy) {
+		ServerBuilder builder;
+		builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+		builder.RegisterService(&service);
+		for (auto i = 0; i < num_threads; ++i) {
+			cqs.emplace_back(builder.AddCompletionQueue());
+		}
+		server = builder.BuildAndStart();
+		std::cout << "Server listening on " << server_address << std::endl;
+
+		BroadcastHub hub(cqs.size(), queue_size, policy);
+		std::vector<std::thread> threads;
+		for (std::size_t i = 0; i < cqs.size(); ++i) {
+			threads.emplace_back([this, &hub, i] { HandleRpcs(&hub, i); });
+		}
+
+		std::string line;
+		while (std::getline(std::cin, line) && line != "quit") {
+			HelloReply reply;
+			reply.set_message(line);
+			hub.Publish(reply);
+			std::cout << hub.Stats() << std::endl;
+		}
+		server->Shutdown();
+		for (auto &&cq : cqs) {
+			cq->Shutdown();
+		}
+		for (auto &&t : threads) {
+			t.join();
+		}
+		std::cout << "Server shutdown on " << server_address << std::endl;
+		if (poller.Instrumented())
+			poller.Report(std::cout);
+		std::cout << hub.Stats() << std::endl;
+	}
+
+private:
+	void HandleRpcs(BroadcastHub *hub, std::size_t i) {
+		auto cq = cqs[i].get();
+		std::make_shared<SayHellosSubscriber>(&service, cq, hub, i)->Start();
+		poller.Run(cq);
+	}
+};
+
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	ServerImpl server(flags.Get("address", "0.0.0.0:50051"),
+										PollerOptionsFromFlags(flags));
+	server.Run(flags.Get("threads", 4), flags.Get<std::size_t>("queue-size", 64),
+						 flags.Get("policy", "drop") == "disconnect"
+								 ? SlowSubscriberPolicy::Disconnect
+								 : SlowSubscriberPolicy::Drop);
+	return 0;
+}
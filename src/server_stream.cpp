@@ -1,3 +1,5 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -11,6 +13,10 @@
 #include "helloworld.grpc.pb.h"
 
 #include "common.hpp"
+#include "deadline.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "recording.hpp"
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -23,63 +29,94 @@ using helloworld::HelloRequest;
 class SayHellosServerStreamServer
 		: public std::enable_shared_from_this<SayHellosServerStreamServer> {
 public:
+	/// @param interval Time between messages, set with a timer on the polling
+	/// thread
 	SayHellosServerStreamServer(helloworld::Greeter::AsyncService *service,
-															grpc::ServerCompletionQueue *cq)
-			: service(service), cq(cq), stream(&context) {}
+															grpc::ServerCompletionQueue *cq,
+															std::chrono::milliseconds interval)
+			: service(service), cq(cq), interval(interval), stream(&context) {}
 	void Start() {
 		context.AsyncNotifyWhenDone(OnDone());
 		service->RequestSayHellos(&context, &request, &stream, cq, cq, OnCreate());
 	}
 	Handler *OnCreate() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"SayHellos.OnCreate"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
 			if (ok) {
-				std::make_shared<SayHellosServerStreamServer>(service, cq)->Start();
+				std::make_shared<SayHellosServerStreamServer>(service, cq, interval)
+						->Start();
+				Recorder::Get().Record(RecordedMethod::SayHellos, request);
+				if (Expired(context)) {
+					++WastedWork::Get().expired;
+					stream.Finish(
+							Status(grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"),
+							OnFinish());
+					return;
+				}
 				stream.SendInitialMetadata(OnSendInitialMetadata());
 			}
 		});
 	}
 	Handler *OnSendInitialMetadata() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"SayHellos.OnSendInitialMetadata"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
 			if (ok) {
-				HelloReply reply;
-				reply.set_message(request.name());
-				stream.Write(reply, OnWriteMessage());
+				Write();
 			}
 		});
 	}
 	Handler *OnWriteMessage() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"SayHellos.OnWriteMessage"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
 			if (ok) {
-				if (--num_messages) {
-					HelloReply reply;
-					reply.set_message(request.name());
-					stream.Write(reply, OnWriteMessage());
-				} else {
+				if (--num_messages == 0) {
 					stream.Finish(grpc::Status::OK, OnFinish());
+				} else if (interval.count()) {
+					Poller::After(interval, [this, me = shared_from_this()] { Write(); });
+				} else {
+					Write();
 				}
 			}
 		});
 	}
 	Handler *OnFinish() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"SayHellos.OnFinish"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
 			if (ok) {
 				std::cout << "SayHellosServerStreamServer finished " << std::endl;
 			}
 		});
 	}
 	Handler *OnDone() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"SayHellos.OnDone"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
+			done = true;
 			std::cout << "SayHellosServerStreamServer done" << std::endl;
 		});
 	}
 
+private:
+	void Write() {
+		// The client is gone so the remaining messages would only be thrown away.
+		if (done) {
+			WastedWork::Get().writes_skipped += num_messages;
+			return;
+		}
+		HelloReply reply;
+		reply.set_message(request.name());
+		stream.Write(reply, OnWriteMessage());
+	}
+
 private:
 	Greeter::AsyncService *service;
 	grpc::ServerCompletionQueue *cq;
+	std::chrono::milliseconds interval;
 	grpc::ServerContext context;
 	grpc::ServerAsyncWriter<HelloReply> stream;
 	HelloRequest request;
 	int num_messages = 4;
+	/// Set once the call is done (finished, cancelled or past its deadline).
+	std::atomic<bool> done{false};
 };
 
 class ServerImpl {
@@ -87,10 +124,14 @@ class ServerImpl {
 	helloworld::Greeter::AsyncService service;
 	std::unique_ptr<Server> server;
 	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	Poller poller;
 
 public:
-	ServerImpl(std::string server_address) : server_address(server_address) {}
-	void Run(int num_threads = 1) {
+	ServerImpl(std::string server_address, PollerOptions poller_options = {})
+			: server_address(server_address), poller(poller_options) {}
+	/// @param interval Time between the messages of a stream
+	void Run(int num_threads = 1,
+					 std::chrono::milliseconds interval = std::chrono::milliseconds(0)) {
 		ServerBuilder builder;
 		builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
 		builder.RegisterService(&service);
@@ -102,7 +143,8 @@ public:
 
 		std::vector<std::thread> threads;
 		for (auto &&cq : cqs) {
-			threads.emplace_back([this, cq = cq.get()] { HandleRpcs(cq); });
+			threads.emplace_back(
+					[this, cq = cq.get(), interval] { HandleRpcs(cq, interval); });
 		}
 
 		std::string j;
@@ -115,23 +157,27 @@ public:
 			t.join();
 		}
 		std::cout << "Server shutdown on " << server_address << std::endl;
+		if (poller.Instrumented())
+			poller.Report(std::cout);
+		std::cout << "Wasted work avoided: " << WastedWork::Get() << std::endl;
 		std::cin >> j;
 	}
 
 private:
-	void HandleRpcs(grpc::ServerCompletionQueue *cq) {
-		std::make_shared<SayHellosServerStreamServer>(&service, cq)->Start();
-		void *tag;
-		bool ok;
-		while (cq->Next(&tag, &ok)) {
-			static_cast<Handler *>(tag)->Proceed(ok);
-		}
+	void HandleRpcs(grpc::ServerCompletionQueue *cq,
+									std::chrono::milliseconds interval) {
+		std::make_shared<SayHellosServerStreamServer>(&service, cq, interval)
+				->Start();
+		poller.Run(cq);
 	}
 };
 
-int main() {
-	std::string server_address("0.0.0.0:50051");
-	ServerImpl server(server_address);
-	server.Run();
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	RecordFromFlags(flags);
+	ServerImpl server(flags.Get("address", "0.0.0.0:50051"),
+										PollerOptionsFromFlags(flags));
+	server.Run(flags.Get("threads", 1),
+						 std::chrono::milliseconds(flags.Get("interval-ms", 0)));
 	return 0;
 }
\ No newline at end of file
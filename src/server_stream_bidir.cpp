@@ -1,19 +1,37 @@
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <type_traits>
+#include <vector>
 
 #include <grpcpp/grpcpp.h>
 
 #include "helloworld.grpc.pb.h"
 
 #include "common.hpp"
+#include "deadline.hpp"
+#include "flags.hpp"
+#include "mux_server.hpp"
+#include "poller.hpp"
+#include "profiler.hpp"
+#include "recording.hpp"
+#include "reclaim.hpp"
+#include "session_registry.hpp"
+#include "trace.hpp"
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -36,10 +54,17 @@ public:
 	/// @param call_cq Completes everything after call (read, write, finish, done,
 	/// etc...)
 	/// @param notification_cq Completes when a call is initiated
+	/// @param sessions Where the call is registered once it has started
+	/// @param shard Shard of sessions to use, the index of the completion queue
+	/// @param idle_timeout Cancel the call when nothing has been read or written
+	/// for this long, zero for never
 	SayHelloBidirServer(helloworld::Greeter::AsyncService *service,
 											grpc::CompletionQueue *call_cq,
-											grpc::ServerCompletionQueue *notification_cq)
+											grpc::ServerCompletionQueue *notification_cq,
+											SessionRegistry<SayHelloBidirServer> *sessions,
+											std::size_t shard, std::chrono::milliseconds idle_timeout)
 			: service(service), call_cq(call_cq), notification_cq(notification_cq),
+				sessions(sessions), shard(shard), idle_timeout(idle_timeout),
 				stream(&context) {}
 	/// Two stage initialization because shared_from_this is used.
 	void Start() {
@@ -53,17 +78,24 @@ public:
 																	OnCreate());
 	}
 
-private:
+	/// Queue a reply to the client. Safe to call from any thread, including
+	/// while the call is finishing, in which case the reply is dropped.
 	void Write(HelloReply reply) {
 		// If we're using more than one thread on the completion queue then we'd
 		// have a data race on the writes.
 		std::lock_guard l{write_mutex};
+		// Nobody will read it.
+		if (done) {
+			++WastedWork::Get().writes_skipped;
+			return;
+		}
+		idle.Touch();
 		// Only add the the pending writes as an ongoing write will get to it
 		// eventually.
-		writes.emplace_back(std::move(reply));
+		writes.push_back({std::move(reply), trace_id ? Tracer::Now() : 0});
 		// If there weren't any pending writes then we'll have to start the write.
 		if (writes.size() == 1) {
-			stream.Write(writes.front(), OnWrite());
+			StartWrite();
 		}
 	}
 
@@ -76,12 +108,22 @@ private: // Handlers
 	// must still be kept alive.
 
 	Handler *OnCreate() {
-		return new Handler([this, me = shared_from_this()](bool ok) noexcept {
+		auto tag = Trace("SayHelloBidir.OnCreate");
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) noexcept {
 			if (ok) {
 				std::cout << std::this_thread::get_id() << " created" << std::endl;
 				// Create another waiter for this rpc
-				std::make_shared<SayHelloBidirServer>(service, call_cq, notification_cq)
+				std::make_shared<SayHelloBidirServer>(service, call_cq, notification_cq,
+																							sessions, shard, idle_timeout)
 						->Start();
+				// The client would give up before anything got back to it.
+				if (Expired(context)) {
+					++WastedWork::Get().expired;
+					status = Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+													"deadline exceeded");
+					stream.Finish(status, OnFinish());
+					return;
+				}
 				stream.SendInitialMetadata(OnSendInitialMetadata());
 			} else {
 				std::cout << std::this_thread::get_id() << " created error"
@@ -90,10 +132,21 @@ private: // Handlers
 		});
 	}
 	Handler *OnSendInitialMetadata() {
-		return new Handler([this, me = shared_from_this()](bool ok) noexcept {
+		auto tag = Trace("SayHelloBidir.OnSendInitialMetadata");
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) noexcept {
 			if (ok) {
-				std::cout << std::this_thread::get_id() << " sent metadata "
-									<< std::endl;
+				// Only registered now so nobody else can write before the metadata has
+				// gone out.
+				auto id = sessions->Add(shard, weak_from_this());
+				session_id = id;
+				// OnDone could have run already and missed the id.
+				if (done)
+					sessions->Remove(id);
+				std::cout << std::this_thread::get_id() << " sent metadata, session "
+									<< id << std::endl;
+				idle.Touch();
+				if (idle_timeout.count())
+					WatchIdle(idle_timeout);
 				// Begin read
 				stream.Read(&request, OnRead());
 			} else {
@@ -103,12 +156,20 @@ private: // Handlers
 		});
 	}
 	Handler *OnRead() {
-		return new Handler([this, me = shared_from_this()](bool ok) noexcept {
-			if (ok) {
+		auto tag = Trace("SayHelloBidir.OnRead");
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) noexcept {
+			if (ok && done) {
+				// Cancelled while the read was in flight. Stop reading and don't
+				// bother replying.
+				++WastedWork::Get().reads_skipped;
+			} else if (ok) {
+				Recorder::Get().Record(RecordedMethod::SayHelloBidir, call, request);
 				std::cout << std::this_thread::get_id() << " read: " << request.name()
 									<< std::endl;
+				idle.Touch();
 				HelloReply reply;
 				reply.set_message("You sent: " + request.name());
+				reply.set_id(request.id());
 				// Continue to read until failure
 				stream.Read(&request, OnRead());
 				Write(std::move(reply));
@@ -118,16 +179,22 @@ private: // Handlers
 		});
 	}
 	Handler *OnWrite() {
-		return new Handler([this, me = shared_from_this()](bool ok) noexcept {
+		auto tag = Trace("SayHelloBidir.OnWrite");
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) noexcept {
 			if (ok) {
 				std::lock_guard l{write_mutex};
 				std::cout << std::this_thread::get_id()
-									<< " wrote: " << writes.front().message() << std::endl;
+									<< " wrote: " << writes.front().reply.message() << std::endl;
 				writes.pop_front();
+				// Drop whatever is left if the client has gone.
+				if (done) {
+					WastedWork::Get().writes_skipped += writes.size();
+					writes.clear();
+				}
 				// There can only be one write at a time and so writes get queued.
 				// Thus continue to write until the queue is empty.
 				if (!writes.empty()) {
-					stream.Write(writes.front(), OnWrite());
+					StartWrite();
 				}
 			} else {
 				std::cout << std::this_thread::get_id() << " write done" << std::endl;
@@ -135,7 +202,8 @@ private: // Handlers
 		});
 	}
 	Handler *OnFinish() {
-		return new Handler([this, me = shared_from_this()](bool ok) noexcept {
+		auto tag = Trace("SayHelloBidir.OnFinish");
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) noexcept {
 			if (ok) {
 				std::cout << std::this_thread::get_id()
 									<< " finished: " << status.error_code() << " "
@@ -147,22 +215,102 @@ private: // Handlers
 		});
 	}
 	Handler *OnDone() {
-		return new Handler([this, me = shared_from_this()](bool ok) noexcept {
+		auto tag = Trace("SayHelloBidir.OnDone");
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) noexcept {
+			done = true;
+			// Nothing can find the call after this.
+			if (auto id = session_id.load(); id != kNoSession)
+				sessions->Remove(id);
+			auto &reclaim = ReclaimStats::Get();
+			if (reaped || context.IsCancelled()) {
+				if (!reaped)
+					++reclaim.cancelled;
+				reclaim.bytes_freed += Footprint();
+			}
 			std::cout << std::this_thread::get_id() << " done "
 								<< (context.IsCancelled() ? "cancelled" : "") << std::endl;
 		});
 	}
 
 private:
+	TraceTag Trace(char const *name) const { return {name, trace_id}; }
+
+	/// Checks for idleness after delay on this thread. The timer doesn't keep
+	/// the call alive.
+	void WatchIdle(std::chrono::nanoseconds delay) {
+		Poller::After(delay, [weak = weak_from_this()] {
+			if (auto me = weak.lock())
+				me->CheckIdle();
+		});
+	}
+	void CheckIdle() {
+		if (done)
+			return;
+		// Reads and writes since the timer was set push the deadline back.
+		if (auto left = idle.Left(idle_timeout); left.count() > 0) {
+			WatchIdle(left);
+			return;
+		}
+		std::cout << std::this_thread::get_id() << " idle for "
+							<< idle_timeout.count() << "ms, cancelling" << std::endl;
+		reaped = true;
+		++ReclaimStats::Get().idle_reaped;
+		context.TryCancel();
+	}
+	/// Rough size of the call and what it holds on to.
+	std::size_t Footprint() {
+		std::lock_guard l{write_mutex};
+		std::size_t bytes = sizeof(*this) + request.SpaceUsedLong();
+		for (auto &w : writes) {
+			bytes += sizeof(w) + w.reply.SpaceUsedLong();
+		}
+		return bytes;
+	}
+	/// Writes the front of the queue. Must hold write_mutex.
+	void StartWrite() {
+		auto &front = writes.front();
+		if (trace_id) {
+			// Queued writes overlap so each gets its own row.
+			Tracer::Get().RecordAsync("write queue", trace_id,
+																trace_id << 24 | (writes_started++ & 0xffffff),
+																front.queued, Tracer::Now());
+		}
+		stream.Write(front.reply, OnWrite());
+	}
+
+	struct PendingWrite {
+		HelloReply reply;
+		/// When it was queued, only set if the call is traced.
+		std::int64_t queued;
+	};
+
+	static constexpr auto kNoSession =
+			std::numeric_limits<SessionRegistry<SayHelloBidirServer>::Id>::max();
+
 	helloworld::Greeter::AsyncService *service;
 	grpc::CompletionQueue *call_cq;
 	grpc::ServerCompletionQueue *notification_cq;
+	SessionRegistry<SayHelloBidirServer> *sessions;
+	std::size_t shard;
+	std::chrono::milliseconds idle_timeout;
+	IdleWatch idle;
+	/// Set when the call was cancelled for being idle.
+	std::atomic<bool> reaped{false};
+	std::atomic<SessionRegistry<SayHelloBidirServer>::Id> session_id{kNoSession};
 	grpc::ServerAsyncReaderWriter<HelloReply, HelloRequest> stream;
 	grpc::ServerContext context;
 	grpc::Status status;
 	HelloRequest request;
-	std::list<HelloReply> writes;
+	/// Id of the call in the recording, if requests are recorded.
+	std::uint64_t call = 0;
+	std::list<PendingWrite> writes;
 	std::mutex write_mutex;
+	/// Set once the call is done (finished, cancelled or past its deadline).
+	/// Reads and writes aren't started after this.
+	std::atomic<bool> done{false};
+	/// Non zero if this call's handlers are traced.
+	TraceId trace_id = Tracer::Get().Sample();
+	std::uint64_t writes_started = 0;
 };
 
 class ServerImpl {
@@ -170,13 +318,26 @@ class ServerImpl {
 	helloworld::Greeter::AsyncService service;
 	std::unique_ptr<Server> server;
 	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	SessionRegistry<SayHelloBidirServer> sessions{4};
+	Poller poller;
+	Flags const &flags;
 
 public:
-	ServerImpl(std::string server_address) : server_address(server_address) {}
+	ServerImpl(Flags const &flags)
+			: server_address(flags.Get("address", "0.0.0.0:50051")),
+				poller(PollerOptionsFromFlags(flags)), flags(flags) {}
 	void Run() {
 		ServerBuilder builder;
 		builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
 		builder.RegisterService(&service);
+		AddKeepaliveArguments(builder, flags);
+		auto idle_timeout =
+				IdleTimeouts(flags, std::chrono::minutes(5)).Get("SayHelloBidir");
+		MuxOptions mux_options;
+		mux_options.window = flags.Get("mux-window", mux_options.window);
+		mux_options.quantum = flags.Get("mux-quantum", mux_options.quantum);
+		mux_options.max_channels =
+				flags.Get("mux-max-channels", mux_options.max_channels);
 		for (auto i = 0; i < 4; ++i) {
 			cqs.emplace_back(builder.AddCompletionQueue());
 		}
@@ -185,26 +346,53 @@ public:
 
 		// Only using one completion queue for both notification and calls.
 		// Unless it's really necessary you probably want this.
-		auto f = [](helloworld::Greeter::AsyncService *service,
-								grpc::ServerCompletionQueue *cq) {
-			return [service, cq] {
-				std::make_shared<SayHelloBidirServer>(service, cq, cq)->Start();
-				void *tag;
-				bool ok;
-				while (cq->Next(&tag, &ok)) {
-					static_cast<Handler *>(tag)->Proceed(ok);
-				}
+		auto f = [this, idle_timeout,
+							mux_options](helloworld::Greeter::AsyncService *service,
+													 grpc::ServerCompletionQueue *cq, std::size_t shard) {
+			return [this, service, cq, shard, idle_timeout, mux_options] {
+				std::make_shared<SayHelloBidirServer>(service, cq, cq, &sessions, shard,
+																							idle_timeout)
+						->Start();
+				std::make_shared<SayHelloMuxServer>(service, cq, mux_options)->Start();
+				poller.Run(cq);
 			};
 		};
 
 		// The recommendation is for one thread per completion queue
 		std::vector<std::thread> ts;
-		for (auto &cq : cqs) {
-			ts.emplace_back(f(&service, cq.get()));
+		for (std::size_t i = 0; i < cqs.size(); ++i) {
+			ts.emplace_back(f(&service, cqs[i].get(), i));
 		}
 
-		std::string j;
-		std::cin >> j;
+		// "<session> <message>" sends to one client, "all <message>" sends to
+		// every client and anything else shuts down.
+		std::string line;
+		while (std::getline(std::cin, line)) {
+			std::istringstream is(line);
+			std::string to, message;
+			is >> to;
+			std::getline(is >> std::ws, message);
+			HelloReply reply;
+			reply.set_message(message);
+			auto write = [&](SayHelloBidirServer &session) { session.Write(reply); };
+			if (to == "all") {
+				sessions.ForEach(write);
+			} else if (!to.empty() &&
+								 std::all_of(to.begin(), to.end(), [](unsigned char c) {
+									 return std::isdigit(c);
+								 })) {
+				// Too many digits for an id is out of range rather than an exception.
+				std::uint64_t id = 0;
+				auto last = to.data() + to.size();
+				auto [end, error] = std::from_chars(to.data(), last, id);
+				if (error != std::errc() || end != last)
+					std::cout << "bad session " << to << std::endl;
+				else if (!sessions.With(id, write))
+					std::cout << "no session " << to << std::endl;
+			} else {
+				break;
+			}
+		}
 		// Server shutdown must be done before completion queue.
 		server->Shutdown();
 		// Initiate completion queue shutdowns.
@@ -218,12 +406,32 @@ public:
 		}
 
 		std::cout << "Finished" << std::endl;
+		if (poller.Instrumented())
+			poller.Report(std::cout);
+		std::cout << "Wasted work avoided: " << WastedWork::Get() << std::endl;
+		std::cout << "Reclaimed: " << ReclaimStats::Get() << std::endl;
 	}
 };
 
-int main() {
-	std::string server_address("0.0.0.0:50051");
-	ServerImpl server(server_address);
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	RecordFromFlags(flags);
+	// SIGUSR1 and SIGUSR2 toggle the CPU and heap profiles.
+	Profiler profiler(ProfilerOptionsFromFlags(flags));
+	profiler.HandleSignals();
+	// --trace=<file> writes a Chrome trace of one call in --trace-sample.
+	auto trace_file = flags.Get("trace", "");
+	if (!trace_file.empty()) {
+		Tracer::Get().Enable(flags.Get<std::uint64_t>("trace-sample", 1));
+	}
+	ServerImpl server(flags);
 	server.Run();
+	if (!trace_file.empty()) {
+		if (Tracer::Get().WriteFile(trace_file)) {
+			std::cout << "Trace written to " << trace_file << std::endl;
+		} else {
+			std::cout << "Couldn't write trace to " << trace_file << std::endl;
+		}
+	}
 	return 0;
 }
\ No newline at end of file
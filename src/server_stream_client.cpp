@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <windows.h>
 
@@ -9,7 +13,14 @@
 
 #include "helloworld.grpc.pb.h"
 
+#include "aggregate.hpp"
+#include "async_call.hpp"
+#include "chunked.hpp"
 #include "common.hpp"
+#include "deadline.hpp"
+#include "flags.hpp"
+#include "poller.hpp"
+#include "recording.hpp"
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -18,69 +29,144 @@ using grpc::Status;
 using helloworld::Greeter;
 using helloworld::HelloReply;
 using helloworld::HelloRequest;
+using helloworld::UploadChunk;
+using helloworld::UploadReply;
 
-class SayHellosClientStreamServer
-		: public std::enable_shared_from_this<SayHellosClientStreamServer> {
+/// SayHellosClient, served by AsyncCall: replies with every name it was sent.
+class SayHellosClient {
 public:
-	SayHellosClientStreamServer(helloworld::Greeter::AsyncService *service,
-															grpc::ServerCompletionQueue *cq)
-			: service(service), cq(cq), stream(&context) {}
+	Status OnRead(HelloRequest const &request) {
+		Recorder::Get().Record(RecordedMethod::SayHellosClient, call, request);
+		std::cout << "read: " << request.name() << std::endl;
+		names += request.name();
+		return Status::OK;
+	}
+	Status OnReadsDone(HelloReply &reply) {
+		reply.set_message("You sent: " + names);
+		return Status::OK;
+	}
+
+private:
+	std::string names;
+	/// Id of the call in the recording, if requests are recorded.
+	std::uint64_t call = 0;
+};
+
+/// Limits on uploads and where they go.
+struct UploadOptions {
+	/// Largest upload written to dir.
+	std::uint64_t max_size = std::uint64_t(4) << 30;
+	/// Largest upload kept in memory, when there's no dir.
+	std::uint64_t max_buffered_size = 64 << 20;
+	std::uint64_t max_chunk_size = 1 << 20;
+	/// Uploads are written to files here if set, otherwise they're kept in
+	/// memory until they've been checked.
+	std::string dir;
+
+	/// Largest upload accepted, depending on where it goes.
+	std::uint64_t MaxSize() const {
+		return dir.empty() ? std::min(max_size, max_buffered_size) : max_size;
+	}
+};
+
+/// Receives an Upload one chunk at a time. Only the current chunk is held
+/// unless the upload is kept in memory.
+class UploadServer : public std::enable_shared_from_this<UploadServer> {
+public:
+	UploadServer(helloworld::Greeter::AsyncService *service,
+							 grpc::ServerCompletionQueue *cq, UploadOptions const &options)
+			: service(service), cq(cq), options(options), stream(&context),
+				assembler(MakeSink(options), options.MaxSize(),
+									options.max_chunk_size) {}
 	void Start() {
 		context.AsyncNotifyWhenDone(OnDone());
-		service->RequestSayHellosClient(&context, &stream, cq, cq, OnCreate());
+		service->RequestUpload(&context, &stream, cq, cq, OnCreate());
 	}
 	Handler *OnCreate() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"Upload.OnCreate"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
 			if (ok) {
-				std::make_shared<SayHellosClientStreamServer>(service, cq)->Start();
+				std::make_shared<UploadServer>(service, cq, options)->Start();
+				context.AddInitialMetadata(kMaxChunkSizeKey,
+																	 std::to_string(options.max_chunk_size));
+				context.AddInitialMetadata(kMaxUploadSizeKey,
+																	 std::to_string(options.MaxSize()));
 				stream.SendInitialMetadata(OnSendInitialMetadata());
 			}
 		});
 	}
 	Handler *OnSendInitialMetadata() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"Upload.OnSendInitialMetadata"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
 			if (ok) {
-				stream.Read(&request, OnReadMessage());
+				Read();
 			}
 		});
 	}
 	Handler *OnReadMessage() {
-		return new Handler([this, me = shared_from_this()](bool ok) {
+		TraceTag tag{"Upload.OnReadMessage"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
 			if (ok) {
-				auto m = request.name();
-				std::cout << "read: " << m << std::endl;
-				msgs.emplace_back(std::move(m));
-				stream.Read(&request, OnReadMessage());
-			} else {
+				if (auto status = assembler.Add(chunk); !status.ok()) {
+					std::cout << "Upload failed: " << status.error_message()
+										<< std::endl;
+					stream.FinishWithError(status, OnFinish());
+					return;
+				}
+				Read();
+			} else if (!done) {
 				// ReadDone
-				std::string r = "You sent: ";
-				for (auto &&m : msgs) {
-					r += m;
+				UploadReply reply;
+				auto status = assembler.End(&reply);
+				std::cout << "Upload of " << reply.received() << " bytes crc32 "
+									<< std::hex << reply.crc32() << std::dec << ": "
+									<< (status.ok() ? "ok" : status.error_message())
+									<< std::endl;
+				if (status.ok()) {
+					stream.Finish(reply, status, OnFinish());
+				} else {
+					stream.FinishWithError(status, OnFinish());
 				}
-				HelloReply reply;
-				reply.set_message(r);
-				stream.Finish(reply, grpc::Status::OK, OnFinish());
 			}
 		});
 	}
 	Handler *OnFinish() {
-		return new Handler([me = shared_from_this()](bool ok) {
-			std::cout << "SayHellosClient Finish" << std::endl;
-		});
+		TraceTag tag{"Upload.OnFinish"};
+		return new Handler(tag, [me = shared_from_this()](bool ok) {});
 	}
 	Handler *OnDone() {
-		return new Handler([me = shared_from_this()](bool ok) {
-			std::cout << "SayHellosClient Done" << std::endl;
+		TraceTag tag{"Upload.OnDone"};
+		return new Handler(tag, [this, me = shared_from_this()](bool ok) {
+			done = true;
 		});
 	}
 
+private:
+	static std::unique_ptr<UploadSink> MakeSink(UploadOptions const &options) {
+		if (options.dir.empty())
+			return std::make_unique<BufferSink>();
+		static std::atomic<int> uploads{0};
+		return std::make_unique<FileSink>(options.dir + "/upload-" +
+																			std::to_string(uploads++));
+	}
+	void Read() {
+		if (done) {
+			++WastedWork::Get().reads_skipped;
+			return;
+		}
+		stream.Read(&chunk, OnReadMessage());
+	}
+
 private:
 	ServerContext context;
 	helloworld::Greeter::AsyncService *service;
 	grpc::ServerCompletionQueue *cq;
-	grpc::ServerAsyncReader<HelloReply, helloworld::HelloRequest> stream;
-	HelloRequest request;
-	std::vector<std::string> msgs;
+	UploadOptions const &options;
+	grpc::ServerAsyncReader<UploadReply, UploadChunk> stream;
+	/// Reused for every chunk so its buffer is only allocated once.
+	UploadChunk chunk;
+	ChunkAssembler assembler;
+	std::atomic<bool> done{false};
 };
 
 class ServerImpl {
@@ -88,13 +174,37 @@ class ServerImpl {
 	helloworld::Greeter::AsyncService service;
 	std::unique_ptr<Server> server;
 	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+	Poller poller;
+	UploadOptions upload_options;
+	/// SayHellosClient streams are aggregated by whichever of these is set.
+	std::unique_ptr<AggregationEngine<Totals>> totals;
+	std::unique_ptr<AggregationEngine<NameCounts>> name_counts;
 
 public:
-	ServerImpl(std::string server_address) : server_address(server_address) {}
+	ServerImpl(std::string server_address, PollerOptions poller_options = {},
+						 UploadOptions upload_options = {})
+			: server_address(server_address), poller(poller_options),
+				upload_options(upload_options) {}
+	/// Aggregates SayHellosClient streams instead of replying with their names.
+	/// @param aggregate totals or names
+	/// @return false if there's no such aggregate
+	bool Aggregate(std::string const &aggregate, AggregationOptions options) {
+		if (aggregate == "totals") {
+			totals = std::make_unique<AggregationEngine<Totals>>(options);
+		} else if (aggregate == "names") {
+			name_counts = std::make_unique<AggregationEngine<NameCounts>>(options);
+		} else {
+			return false;
+		}
+		return true;
+	}
 	void Run(int num_threads = 1) {
 		ServerBuilder builder;
 		builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
 		builder.RegisterService(&service);
+		// Room for the largest chunk allowed.
+		builder.SetMaxReceiveMessageSize(static_cast<int>(std::max<std::uint64_t>(
+				4 << 20, upload_options.max_chunk_size + (64 << 10))));
 		for (auto i = 0; i < num_threads; ++i) {
 			cqs.emplace_back(builder.AddCompletionQueue());
 		}
@@ -102,11 +212,16 @@ public:
 		std::cout << "Server listening on " << server_address << std::endl;
 
 		std::vector<std::thread> threads;
-		for (auto &&cq : cqs) {
-			threads.emplace_back([this, cq = cq.get()] { HandleRpcs(cq); });
+		for (std::size_t i = 0; i < cqs.size(); ++i) {
+			threads.emplace_back(
+					[this, cq = cqs[i].get(), i] { HandleRpcs(cq, i); });
+		}
+		// "aggregate" prints what's been aggregated so far, anything else shuts
+		// down.
+		std::string command;
+		while (std::cin >> command && command == "aggregate") {
+			PrintAggregate();
 		}
-		std::string j;
-		std::cin >> j;
 		server->Shutdown();
 		for (auto &&cq : cqs) {
 			cq->Shutdown();
@@ -116,22 +231,69 @@ public:
 			t.join();
 		}
 		std::cout << "Server shutdown on " << server_address << std::endl;
+		if (poller.Instrumented())
+			poller.Report(std::cout);
+		std::cout << "Wasted work avoided: " << WastedWork::Get() << std::endl;
+		PrintAggregate();
 	}
 
 private:
-	void HandleRpcs(grpc::ServerCompletionQueue *cq) {
-		std::make_shared<SayHellosClientStreamServer>(&service, cq)->Start();
-		void *tag;
-		bool ok;
-		while (cq->Next(&tag, &ok)) {
-			static_cast<Handler *>(tag)->Proceed(ok);
+	void HandleRpcs(grpc::ServerCompletionQueue *cq, std::size_t shard) {
+		constexpr auto method = &Greeter::AsyncService::RequestSayHellosClient;
+		if (totals) {
+			Listen<method, AggregateSayHellosClient<Totals>>(&service, cq,
+																												totals.get(), shard);
+		} else if (name_counts) {
+			Listen<method, AggregateSayHellosClient<NameCounts>>(
+					&service, cq, name_counts.get(), shard);
+		} else {
+			Listen<method, SayHellosClient>(&service, cq);
+		}
+		std::make_shared<UploadServer>(&service, cq, upload_options)->Start();
+		poller.Run(cq);
+	}
+	void PrintAggregate() {
+		if (totals) {
+			std::cout << "Aggregated ";
+			Totals::Describe(totals->Snapshot(), std::cout);
+			std::cout << std::endl;
+		} else if (name_counts) {
+			std::cout << "Aggregated ";
+			NameCounts::Describe(name_counts->Snapshot(), std::cout);
+			std::cout << std::endl;
 		}
 	}
 };
 
-int main() {
-	std::string server_address("0.0.0.0:50051");
-	ServerImpl server(server_address);
-	server.Run(4);
+int main(int argc, char **argv) {
+	Flags flags(argc, argv);
+	RecordFromFlags(flags);
+	UploadOptions upload_options;
+	upload_options.max_size =
+			flags.Get<std::uint64_t>("max-upload-mb", upload_options.max_size >> 20)
+			<< 20;
+	upload_options.max_buffered_size =
+			flags.Get<std::uint64_t>("max-buffered-upload-mb",
+															 upload_options.max_buffered_size >> 20)
+			<< 20;
+	upload_options.max_chunk_size =
+			flags.Get<std::uint64_t>("max-chunk-kb",
+															 upload_options.max_chunk_size >> 10)
+			<< 10;
+	upload_options.dir = flags.Get("upload-dir", "");
+	ServerImpl server(flags.Get("address", "0.0.0.0:50051"),
+										PollerOptionsFromFlags(flags), upload_options);
+	auto threads = flags.Get("threads", 4);
+	if (auto aggregate = flags.Get("aggregate", ""); !aggregate.empty()) {
+		AggregationOptions options;
+		options.shards = flags.Get<std::size_t>("aggregate-shards", threads);
+		options.flush_every =
+				flags.Get<std::size_t>("aggregate-flush", options.flush_every);
+		if (!server.Aggregate(aggregate, options)) {
+			std::cerr << "--aggregate is totals or names" << std::endl;
+			return 1;
+		}
+	}
+	server.Run(threads);
 	return 0;
 }
\ No newline at end of file
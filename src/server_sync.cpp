@@ -6,9 +6,14 @@
 #include <windows.h>
 
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/resource_quota.h>
 
 #include "helloworld.grpc.pb.h"
 
+#include "deadline.hpp"
+#include "flags.hpp"
+#include "recording.hpp"
+
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
@@ -20,35 +25,89 @@ using helloworld::HelloRequest;
 class GreeterServiceImpl final : public Greeter::Service {
   Status SayHello(ServerContext *context, const HelloRequest *request,
                   HelloReply *reply) override {
+    Recorder::Get().Record(RecordedMethod::SayHello, *request);
+    // IsCancelled() is always safe to call from the sync api.
+    if (context->IsCancelled()) {
+      ++WastedWork::Get().cancelled;
+      return Status(grpc::StatusCode::CANCELLED, "cancelled");
+    }
+    if (Expired(*context)) {
+      ++WastedWork::Get().expired;
+      return Status(grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded");
+    }
     std::string prefix("Hello ");
     reply->set_message(prefix + request->name());
     return Status::OK;
   }
 };
 
+/// Threading of the sync server. Anything left at -1 is whatever gRPC picks,
+/// which is also what the other settings of 0 or less mean.
+struct SyncServerOptions {
+  /// Completion queues the server polls for new calls.
+  int num_cqs = -1;
+  /// Threads per completion queue kept polling for new calls. 0 is a valid
+  /// setting, only -1 leaves it to gRPC.
+  int min_pollers = -1;
+  /// Most threads per completion queue polling at once.
+  int max_pollers = -1;
+  /// How long an idle poller waits before checking whether it should exit.
+  int cq_timeout_ms = -1;
+  /// Most threads the server may create in total, pollers and calls alike.
+  int max_threads = -1;
+};
+
 class ServerImpl {
 private:
   std::string server_address;
   GreeterServiceImpl service;
   std::unique_ptr<Server> server;
+  SyncServerOptions options;
 
 public:
-  ServerImpl(std::string server_address)
-      : server_address(std::move(server_address)) {}
+  ServerImpl(std::string server_address, SyncServerOptions options = {})
+      : server_address(std::move(server_address)), options(options) {}
 
 public:
   void Run() {
     ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
+    if (options.num_cqs > 0)
+      builder.SetSyncServerOption(ServerBuilder::SyncServerOption::NUM_CQS,
+                                  options.num_cqs);
+    if (options.min_pollers >= 0)
+      builder.SetSyncServerOption(
+          ServerBuilder::SyncServerOption::MIN_POLLERS, options.min_pollers);
+    if (options.max_pollers > 0)
+      builder.SetSyncServerOption(
+          ServerBuilder::SyncServerOption::MAX_POLLERS, options.max_pollers);
+    if (options.cq_timeout_ms > 0)
+      builder.SetSyncServerOption(
+          ServerBuilder::SyncServerOption::CQ_TIMEOUT_MSEC,
+          options.cq_timeout_ms);
+    // Calls get a thread each so this also limits concurrent calls. Calls over
+    // the limit fail with RESOURCE_EXHAUSTED.
+    grpc::ResourceQuota quota("server_sync");
+    if (options.max_threads > 0) {
+      quota.SetMaxThreads(options.max_threads);
+      builder.SetResourceQuota(quota);
+    }
     server = builder.BuildAndStart();
     std::cout << "Server listening on " << server_address << std::endl;
     server->Wait();
   }
 };
-int main() {
-  std::string server_address("0.0.0.0:50051");
-  ServerImpl server(server_address);
+int main(int argc, char **argv) {
+  Flags flags(argc, argv);
+  RecordFromFlags(flags);
+  SyncServerOptions options;
+  options.num_cqs = flags.Get("num-cqs", -1);
+  options.min_pollers = flags.Get("min-pollers", -1);
+  options.max_pollers = flags.Get("max-pollers", -1);
+  options.cq_timeout_ms = flags.Get("cq-timeout-ms", -1);
+  options.max_threads = flags.Get("max-threads", -1);
+  ServerImpl server(flags.Get("address", "0.0.0.0:50051"), options);
   server.Run();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Finds live calls by id so that other parts of the program can push
+/// messages into them.
+///
+/// Calls are split into shards, usually one per completion queue, and each
+/// shard has its own lock so there's no global lock. The shard is part of the
+/// id so a lookup only ever touches one shard.
+///
+/// Only weak references are kept. The registry never keeps a call alive and
+/// the call should Remove() itself in OnDone.
+template <typename Session> class SessionRegistry {
+public:
+	using Id = std::uint64_t;
+
+	explicit SessionRegistry(std::size_t num_shards) : shards(num_shards) {}
+
+	/// @param shard Usually the index of the completion queue of the call
+	/// @return Id of the session, unique for the life of the registry
+	Id Add(std::size_t shard, std::weak_ptr<Session> session) {
+		shard %= shards.size();
+		auto &s = shards[shard];
+		std::lock_guard l{s.mutex};
+		Id id = s.next++ * shards.size() + shard;
+		s.sessions.emplace(id, std::move(session));
+		return id;
+	}
+	void Remove(Id id) {
+		auto &s = shards[id % shards.size()];
+		std::lock_guard l{s.mutex};
+		s.sessions.erase(id);
+	}
+
+	/// Calls f with the session if it's still registered and alive.
+	///
+	/// The session is only kept alive while f runs and the shard isn't locked
+	/// then, so f can take its time. The session may be finishing while f runs
+	/// so its methods have to cope with that.
+	///
+	/// @return Whether f was called
+	template <typename F> bool With(Id id, F &&f) {
+		std::shared_ptr<Session> session;
+		{
+			auto &s = shards[id % shards.size()];
+			std::lock_guard l{s.mutex};
+			auto it = s.sessions.find(id);
+			if (it == s.sessions.end())
+				return false;
+			session = it->second.lock();
+		}
+		if (!session)
+			return false;
+		f(*session);
+		return true;
+	}
+
+	/// Calls f with every live session, one shard at a time.
+	template <typename F> void ForEach(F &&f) {
+		std::vector<std::shared_ptr<Session>> live;
+		for (auto &s : shards) {
+			{
+				std::lock_guard l{s.mutex};
+				for (auto &&[id, weak] : s.sessions) {
+					if (auto session = weak.lock())
+						live.push_back(std::move(session));
+				}
+			}
+			for (auto &session : live) {
+				f(*session);
+			}
+			live.clear();
+		}
+	}
+
+	std::size_t Size() {
+		std::size_t size = 0;
+		for (auto &s : shards) {
+			std::lock_guard l{s.mutex};
+			size += s.sessions.size();
+		}
+		return size;
+	}
+
+private:
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<Id, std::weak_ptr<Session>> sessions;
+		Id next = 0;
+	};
+	std::vector<Shard> shards;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+/// Collects latency samples from any number of threads and reports
+/// percentiles. Used by the benchmarks.
+class LatencyRecorder {
+public:
+	void Record(std::chrono::nanoseconds latency) {
+		std::lock_guard l{mutex};
+		samples.push_back(latency);
+		sorted = false;
+	}
+	void Clear() {
+		std::lock_guard l{mutex};
+		samples.clear();
+	}
+	std::size_t Count() {
+		std::lock_guard l{mutex};
+		return samples.size();
+	}
+	/// Latency below which p (0 to 1) of the samples fall.
+	std::chrono::nanoseconds Percentile(double p) {
+		std::lock_guard l{mutex};
+		return PercentileLocked(p);
+	}
+	friend std::ostream &operator<<(std::ostream &os, LatencyRecorder &r) {
+		using us = std::chrono::duration<double, std::micro>;
+		std::lock_guard l{r.mutex};
+		return os << "n: " << r.samples.size()
+							<< " p50: " << us(r.PercentileLocked(0.5)).count()
+							<< "us p90: " << us(r.PercentileLocked(0.9)).count()
+							<< "us p99: " << us(r.PercentileLocked(0.99)).count()
+							<< "us p999: " << us(r.PercentileLocked(0.999)).count()
+							<< "us max: " << us(r.PercentileLocked(1)).count() << "us";
+	}
+
+private:
+	std::chrono::nanoseconds PercentileLocked(double p) {
+		if (samples.empty())
+			return {};
+		if (!sorted) {
+			std::sort(samples.begin(), samples.end());
+			sorted = true;
+		}
+		auto i = static_cast<std::size_t>(p * (samples.size() - 1) + 0.5);
+		return samples[std::min(i, samples.size() - 1)];
+	}
+
+	std::mutex mutex;
+	std::vector<std::chrono::nanoseconds> samples;
+	bool sorted = false;
+};
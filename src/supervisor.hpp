@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+struct SupervisorOptions {
+	/// Worker processes kept running.
+	int workers = 1;
+	/// How long a new worker has to say it's ready before it's killed.
+	std::chrono::milliseconds ready_timeout{10000};
+	/// How long a worker being stopped gets to finish its calls before it's
+	/// killed.
+	std::chrono::milliseconds drain_timeout{10000};
+};
+
+/// Runs a server in several worker processes that share its port, so the load
+/// is spread over more than one gRPC core. The workers listen with
+/// GRPC_ARG_ALLOW_REUSEPORT and the kernel hands each new connection to one of
+/// them.
+///
+/// A worker is a function run in a forked child. It calls ready once it's
+/// listening and returns its exit code after SIGTERM, finishing the calls it
+/// has. Workers that exit on their own are started again.
+///
+/// SIGHUP restarts the workers one at a time without refusing connections:
+/// the new worker starts listening before the old one is stopped, and the old
+/// one drains its calls. SIGINT and SIGTERM stop every worker and return.
+/// SIGUSR1 and SIGUSR2 are passed on to every worker.
+///
+/// Forking only copies the calling thread, so the supervisor has to start the
+/// workers before the process uses gRPC or starts threads. Needs fork and
+/// SO_REUSEPORT, on Windows the worker runs in this process instead.
+class Supervisor {
+public:
+	using Worker = std::function<int(int index, std::function<void()> ready)>;
+
+	Supervisor(SupervisorOptions options, Worker worker)
+			: options(options), worker(std::move(worker)) {}
+	~Supervisor() { Stop(); }
+
+	/// Starts every worker and waits for them to be ready.
+	/// @return false if one of them didn't start
+	bool Start();
+	/// Restarts every worker one at a time.
+	/// @return false if a new worker didn't start, which leaves the old one
+	bool Restart();
+	/// Stops every worker and waits for them to exit.
+	void Stop();
+	/// Start, then keep the workers running until SIGINT or SIGTERM, restarting
+	/// them on SIGHUP.
+	/// @return Exit code for the supervisor
+	int Run();
+
+private:
+#ifndef _WIN32
+	/// Forks worker index and waits for it to be ready.
+	/// @return Its pid, or -1 if it didn't start
+	pid_t Spawn(int index);
+	/// Sends SIGTERM to pid and waits for it to exit, killing it after the
+	/// drain timeout.
+	void Terminate(pid_t pid);
+
+	std::vector<pid_t> pids;
+#endif
+
+	SupervisorOptions options;
+	Worker worker;
+};
+
+namespace supervisor {
+inline std::atomic<bool> stop_requested{false};
+inline std::atomic<bool> restart_requested{false};
+/// Bit n set if signal n has come in and is still to be passed on.
+inline std::atomic<unsigned> forward_signals{0};
+extern "C" inline void RequestStop(int) { stop_requested = true; }
+extern "C" inline void RequestRestart(int) { restart_requested = true; }
+extern "C" inline void Forward(int signal) { forward_signals |= 1u << signal; }
+} // namespace supervisor
+
+#ifndef _WIN32
+
+inline bool Supervisor::Start() {
+	pids.assign(std::max(options.workers, 1), -1);
+	for (std::size_t i = 0; i < pids.size(); ++i) {
+		pids[i] = Spawn(static_cast<int>(i));
+		if (pids[i] < 0)
+			return false;
+	}
+	return true;
+}
+
+inline bool Supervisor::Restart() {
+	for (std::size_t i = 0; i < pids.size(); ++i) {
+		auto next = Spawn(static_cast<int>(i));
+		if (next < 0)
+			return false;
+		auto old = std::exchange(pids[i], next);
+		if (old > 0)
+			Terminate(old);
+	}
+	return true;
+}
+
+inline void Supervisor::Stop() {
+	for (auto pid : pids) {
+		if (pid > 0)
+			kill(pid, SIGTERM);
+	}
+	for (auto &pid : pids) {
+		if (pid > 0)
+			Terminate(pid);
+		pid = -1;
+	}
+}
+
+inline int Supervisor::Run() {
+	std::signal(SIGINT, supervisor::RequestStop);
+	std::signal(SIGTERM, supervisor::RequestStop);
+	std::signal(SIGHUP, supervisor::RequestRestart);
+	// Passed on to the workers, for their profilers (see profiler.hpp).
+	std::signal(SIGUSR1, supervisor::Forward);
+	std::signal(SIGUSR2, supervisor::Forward);
+	if (!Start()) {
+		Stop();
+		return 1;
+	}
+	while (!supervisor::stop_requested) {
+		if (supervisor::restart_requested.exchange(false)) {
+			std::cout << "Restarting workers" << std::endl;
+			if (!Restart())
+				std::cout << "A new worker didn't start, kept the old one" << std::endl;
+		}
+		auto forward = supervisor::forward_signals.exchange(0);
+		for (auto signal : {SIGUSR1, SIGUSR2}) {
+			if (!(forward & (1u << signal)))
+				continue;
+			for (auto pid : pids) {
+				if (pid > 0)
+					kill(pid, signal);
+			}
+		}
+		// Workers that died are started again. One that can't start is tried
+		// again next time around.
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			auto it = std::find(pids.begin(), pids.end(), pid);
+			if (it == pids.end())
+				continue;
+			auto index = static_cast<int>(it - pids.begin());
+			std::cout << "Worker " << index << " (pid " << pid << ") exited with "
+								<< (WIFEXITED(status) ? WEXITSTATUS(status)
+																			: 128 + WTERMSIG(status))
+								<< ", starting it again" << std::endl;
+			*it = Spawn(index);
+		}
+		for (std::size_t i = 0; i < pids.size(); ++i) {
+			if (pids[i] < 0)
+				pids[i] = Spawn(static_cast<int>(i));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	Stop();
+	return 0;
+}
+
+inline pid_t Supervisor::Spawn(int index) {
+	int fds[2];
+	if (pipe(fds) != 0)
+		return -1;
+	// Or the child writes out what's buffered here too.
+	std::cout << std::flush;
+	auto pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		std::signal(SIGINT, SIG_DFL);
+		std::signal(SIGTERM, SIG_DFL);
+		std::signal(SIGHUP, SIG_DFL);
+		std::signal(SIGUSR1, SIG_DFL);
+		std::signal(SIGUSR2, SIG_DFL);
+		auto ready = [fd = fds[1]] {
+			char byte = 1;
+			if (write(fd, &byte, 1) != 1)
+				std::cerr << "worker couldn't report it's ready" << std::endl;
+		};
+		auto code = worker(index, ready);
+		std::cout << std::flush;
+		// Skips the supervisor's own exit handlers and static destructors.
+		_exit(code);
+	}
+	close(fds[1]);
+	pollfd fd{fds[0], POLLIN, 0};
+	char byte = 0;
+	auto deadline = std::chrono::steady_clock::now() + options.ready_timeout;
+	// Signals for the profilers or another SIGHUP interrupt poll, which isn't
+	// restarted, so it goes on waiting for the rest of the timeout.
+	int polled;
+	do {
+		auto left = std::chrono::ceil<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now());
+		auto timeout = static_cast<int>(std::max<long long>(left.count(), 0));
+		polled = poll(&fd, 1, timeout);
+	} while (polled < 0 && errno == EINTR);
+	// A worker that exits first closes the pipe without writing anything.
+	auto started = polled == 1 && read(fds[0], &byte, 1) == 1;
+	close(fds[0]);
+	if (!started) {
+		std::cout << "Worker " << index << " (pid " << pid << ") didn't start"
+							<< std::endl;
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+		return -1;
+	}
+	std::cout << "Worker " << index << " (pid " << pid << ") ready" << std::endl;
+	return pid;
+}
+
+inline void Supervisor::Terminate(pid_t pid) {
+	kill(pid, SIGTERM);
+	auto deadline = std::chrono::steady_clock::now() + options.drain_timeout;
+	while (waitpid(pid, nullptr, WNOHANG) == 0) {
+		if (std::chrono::steady_clock::now() >= deadline) {
+			std::cout << "Worker (pid " << pid << ") didn't drain in time, killing it"
+								<< std::endl;
+			kill(pid, SIGKILL);
+			waitpid(pid, nullptr, 0);
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+#else
+
+inline bool Supervisor::Start() { return false; }
+inline bool Supervisor::Restart() { return false; }
+inline void Supervisor::Stop() {}
+inline int Supervisor::Run() {
+	std::cout << "Worker processes need fork and SO_REUSEPORT, running one "
+							 "worker in this process"
+						<< std::endl;
+	return worker(0, [] {});
+}
+
+#endif
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/// Hierarchical timing wheel.
+///
+/// Time is counted in ticks. Each level has 256 slots and a slot of a level
+/// covers a whole turn of the level below. Scheduling and cancelling are O(1):
+/// a timer goes straight into the slot of the level that covers its expiry and
+/// drops down a level each time the level below wraps round to it.
+///
+/// Not thread safe, each polling thread has its own wheel.
+class TimerWheel {
+	static constexpr std::size_t kBits = 8;
+	static constexpr std::size_t kSlots = std::size_t(1) << kBits;
+	static constexpr std::size_t kLevels = 4;
+
+	struct Link {
+		Link *prev = this;
+		Link *next = this;
+		bool Empty() const { return next == this; }
+	};
+	struct Node : Link {
+		std::uint64_t expiry = 0;
+		/// Bumped when the node is reused so stale handles can be told apart.
+		std::uint64_t generation = 0;
+		std::size_t level = 0;
+		bool scheduled = false;
+		std::function<void()> callback;
+	};
+
+public:
+	/// Refers to a scheduled timer. Stays safe to cancel after the timer fired.
+	struct Handle {
+		Node *node = nullptr;
+		std::uint64_t generation = 0;
+	};
+
+	explicit TimerWheel(std::uint64_t now = 0) : current(now) {}
+	TimerWheel(TimerWheel const &) = delete;
+	TimerWheel &operator=(TimerWheel const &) = delete;
+
+	/// Calls callback from Advance once tick expiry is reached. Expiries that
+	/// have already passed fire on the next tick.
+	Handle Schedule(std::uint64_t expiry, std::function<void()> callback) {
+		auto node = Allocate();
+		node->expiry = std::max(expiry, current + 1);
+		node->callback = std::move(callback);
+		Insert(node);
+		++count;
+		return {node, node->generation};
+	}
+	/// @return Whether the timer was still scheduled
+	bool Cancel(Handle handle) {
+		auto node = handle.node;
+		if (!node || node->generation != handle.generation || !node->scheduled)
+			return false;
+		Unlink(node);
+		Free(node);
+		--count;
+		return true;
+	}
+
+	/// Fires every timer that expires at or before tick now.
+	void Advance(std::uint64_t now) {
+		while (current < now) {
+			// Nothing happens before the lowest level with timers in it next moves
+			// on, so skip to that.
+			if (!level_counts[0]) {
+				auto next = NextBoundary();
+				if (next > now) {
+					current = now;
+					return;
+				}
+				current = next - 1;
+			}
+			++current;
+			// Move timers down from each level whose slot has just come round.
+			for (std::size_t level = 1; level < kLevels; ++level) {
+				if (current & ((std::uint64_t(1) << (level * kBits)) - 1))
+					break;
+				Cascade(slots[level][SlotOf(level, current)]);
+			}
+			Fire(slots[0][current & (kSlots - 1)]);
+		}
+	}
+
+	/// @return Ticks until Advance could next fire something. Exact for timers
+	/// in the bottom level, otherwise when the next of them could move down into
+	/// it. Max if nothing is scheduled.
+	std::uint64_t TicksUntilNext() const {
+		if (!count)
+			return std::numeric_limits<std::uint64_t>::max();
+		if (!level_counts[0])
+			return NextBoundary() - current;
+		auto wrap = kSlots - (current & (kSlots - 1));
+		for (std::uint64_t t = 1; t < wrap; ++t) {
+			if (!slots[0][(current + t) & (kSlots - 1)].Empty())
+				return t;
+		}
+		return wrap;
+	}
+
+	std::uint64_t Now() const { return current; }
+	std::size_t Size() const { return count; }
+
+private:
+	static std::size_t SlotOf(std::size_t level, std::uint64_t tick) {
+		return (tick >> (level * kBits)) & (kSlots - 1);
+	}
+
+	/// Next tick at which the lowest level with timers in it moves to its next
+	/// slot.
+	std::uint64_t NextBoundary() const {
+		std::size_t level = 1;
+		while (level + 1 < kLevels && !level_counts[level])
+			++level;
+		auto mask = (std::uint64_t(1) << (level * kBits)) - 1;
+		return (current | mask) + 1;
+	}
+
+	void Insert(Node *node) {
+		auto delta = node->expiry - current;
+		auto expiry = node->expiry;
+		std::size_t level = 0;
+		while (level + 1 < kLevels &&
+					 delta >= std::uint64_t(1) << ((level + 1) * kBits))
+			++level;
+		// Too far out even for the top level, park it in the furthest slot and
+		// place it again when that comes round.
+		if (delta >= std::uint64_t(1) << (kLevels * kBits))
+			expiry = current + (std::uint64_t(1) << (kLevels * kBits)) - 1;
+		auto &head = slots[level][SlotOf(level, expiry)];
+		node->prev = &head;
+		node->next = head.next;
+		head.next->prev = node;
+		head.next = node;
+		node->level = level;
+		node->scheduled = true;
+		++level_counts[level];
+	}
+	void Unlink(Node *node) {
+		node->prev->next = node->next;
+		node->next->prev = node->prev;
+		node->prev = node->next = node;
+		node->scheduled = false;
+		--level_counts[node->level];
+	}
+	void Cascade(Link &head) {
+		while (!head.Empty()) {
+			auto node = static_cast<Node *>(head.next);
+			Unlink(node);
+			Insert(node);
+		}
+	}
+	void Fire(Link &head) {
+		while (!head.Empty()) {
+			auto node = static_cast<Node *>(head.next);
+			Unlink(node);
+			--count;
+			auto callback = std::move(node->callback);
+			Free(node);
+			// May schedule or cancel other timers.
+			callback();
+		}
+	}
+
+	/// Nodes are reused so a steady state of timers doesn't allocate, apart from
+	/// what the callbacks themselves need.
+	Node *Allocate() {
+		if (free.empty()) {
+			nodes.push_back(std::make_unique<Node>());
+			return nodes.back().get();
+		}
+		auto node = free.back();
+		free.pop_back();
+		return node;
+	}
+	void Free(Node *node) {
+		++node->generation;
+		node->callback = nullptr;
+		free.push_back(node);
+	}
+
+	std::array<std::array<Link, kSlots>, kLevels> slots;
+	std::array<std::size_t, kLevels> level_counts{};
+	std::uint64_t current;
+	std::size_t count = 0;
+	std::vector<std::unique_ptr<Node>> nodes;
+	std::vector<Node *> free;
+};
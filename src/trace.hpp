@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Identifies a traced call. Zero means the call isn't traced.
+using TraceId = std::uint64_t;
+
+/// Names the operation a handler completes and the call it belongs to.
+struct TraceTag {
+	/// Must outlive the tracer, a string literal in practice.
+	char const *name = nullptr;
+	TraceId id = 0;
+};
+
+/// Collects timestamped spans for a sample of calls and writes them out in the
+/// Chrome trace event format, which chrome://tracing and ui.perfetto.dev open.
+///
+/// Each thread records into its own buffer so threads don't contend with each
+/// other. When tracing is disabled a call costs one relaxed load to find out it
+/// isn't sampled and a handler one branch.
+class Tracer {
+public:
+	static Tracer &Get() {
+		static Tracer tracer;
+		return tracer;
+	}
+
+	/// Call before any traced calls start.
+	/// @param sample_every Trace one call in this many
+	/// @param max_events Events kept per thread, later ones are dropped
+	void Enable(std::uint64_t sample_every = 1,
+							std::size_t max_events = std::size_t(1) << 20) {
+		this->sample_every = sample_every ? sample_every : 1;
+		this->max_events = max_events;
+		enabled = true;
+	}
+	void Disable() { enabled = false; }
+
+	/// Decides whether a new call is traced.
+	/// @return Id for the call's spans, 0 if it isn't traced
+	TraceId Sample() {
+		if (!enabled.load(std::memory_order_relaxed))
+			return 0;
+		auto n = calls.fetch_add(1, std::memory_order_relaxed);
+		return n % sample_every == 0 ? n + 1 : 0;
+	}
+
+	static std::int64_t Now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+							 std::chrono::steady_clock::now().time_since_epoch())
+				.count();
+	}
+
+	/// Records a handler: the operation was pending (in flight and then waiting
+	/// in the completion queue) from issued to start and the handler ran on this
+	/// thread from start to end.
+	void Record(TraceTag tag, std::int64_t issued, std::int64_t start,
+							std::int64_t end) {
+		auto &buffer = Local();
+		std::lock_guard l{buffer.mutex};
+		Add(buffer, {tag.name, tag.id, tag.id, issued, start, true});
+		Add(buffer, {tag.name, tag.id, tag.id, start, end, false});
+	}
+	/// Records a span that isn't tied to a thread, like time in a write queue.
+	/// Spans with the same name and track are shown on one row so they must not
+	/// overlap.
+	void RecordAsync(char const *name, TraceId call, std::uint64_t track,
+									 std::int64_t start, std::int64_t end) {
+		auto &buffer = Local();
+		std::lock_guard l{buffer.mutex};
+		Add(buffer, {name, call, track, start, end, true});
+	}
+
+	/// Writes everything recorded so far as Chrome trace JSON.
+	void Write(std::ostream &os) {
+		std::vector<std::shared_ptr<Buffer>> all;
+		{
+			std::lock_guard l{buffers_mutex};
+			all = buffers;
+		}
+		std::uint64_t dropped = 0;
+		bool first = true;
+		auto separator = [&]() -> std::ostream & {
+			os << (first ? "\n" : ",\n");
+			first = false;
+			return os;
+		};
+		// Microseconds with nanosecond precision, never in scientific notation.
+		auto flags = os.flags();
+		auto precision = os.precision(3);
+		os << std::fixed << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		for (auto &buffer : all) {
+			std::lock_guard l{buffer->mutex};
+			dropped += buffer->dropped;
+			separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+									<< "\"tid\":" << buffer->tid << ",\"args\":{\"name\":\""
+									<< "thread " << buffer->tid << "\"}}";
+			for (auto &e : buffer->events) {
+				if (e.async) {
+					// Nestable async events, one row per operation of a call.
+					auto async = [&](char ph, std::int64_t ts) {
+						separator() << "{\"name\":\"" << e.name << "\",\"cat\":\""
+												<< e.name << "\",\"ph\":\"" << ph << "\",\"id\":\"0x"
+												<< std::hex << e.track << std::dec
+												<< "\",\"pid\":1,\"tid\":" << buffer->tid
+												<< ",\"ts\":" << Micros(ts)
+												<< ",\"args\":{\"call\":" << e.call << "}}";
+					};
+					async('b', e.start);
+					async('e', e.end);
+				} else {
+					separator() << "{\"name\":\"" << e.name
+											<< "\",\"cat\":\"handler\",\"ph\":\"X\",\"pid\":1,"
+											<< "\"tid\":" << buffer->tid
+											<< ",\"ts\":" << Micros(e.start)
+											<< ",\"dur\":" << (e.end - e.start) / 1000.0
+											<< ",\"args\":{\"call\":" << e.call << "}}";
+				}
+			}
+		}
+		os << "\n],\"otherData\":{\"dropped\":" << dropped << "}}\n";
+		os.flags(flags);
+		os.precision(precision);
+	}
+	/// @return Whether the file was written
+	bool WriteFile(std::string const &path) {
+		std::ofstream file(path);
+		Write(file);
+		return static_cast<bool>(file);
+	}
+
+private:
+	struct Event {
+		char const *name;
+		TraceId call;
+		/// Row of an async event, usually the call.
+		std::uint64_t track;
+		std::int64_t start;
+		std::int64_t end;
+		bool async;
+	};
+	struct Buffer {
+		/// Only contended while the trace is written.
+		std::mutex mutex;
+		std::vector<Event> events;
+		std::uint64_t dropped = 0;
+		std::uint32_t tid = 0;
+	};
+
+	Tracer() : epoch(Now()) {}
+
+	/// Buffers are shared with the tracer so they outlive their thread.
+	Buffer &Local() {
+		thread_local std::shared_ptr<Buffer> buffer = [this] {
+			auto buffer = std::make_shared<Buffer>();
+			std::lock_guard l{buffers_mutex};
+			buffer->tid = static_cast<std::uint32_t>(buffers.size() + 1);
+			buffers.push_back(buffer);
+			return buffer;
+		}();
+		return *buffer;
+	}
+	void Add(Buffer &buffer, Event const &e) {
+		if (buffer.events.size() >= max_events) {
+			++buffer.dropped;
+			return;
+		}
+		buffer.events.push_back(e);
+	}
+	/// Timestamps are microseconds since the tracer started.
+	double Micros(std::int64_t ns) const { return (ns - epoch) / 1000.0; }
+
+	std::atomic<bool> enabled{false};
+	std::atomic<std::uint64_t> calls{0};
+	std::uint64_t sample_every = 1;
+	std::size_t max_events = std::size_t(1) << 20;
+	std::int64_t epoch;
+	std::mutex buffers_mutex;
+	std::vector<std::shared_ptr<Buffer>> buffers;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "helloworld.grpc.pb.h"
+
+#include "common.hpp"
+#include "stats.hpp"
+
+/// Shared by every call of one concurrency level.
+struct Load {
+	std::vector<std::unique_ptr<helloworld::Greeter::Stub>> const &stubs;
+	grpc::CompletionQueue *cq;
+	std::chrono::milliseconds timeout;
+	/// Only calls that finish while measuring are counted.
+	std::atomic<bool> measuring{false};
+	std::atomic<bool> stopping{false};
+	std::atomic<int> in_flight{0};
+	std::atomic<std::uint64_t> succeeded{0};
+	std::atomic<std::uint64_t> failed{0};
+	LatencyRecorder latencies;
+};
+
+/// Calls SayHello and starts the next call when it finishes, so each of these
+/// chains keeps one call in flight until the load stops.
+/// @param channel Index of the stub the chain uses
+inline void Issue(Load *load, std::size_t channel) {
+	if (load->stopping) {
+		--load->in_flight;
+		return;
+	}
+	struct Call {
+		grpc::ClientContext context;
+		helloworld::HelloReply reply;
+		grpc::Status status;
+		std::unique_ptr<grpc::ClientAsyncResponseReader<helloworld::HelloReply>>
+				reader;
+		std::chrono::steady_clock::time_point start;
+	};
+	auto call = std::make_shared<Call>();
+	helloworld::HelloRequest request;
+	request.set_name("world");
+	call->start = std::chrono::steady_clock::now();
+	call->context.set_deadline(std::chrono::system_clock::now() + load->timeout);
+	call->reader = load->stubs[channel]->PrepareAsyncSayHello(
+			&call->context, request, load->cq);
+	call->reader->StartCall();
+	call->reader->Finish(&call->reply, &call->status,
+											 new Handler([load, channel, call](bool ok) {
+												 if (load->measuring) {
+													 if (call->status.ok()) {
+														 ++load->succeeded;
+														 load->latencies.Record(
+																 std::chrono::steady_clock::now() - call->start);
+													 } else {
+														 ++load->failed;
+													 }
+												 }
+												 Issue(load, channel);
+											 }));
+}
+
+/// Stubs on channels of their own, so the load is spread over several
+/// connections.
+inline std::vector<std::unique_ptr<helloworld::Greeter::Stub>>
+MakeStubs(std::string const &address, int channels) {
+	std::vector<std::unique_ptr<helloworld::Greeter::Stub>> stubs;
+	for (auto i = 0; i < channels; ++i) {
+		grpc::ChannelArguments args;
+		args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+		args.SetInt("benchmark.channel", i);
+		stubs.emplace_back(helloworld::Greeter::NewStub(grpc::CreateCustomChannel(
+				address, grpc::InsecureChannelCredentials(), args)));
+	}
+	return stubs;
+}
+
+/// Keeps concurrency calls in flight over the load's stubs, measures for
+/// duration after warmup, then waits for the calls still in flight.
+/// @return Seconds measured
+inline double RunLoad(Load *load, int concurrency,
+											std::chrono::milliseconds warmup,
+											std::chrono::milliseconds duration) {
+	load->in_flight = concurrency;
+	for (auto i = 0; i < concurrency; ++i) {
+		Issue(load, i % load->stubs.size());
+	}
+	std::this_thread::sleep_for(warmup);
+	load->measuring = true;
+	auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(duration);
+	load->measuring = false;
+	auto elapsed =
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+					.count();
+	load->stopping = true;
+	while (load->in_flight) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return elapsed;
+}
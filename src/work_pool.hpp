@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Threads that help split work a caller would otherwise do alone.
+class WorkPool {
+public:
+	explicit WorkPool(int num_threads) {
+		for (auto i = 0; i < num_threads; ++i) {
+			threads.emplace_back([this] { Run(); });
+		}
+	}
+	WorkPool(WorkPool const &) = delete;
+	WorkPool &operator=(WorkPool const &) = delete;
+	~WorkPool() {
+		{
+			std::lock_guard l{mutex};
+			stopping = true;
+		}
+		work_added.notify_all();
+		for (auto &t : threads) {
+			t.join();
+		}
+	}
+
+	/// Calls f(begin, end) on parts of [0, n) of about grain each, and returns
+	/// once they're all done. The calling thread works on them too, so they get
+	/// done even when every thread of the pool is busy.
+	template <typename F>
+	void ParallelFor(std::size_t n, std::size_t grain, F f) {
+		grain = std::max<std::size_t>(grain, 1);
+		auto parts = (n + grain - 1) / grain;
+		if (parts <= 1 || threads.empty()) {
+			if (n)
+				f(0, n);
+			return;
+		}
+		// Helpers can start after every part is taken and the caller has
+		// returned, so they only get at f through a part they've taken.
+		auto job = std::make_shared<Job>();
+		job->parts = parts;
+		job->run = [&f, n, grain](std::size_t part) {
+			auto begin = part * grain;
+			f(begin, std::min(begin + grain, n));
+		};
+		{
+			std::lock_guard l{mutex};
+			auto helpers = std::min(parts - 1, threads.size());
+			for (std::size_t i = 0; i < helpers; ++i) {
+				queue.push_back(job);
+			}
+		}
+		work_added.notify_all();
+		job->Work();
+		std::unique_lock l{job->mutex};
+		job->all_done.wait(l, [&] { return job->done == job->parts; });
+	}
+	std::size_t Size() const { return threads.size(); }
+
+private:
+	struct Job {
+		/// Takes parts until there are none left.
+		void Work() {
+			std::size_t part;
+			while ((part = next.fetch_add(1, std::memory_order_relaxed)) < parts) {
+				run(part);
+				std::lock_guard l{mutex};
+				if (++done == parts)
+					all_done.notify_one();
+			}
+		}
+		std::size_t parts = 0;
+		std::function<void(std::size_t)> run;
+		std::atomic<std::size_t> next{0};
+		std::size_t done = 0;
+		std::mutex mutex;
+		std::condition_variable all_done;
+	};
+
+	void Run() {
+		for (;;) {
+			std::shared_ptr<Job> job;
+			{
+				std::unique_lock l{mutex};
+				work_added.wait(l, [&] { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+				job = std::move(queue.front());
+				queue.pop_front();
+			}
+			job->Work();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable work_added;
+	std::deque<std::shared_ptr<Job>> queue;
+	bool stopping = false;
+	std::vector<std::thread> threads;
+};